@@ -0,0 +1,343 @@
+/* bench-main.cpp
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host-side benchmarks. Nothing here needs hardware: the "stub" transport
+ * swallows writes and answers reads instantly, so it measures encoding
+ * cost alone, while the "emulator" transport adds the cost of parsing the
+ * MPSSE stream and clocking it through a simulated slave.
+ *
+ * Results are printed one JSON object per line so runs against different
+ * library versions can be compared mechanically.
+ */
+
+#include "ft2232h-spi/buffer-pool.h"
+#include "ft2232h-spi/command-buffer.h"
+#include "ft2232h-spi/ft2232h-spi.h"
+#include "ft2232h-spi/mpsse.h"
+#include "ft2232h-spi/mpsse-emulator.h"
+#include "ft2232h-spi/packet.h"
+#include "ft2232h-spi/spi-display.h"
+#include "ft2232h-spi/spi-flash.h"
+#include "ft2232h-spi/transport.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace ft2232h_spi;
+
+namespace {
+
+/*
+ * Accepts anything and always has reply data ready. The sync sequence at
+ * open time is answered properly; every other read is zero-filled.
+ */
+class stub_transport : public transport
+{
+public:
+    void write(const uint8_t * /* data */, size_t size) override
+    {
+        ++writes;
+        bytes += size;
+    }
+
+    size_t read(uint8_t *data, size_t size) override
+    {
+        size_t i = 0;
+        for (; i < size && !sync_reply.empty(); ++i) {
+            data[i] = sync_reply.front();
+            sync_reply.erase(sync_reply.begin());
+        }
+        memset(data + i, 0, size - i);
+        return size;
+    }
+
+    std::vector<uint8_t> sync_reply {
+        bad_opcode_reply, uint8_t(opcodes::bogus)
+    };
+    uint64_t writes = 0;
+    uint64_t bytes = 0;
+};
+
+struct device
+{
+    virtual ~device() { }
+    virtual uint64_t writes() const = 0;
+    virtual uint64_t bytes() const = 0;
+
+    std::unique_ptr<spi> dev;
+};
+
+struct stub_device : device
+{
+    stub_device() :
+        io(new stub_transport)
+    {
+        dev.reset(new spi { spi::dbus3, std::unique_ptr<transport> { io } });
+    }
+
+    uint64_t writes() const override { return io->writes; }
+    uint64_t bytes() const override { return io->bytes; }
+
+    stub_transport *io;
+};
+
+struct emulated_device : device
+{
+    emulated_device() :
+        io(new mpsse_emulator)
+    {
+        io->attach(spi::dbus3, std::make_shared<register_slave>());
+        dev.reset(new spi { spi::dbus3, std::unique_ptr<transport> { io } });
+    }
+
+    uint64_t writes() const override { return io->writes(); }
+    uint64_t bytes() const override { return io->bytesWritten(); }
+
+    mpsse_emulator *io;
+};
+
+double min_seconds = 0.25;
+const char *filter = nullptr;
+
+/*
+ * Run fn in growing rounds until min_seconds have passed and report the
+ * rate. payload is the number of SPI payload bytes each call moves and
+ * transactions the number of chip-select frames.
+ */
+void run(
+    const std::string& name, const char *transport_name, size_t payload,
+    size_t transactions, const device *dev, const std::function<void()>& fn)
+{
+    if (filter && name.find(filter) == std::string::npos) {
+        return;
+    }
+
+    typedef std::chrono::steady_clock clock;
+
+    fn();
+    uint64_t writes = dev ? dev->writes() : 0;
+    uint64_t bytes = dev ? dev->bytes() : 0;
+    uint64_t allocations = command_buffer::allocations();
+    uint64_t misses = dev ? dev->dev->buffers().misses() : 0;
+
+    uint64_t iterations = 0;
+    uint64_t round = 1;
+    auto start = clock::now();
+    double elapsed = 0;
+    while (elapsed < min_seconds) {
+        for (uint64_t i = 0; i < round; ++i) {
+            fn();
+        }
+        iterations += round;
+        round *= 2;
+        elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    }
+
+    double per_op = elapsed / iterations;
+    printf(
+        "{\"version\":\"%s\",\"benchmark\":\"%s\",\"transport\":\"%s\","
+        "\"payload_bytes\":%zu,\"transactions\":%zu,\"iterations\":%llu,"
+        "\"ns_per_op\":%.1f,\"transactions_per_sec\":%.1f,"
+        "\"payload_bytes_per_sec\":%.1f",
+        FT2232H_SPI_VERSION, name.c_str(), transport_name,
+        payload, transactions, (unsigned long long)iterations,
+        per_op * 1e9, transactions / per_op, payload / per_op
+    );
+    if (dev) {
+        printf(
+            ",\"usb_writes_per_op\":%.3f,\"usb_bytes_per_op\":%.1f",
+            double(dev->writes() - writes) / iterations,
+            double(dev->bytes() - bytes) / iterations
+        );
+        printf(
+            ",\"buffer_allocations_per_op\":%.3f"
+            ",\"pool_misses_per_op\":%.3f",
+            double(command_buffer::allocations() - allocations) / iterations,
+            double(dev->dev->buffers().misses() - misses) / iterations
+        );
+    }
+    printf("}\n");
+    fflush(stdout);
+}
+
+void packetBenchmarks()
+{
+    volatile uint32_t word = 0x11223344;
+    run("packet_construct", "none", 7, 0, nullptr, [&]() {
+        packet p { uint8_t(1), uint16_t(2), uint32_t(word) };
+        asm volatile("" : : "r"(p.data()) : "memory");
+    });
+
+    const packet a { uint32_t(1), uint32_t(2) };
+    const packet b { uint32_t(3), uint32_t(4) };
+    run("packet_append", "none", 16, 0, nullptr, [&]() {
+        packet p { a };
+        p.append(b);
+        asm volatile("" : : "r"(p.data()) : "memory");
+    });
+}
+
+void deviceBenchmarks(const char *transport_name, device& d)
+{
+    spi& dev = *d.dev;
+    const size_t sizes[] = { 1, 16, 256, 4096, 65536, 1 << 20 };
+    std::vector<uint8_t> tx(sizes[5], 0x5a);
+    std::vector<uint8_t> rx(sizes[5]);
+
+    for (auto size : sizes) {
+        run("transmit", transport_name, size, 1, &d, [&]() {
+            dev.transmit(tx.data(), size);
+        });
+    }
+
+    for (auto size : sizes) {
+        if (size > 65536) {
+            continue;
+        }
+        run("transfer", transport_name, size, 1, &d, [&]() {
+            dev.transfer(tx.data(), rx.data(), size);
+        });
+    }
+
+    /* Register-style traffic: short writes with the odd read-back. */
+    const size_t counts[] = { 1, 16, 200 };
+    for (auto count : counts) {
+        spi::batch writes;
+        spi::batch mixed;
+        uint8_t readback[4];
+        for (size_t i = 0; i < count; ++i) {
+            writes.transmit(packet { uint8_t(i & 0x7f), uint8_t(i) });
+            if (i % 4 == 3) {
+                mixed.select()
+                    .write(packet { uint8_t(0x80 | (i & 0x7f)) })
+                    .read(readback, sizeof(readback))
+                    .deselect();
+            } else {
+                mixed.transmit(packet { uint8_t(i & 0x7f), uint8_t(i) });
+            }
+        }
+
+        run("batch_writes", transport_name, 2 * count, count, &d, [&]() {
+            dev.execute(writes);
+        });
+        run("batch_mixed", transport_name, 2 * count, count, &d, [&]() {
+            dev.execute(mixed);
+        });
+    }
+
+    /* The same register writes issued one call at a time. */
+    run("register_writes", transport_name, 2 * 200, 200, &d, [&]() {
+        for (int i = 0; i < 200; ++i) {
+            dev.transmit(packet { uint8_t(i & 0x7f), uint8_t(i) });
+        }
+    });
+
+    run("transmit_async", transport_name, 4096 * 8, 8, &d, [&]() {
+        std::vector<std::future<void>> done;
+        for (int i = 0; i < 8; ++i) {
+            done.push_back(dev.transmitAsync(tx.data(), 4096));
+        }
+        for (auto& f : done) {
+            f.get();
+        }
+    });
+}
+
+/*
+ * Flash programming as encoded for a chip that is always ready, so the
+ * page program padding dominates the stream rather than round trips.
+ */
+void flashBenchmarks(const char *transport_name, device& d)
+{
+    spi_flash flash { *d.dev };
+    std::vector<uint8_t> image(65536, 0x5a);
+    size_t pages = image.size() / spi_flash::page_size;
+    run("flash_program", transport_name, image.size(), pages, &d, [&]() {
+        flash.program(0, image.data(), image.size());
+    });
+}
+
+/*
+ * Display pushes for a 320x240 RGB565 panel: a 16x16 sprite moving
+ * over a static background, and a full refresh every time.
+ */
+void displayBenchmarks(const char *transport_name, device& d)
+{
+    const uint16_t width = 320;
+    const uint16_t height = 240;
+    spi_display display { *d.dev, spi::adbus4, width, height };
+    std::vector<uint8_t> frame(size_t(width) * height * 2, 0);
+
+    uint16_t x = 0;
+    run("display_push_sprite", transport_name, 2 * 2 * 16 * 16, 1, &d, [&]() {
+        for (uint16_t y = 0; y < 16; ++y) {
+            memset(&frame[(y * width + x) * 2], 0, 32);
+        }
+        x = (x + 16) % width;
+        for (uint16_t y = 0; y < 16; ++y) {
+            memset(&frame[(y * width + x) * 2], 0xff, 32);
+        }
+        display.push(frame.data());
+    });
+
+    run("display_push_full", transport_name, frame.size(), 1, &d, [&]() {
+        display.invalidate();
+        display.push(frame.data());
+    });
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--min-time") && i + 1 < argc) {
+            min_seconds = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--filter") && i + 1 < argc) {
+            filter = argv[++i];
+        } else {
+            fprintf(
+                stderr,
+                "usage: %s [--min-time seconds] [--filter name]\n",
+                argv[0]
+            );
+            return 1;
+        }
+    }
+
+    packetBenchmarks();
+
+    {
+        stub_device d;
+        deviceBenchmarks("stub", d);
+        flashBenchmarks("stub", d);
+        displayBenchmarks("stub", d);
+    }
+    {
+        emulated_device d;
+        deviceBenchmarks("emulator", d);
+    }
+    return 0;
+}
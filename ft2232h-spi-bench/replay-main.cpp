@@ -0,0 +1,105 @@
+/* replay-main.cpp
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Replays a trace recorded with spi::startTrace(), either into the MPSSE
+ * emulator (to measure replay cost offline) or into a real adapter (to
+ * reproduce a problem), and prints the result as one JSON object.
+ */
+
+#include "ft2232h-spi/ft2232h-spi.h"
+#include "ft2232h-spi/mpsse-emulator.h"
+#include "ft2232h-spi/trace.h"
+#include "ft2232h-spi/transport.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+
+using namespace ft2232h_spi;
+
+namespace {
+
+int usage(const char *argv0)
+{
+    fprintf(
+        stderr,
+        "usage: %s trace-file [--realtime] [--device vid:pid[:bus]]\n"
+        "\n"
+        "Without --device the trace is replayed into the MPSSE emulator.\n"
+        "vid and pid are hex; bus is 1-4 for channels A-D.\n",
+        argv0
+    );
+    return 1;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = nullptr;
+    const char *device = nullptr;
+    auto speed = replay_speed::maximum;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--realtime")) {
+            speed = replay_speed::original;
+        } else if (!strcmp(argv[i], "--device") && i + 1 < argc) {
+            device = argv[++i];
+        } else if (argv[i][0] != '-' && !path) {
+            path = argv[i];
+        } else {
+            return usage(argv[0]);
+        }
+    }
+    if (!path) {
+        return usage(argv[0]);
+    }
+
+    try {
+        std::unique_ptr<transport> io;
+        if (device) {
+            unsigned vid = 0, pid = 0, bus = spi::bus_a;
+            if (sscanf(device, "%x:%x:%u", &vid, &pid, &bus) < 2) {
+                return usage(argv[0]);
+            }
+            endpoint ep { int(vid), int(pid), "", "", "" };
+            io = openTransport(ep, spi::busses(bus));
+        } else {
+            io.reset(new mpsse_emulator);
+        }
+
+        auto r = replay(path, *io, speed);
+        printf(
+            "{\"trace\":\"%s\",\"target\":\"%s\",\"speed\":\"%s\","
+            "\"writes\":%llu,\"reads\":%llu,\"bytes_written\":%llu,"
+            "\"bytes_read\":%llu,\"mismatches\":%llu,\"seconds\":%.6f,"
+            "\"write_bytes_per_sec\":%.1f}\n",
+            path, device ? device : "emulator",
+            speed == replay_speed::original ? "original" : "maximum",
+            (unsigned long long)r.writes, (unsigned long long)r.reads,
+            (unsigned long long)r.bytes_written,
+            (unsigned long long)r.bytes_read,
+            (unsigned long long)r.mismatches, r.seconds,
+            r.seconds > 0 ? r.bytes_written / r.seconds : 0.0
+        );
+        return r.mismatches ? 2 : 0;
+    } catch (const std::exception& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+}
@@ -0,0 +1,226 @@
+/* buffer-pool-tests.cpp
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <boost/test/unit_test.hpp>
+#include "ft2232h-spi/buffer-pool.h"
+#include "ft2232h-spi/command-buffer.h"
+#include "ft2232h-spi/ft2232h-spi.h"
+#include "ft2232h-spi/mpsse-emulator.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace ft2232h_spi;
+
+BOOST_AUTO_TEST_SUITE(buffer_pool_tests)
+
+BOOST_AUTO_TEST_CASE(reuse)
+{
+    buffer_pool pool { 1000, 2 };
+    {
+        auto a = pool.acquire();
+        BOOST_REQUIRE(a);
+        BOOST_REQUIRE_EQUAL(a.size(), 1000);
+        BOOST_REQUIRE_EQUAL(
+            reinterpret_cast<uintptr_t>(a.data()) % buffer_pool::alignment, 0
+        );
+        a.data()[999] = 1;
+    }
+    BOOST_REQUIRE_EQUAL(pool.misses(), 1);
+    BOOST_REQUIRE_EQUAL(pool.idle(), 1);
+
+    auto b = pool.acquire();
+    BOOST_REQUIRE_EQUAL(pool.hits(), 1);
+    BOOST_REQUIRE_EQUAL(pool.idle(), 0);
+    BOOST_REQUIRE_EQUAL(pool.borrowed(), 1);
+
+    auto c = std::move(b);
+    BOOST_REQUIRE(!b);
+    BOOST_REQUIRE(c);
+}
+
+BOOST_AUTO_TEST_CASE(high_water)
+{
+    buffer_pool pool { 64, 2 };
+    {
+        std::vector<buffer_pool::buffer> held;
+        for (int i = 0; i < 5; ++i) {
+            held.push_back(pool.acquire());
+        }
+        BOOST_REQUIRE_EQUAL(pool.misses(), 5);
+    }
+    BOOST_REQUIRE_EQUAL(pool.idle(), 2);
+
+    pool.setHighWater(1);
+    BOOST_REQUIRE_EQUAL(pool.idle(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(async_steady_state)
+{
+    auto io = new mpsse_emulator;
+    io->attach(spi::dbus3, std::make_shared<register_slave>());
+    spi dev { spi::dbus3, std::unique_ptr<transport> { io } };
+
+    std::vector<uint8_t> tx(200000, 0x01);
+    std::vector<uint8_t> rx(1000);
+    auto burst = [&]() {
+        std::vector<std::future<void>> done;
+        for (int i = 0; i < 4; ++i) {
+            done.push_back(dev.transmitAsync(tx.data(), tx.size()));
+            done.push_back(dev.transferAsync(tx.data(), rx.data(), rx.size()));
+        }
+        for (auto& f : done) {
+            f.get();
+        }
+    };
+
+    burst();
+    dev.setBufferHighWater(64);
+    burst();
+    burst();
+
+    auto misses = dev.buffers().misses();
+    for (int i = 0; i < 5; ++i) {
+        burst();
+    }
+    BOOST_REQUIRE_EQUAL(dev.buffers().misses(), misses);
+    BOOST_REQUIRE_GT(dev.buffers().hits(), 0);
+}
+
+namespace {
+
+/* An emulator whose submitted writes don't finish until open() is called. */
+class gated_emulator : public mpsse_emulator
+{
+public:
+    std::unique_ptr<pending> submitWrite(
+        const uint8_t *data, size_t size) override
+    {
+        return std::unique_ptr<pending> { new write_op { this, data, size } };
+    }
+
+    void open()
+    {
+        {
+            std::lock_guard<std::mutex> lock { mutex_ };
+            open_ = true;
+        }
+        opened_.notify_all();
+    }
+
+private:
+    class write_op : public pending
+    {
+    public:
+        write_op(gated_emulator *owner, const uint8_t *data, size_t size) :
+            owner(owner),
+            data(data),
+            size(size)
+        { }
+
+        size_t wait() override
+        {
+            {
+                std::unique_lock<std::mutex> lock { owner->mutex_ };
+                owner->opened_.wait(lock, [this]() { return owner->open_; });
+            }
+            return owner->mpsse_emulator::submitWrite(data, size)->wait();
+        }
+
+    private:
+        gated_emulator *owner;
+        const uint8_t *data;
+        size_t size;
+    };
+
+    std::mutex mutex_;
+    std::condition_variable opened_;
+    bool open_ = false;
+};
+
+}
+
+BOOST_AUTO_TEST_CASE(async_limit)
+{
+    auto io = new gated_emulator;
+    io->attach(spi::dbus3, std::make_shared<register_slave>());
+    spi dev { spi::dbus3, std::unique_ptr<transport> { io } };
+    dev.setBufferLimit(4);
+
+    /* Small transfers don't take pooled blocks at all. */
+    std::vector<uint8_t> small(3, 0x01);
+    std::vector<std::future<void>> done;
+    for (int i = 0; i < 100; ++i) {
+        done.push_back(dev.transmitAsync(small.data(), small.size()));
+    }
+    BOOST_REQUIRE_EQUAL(dev.buffers().borrowed(), 2);
+
+    /* Each of these needs three blocks, so only one fits at a time. */
+    std::vector<uint8_t> big(200000, 0x01);
+    std::atomic<int> submitted { 0 };
+    std::thread submitter { [&]() {
+        for (int i = 0; i < 4; ++i) {
+            done.push_back(dev.transmitAsync(big.data(), big.size()));
+            ++submitted;
+        }
+    } };
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    /* The synchronous pair, the queued job and the one held back. */
+    BOOST_CHECK_EQUAL(submitted, 1);
+    BOOST_CHECK_EQUAL(dev.buffers().borrowed(), 2 + 3 + 3);
+
+    io->open();
+    submitter.join();
+    for (auto& f : done) {
+        f.get();
+    }
+    BOOST_REQUIRE_EQUAL(submitted, 4);
+}
+
+BOOST_AUTO_TEST_CASE(sync_uses_pool)
+{
+    auto io = new mpsse_emulator;
+    io->attach(spi::dbus3, std::make_shared<register_slave>());
+    spi dev { spi::dbus3, std::unique_ptr<transport> { io } };
+
+    /* Opening took the command and reply buffers from the pool. */
+    BOOST_REQUIRE_EQUAL(dev.buffers().misses(), 2);
+
+    std::vector<uint8_t> tx(100000, 0);
+    std::vector<uint8_t> rx(3000);
+    auto allocations = command_buffer::allocations();
+    for (int i = 0; i < 10; ++i) {
+        dev.transmit(tx.data(), tx.size());
+        dev.transfer(tx.data(), rx.data(), rx.size());
+
+        /* Two reads in one frame go through the reply buffer. */
+        spi::batch b;
+        b.select().read(&rx[0], 100).write(tx.data(), 10).read(&rx[100], 100)
+            .deselect();
+        dev.execute(b);
+    }
+    BOOST_REQUIRE_EQUAL(command_buffer::allocations(), allocations);
+    BOOST_REQUIRE_EQUAL(dev.buffers().misses(), 2);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
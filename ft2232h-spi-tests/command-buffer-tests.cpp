@@ -0,0 +1,125 @@
+/* command-buffer-tests.cpp
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <boost/test/unit_test.hpp>
+#include "ft2232h-spi/command-buffer.h"
+#include "ft2232h-spi/ft2232h-spi.h"
+#include "ft2232h-spi/mpsse-emulator.h"
+
+#include <cstdint>
+#include <vector>
+
+using namespace ft2232h_spi;
+
+BOOST_AUTO_TEST_SUITE(command_buffer_tests)
+
+BOOST_AUTO_TEST_CASE(inline_appends)
+{
+    auto before = command_buffer::allocations();
+    command_buffer b;
+    b.append(packet { uint8_t(1), uint8_t(2) });
+    b.append(static_packet<2> { 3, 4 });
+    uint8_t exp[] = { 1, 2, 3, 4 };
+
+    BOOST_REQUIRE(!b.onHeap());
+    BOOST_REQUIRE_EQUAL(command_buffer::allocations(), before);
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(
+        b.data(), b.data() + b.size(),
+        exp, exp + 4
+    );
+}
+
+BOOST_AUTO_TEST_CASE(spill_and_reuse)
+{
+    std::vector<uint8_t> payload(1000);
+    for (size_t i = 0; i < payload.size(); ++i) {
+        payload[i] = uint8_t(i);
+    }
+
+    command_buffer b;
+    b.append(static_packet<1> { 0xaa });
+    b.append(payload.data(), payload.size());
+    BOOST_REQUIRE(b.onHeap());
+    BOOST_REQUIRE_EQUAL(b.size(), 1001);
+    BOOST_REQUIRE_EQUAL(b.data()[0], 0xaa);
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(
+        b.data() + 1, b.data() + b.size(),
+        payload.begin(), payload.end()
+    );
+
+    /* Refilling up to the old size mustn't allocate again. */
+    auto before = command_buffer::allocations();
+    for (int i = 0; i < 10; ++i) {
+        b.clear();
+        b.append(payload.data(), payload.size());
+    }
+    BOOST_REQUIRE_EQUAL(command_buffer::allocations(), before);
+}
+
+BOOST_AUTO_TEST_CASE(reserve)
+{
+    command_buffer b { 4096 };
+    auto before = command_buffer::allocations();
+    for (int i = 0; i < 4096; ++i) {
+        *b.extend(1) = uint8_t(i);
+    }
+    BOOST_REQUIRE_EQUAL(b.size(), 4096);
+    BOOST_REQUIRE_EQUAL(b.capacity(), 4096);
+    BOOST_REQUIRE_EQUAL(command_buffer::allocations(), before);
+}
+
+BOOST_AUTO_TEST_CASE(move)
+{
+    command_buffer small;
+    small.append(static_packet<3> { 1, 2, 3 });
+    command_buffer small2 { std::move(small) };
+    BOOST_REQUIRE(small.empty());
+    BOOST_REQUIRE_EQUAL(small2.size(), 3);
+    BOOST_REQUIRE_EQUAL(small2.data()[2], 3);
+
+    command_buffer large { 1024 };
+    large.extend(512);
+    auto block = large.data();
+    auto before = command_buffer::allocations();
+
+    small2 = std::move(large);
+    BOOST_REQUIRE(large.empty());
+    BOOST_REQUIRE(!large.onHeap());
+    BOOST_REQUIRE_EQUAL(small2.data(), block);
+    BOOST_REQUIRE_EQUAL(small2.size(), 512);
+    BOOST_REQUIRE_EQUAL(command_buffer::allocations(), before);
+}
+
+BOOST_AUTO_TEST_CASE(steady_state_transfers)
+{
+    auto io = new mpsse_emulator;
+    io->attach(spi::dbus3, std::make_shared<register_slave>());
+    spi dev { spi::dbus3, std::unique_ptr<transport> { io } };
+
+    std::vector<uint8_t> tx(300, 0x01);
+    std::vector<uint8_t> rx(300);
+    dev.transmit(tx.data(), tx.size());
+    dev.transfer(tx.data(), rx.data(), rx.size());
+
+    auto before = command_buffer::allocations();
+    for (int i = 0; i < 100; ++i) {
+        dev.transmit(tx.data(), tx.size());
+        dev.transfer(tx.data(), rx.data(), rx.size());
+    }
+    BOOST_REQUIRE_EQUAL(command_buffer::allocations(), before);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
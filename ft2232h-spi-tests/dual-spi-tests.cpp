@@ -0,0 +1,168 @@
+/* dual-spi-tests.cpp
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <boost/test/unit_test.hpp>
+#include "ft2232h-spi/dual-spi.h"
+#include "ft2232h-spi/mpsse-emulator.h"
+#include "ft2232h-spi/spi-flash.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+using namespace ft2232h_spi;
+
+namespace {
+
+template <typename T>
+std::unique_ptr<transport> attach(std::shared_ptr<T> slave)
+{
+    auto emu = new mpsse_emulator;
+    emu->attach(spi::dbus3, slave);
+    return std::unique_ptr<transport> { emu };
+}
+
+struct fixture
+{
+    fixture() :
+        a(std::make_shared<recording_slave>()),
+        b(std::make_shared<recording_slave>()),
+        dev(spi::dbus3, attach(a), attach(b))
+    {
+        a->frames.clear();
+        b->frames.clear();
+    }
+
+    std::shared_ptr<recording_slave> a;
+    std::shared_ptr<recording_slave> b;
+    dual_spi dev;
+};
+
+std::vector<uint8_t> pattern(size_t size)
+{
+    std::vector<uint8_t> result(size);
+    for (size_t i = 0; i < size; ++i) {
+        result[i] = uint8_t(i * 7 + (i >> 8));
+    }
+    return result;
+}
+
+}
+
+BOOST_AUTO_TEST_SUITE(dual_spi_tests)
+
+BOOST_FIXTURE_TEST_CASE(transmit_striped, fixture)
+{
+    auto data = pattern(10000);
+    auto r = dev.transmitStriped(data.data(), data.size(), 1024);
+
+    BOOST_REQUIRE_EQUAL(r.channel[0].bytes, 5 * 1024);
+    BOOST_REQUIRE_EQUAL(r.channel[1].bytes, 10000 - 5 * 1024);
+    BOOST_REQUIRE_EQUAL(r.total.bytes, 10000);
+
+    std::vector<uint8_t> even, odd;
+    for (size_t offset = 0, i = 0; offset < data.size(); offset += 1024, ++i) {
+        auto& share = i % 2 ? odd : even;
+        size_t piece = std::min<size_t>(1024, data.size() - offset);
+        share.insert(share.end(), &data[offset], &data[offset] + piece);
+    }
+
+    BOOST_REQUIRE_EQUAL(a->frames.size(), 1);
+    BOOST_REQUIRE_EQUAL(b->frames.size(), 1);
+    BOOST_REQUIRE(a->frames[0] == even);
+    BOOST_REQUIRE(b->frames[0] == odd);
+}
+
+BOOST_FIXTURE_TEST_CASE(transmit_striped_one_stripe, fixture)
+{
+    auto data = pattern(100);
+    auto r = dev.transmitStriped(data.data(), data.size());
+
+    BOOST_REQUIRE_EQUAL(r.channel[1].bytes, 0);
+    BOOST_REQUIRE_EQUAL(a->frames.size(), 1);
+    BOOST_REQUIRE(a->frames[0] == data);
+    BOOST_REQUIRE(b->frames.empty());
+    BOOST_REQUIRE_THROW(
+        dev.transmitStriped(data.data(), data.size(), 0), error);
+}
+
+BOOST_FIXTURE_TEST_CASE(transmit_mirrored, fixture)
+{
+    auto data = pattern(3000);
+    auto r = dev.transmitMirrored(data.data(), data.size());
+
+    BOOST_REQUIRE_EQUAL(r.total.bytes, 6000);
+    BOOST_REQUIRE_EQUAL(a->frames.size(), 1);
+    BOOST_REQUIRE_EQUAL(b->frames.size(), 1);
+    BOOST_REQUIRE(a->frames[0] == data);
+    BOOST_REQUIRE(b->frames[0] == data);
+}
+
+BOOST_FIXTURE_TEST_CASE(receive_striped, fixture)
+{
+    auto data = pattern(5000);
+    for (size_t offset = 0, i = 0; offset < data.size(); offset += 512, ++i) {
+        auto& slave = i % 2 ? b : a;
+        size_t piece = std::min<size_t>(512, data.size() - offset);
+        slave->miso.insert(
+            slave->miso.end(), &data[offset], &data[offset] + piece);
+    }
+
+    std::vector<uint8_t> rx(data.size());
+    auto r = dev.receiveStriped(rx.data(), rx.size(), 512);
+
+    BOOST_REQUIRE_EQUAL(r.total.bytes, data.size());
+    BOOST_REQUIRE(rx == data);
+    BOOST_REQUIRE_EQUAL(a->frames.size(), 1);
+    BOOST_REQUIRE_EQUAL(b->frames.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(run_flash_on_both)
+{
+    auto a = std::make_shared<flash_slave>(0x10000);
+    auto b = std::make_shared<flash_slave>(0x10000);
+    dual_spi dev { spi::dbus3, attach(a), attach(b) };
+    auto data = pattern(0x4000);
+
+    auto r = dev.run([&](spi& s, size_t) -> uint64_t {
+        spi_flash flash { s };
+        flash.erase(0, data.size());
+        return flash.program(0, data.data(), data.size()).bytes;
+    });
+
+    BOOST_REQUIRE_EQUAL(r.total.bytes, 2 * data.size());
+    BOOST_REQUIRE(std::equal(data.begin(), data.end(), a->memory.begin()));
+    BOOST_REQUIRE(std::equal(data.begin(), data.end(), b->memory.begin()));
+}
+
+BOOST_FIXTURE_TEST_CASE(run_rethrows, fixture)
+{
+    bool other_finished = false;
+    BOOST_REQUIRE_THROW(
+        dev.run([&](spi&, size_t index) -> uint64_t {
+            if (index == 1) {
+                throw error(WHEN("channel B failed."));
+            }
+            other_finished = true;
+            return 0;
+        }),
+        error
+    );
+    BOOST_REQUIRE(other_finished);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,781 @@
+/* emulator-tests.cpp
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <boost/test/unit_test.hpp>
+#include "ft2232h-spi/ft2232h-spi.h"
+#include "ft2232h-spi/mpsse-emulator.h"
+#include "ft2232h-spi/packet.h"
+#include "ft2232h-spi/spi-bus.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace ft2232h_spi;
+
+namespace {
+
+struct fixture
+{
+    fixture() :
+        emu(new mpsse_emulator),
+        slave(std::make_shared<recording_slave>()),
+        dev(spi::dbus3, attach(emu, slave))
+    {
+        slave->frames.clear();
+    }
+
+    static std::unique_ptr<transport> attach(
+        mpsse_emulator *emu, std::shared_ptr<recording_slave> slave)
+    {
+        emu->attach(spi::dbus3, slave);
+        return std::unique_ptr<transport> { emu };
+    }
+
+    mpsse_emulator *emu;
+    std::shared_ptr<recording_slave> slave;
+    spi dev;
+};
+
+std::vector<uint8_t> pattern(size_t size)
+{
+    std::vector<uint8_t> result(size);
+    for (size_t i = 0; i < size; ++i) {
+        result[i] = uint8_t(i * 7 + (i >> 8));
+    }
+    return result;
+}
+
+}
+
+BOOST_AUTO_TEST_SUITE(emulator_tests)
+
+BOOST_FIXTURE_TEST_CASE(init, fixture)
+{
+    BOOST_REQUIRE(!emu->loopback());
+    BOOST_REQUIRE_EQUAL(emu->lowDirection(), spi::sck | spi::sdata | spi::dbus3);
+    BOOST_REQUIRE_EQUAL(emu->lowPins() & spi::dbus3, spi::dbus3);
+    BOOST_REQUIRE_EQUAL(emu->clock(), 1000000);
+    BOOST_REQUIRE_EQUAL(dev.clock(), 1000000);
+}
+
+BOOST_FIXTURE_TEST_CASE(transmit_packet, fixture)
+{
+    uint8_t exp[] = { 0x44, 0x33, 0x22, 0x11 };
+    dev.transmit(packet { 0x11223344 });
+
+    BOOST_REQUIRE_EQUAL(slave->frames.size(), 1);
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(
+        slave->frames[0].begin(), slave->frames[0].end(),
+        exp, exp + 4
+    );
+    BOOST_REQUIRE(!slave->selected);
+}
+
+BOOST_FIXTURE_TEST_CASE(transmit_large, fixture)
+{
+    auto data = pattern(200000);
+    auto writes = emu->writes();
+    dev.transmit(data.data(), data.size());
+
+    BOOST_REQUIRE_EQUAL(slave->frames.size(), 1);
+    BOOST_REQUIRE(slave->frames[0] == data);
+    BOOST_REQUIRE_LE(emu->writes() - writes, 4);
+}
+
+BOOST_FIXTURE_TEST_CASE(transmit_gather, fixture)
+{
+    uint8_t command = 0x02;
+    uint8_t address[] = { 0x12, 0x34, 0x56 };
+    auto payload = pattern(70000);
+
+    std::vector<uint8_t> exp { command };
+    exp.insert(exp.end(), address, address + 3);
+    exp.insert(exp.end(), payload.begin(), payload.end());
+
+    /* The 64 KiB command boundary falls inside the payload segment. */
+    dev.transmit({
+        { &command, 1 },
+        { address, sizeof(address) },
+        { nullptr, 0 },
+        { payload.data(), payload.size() }
+    });
+
+    BOOST_REQUIRE_EQUAL(slave->frames.size(), 1);
+    BOOST_REQUIRE(slave->frames[0] == exp);
+
+    std::vector<spi::segment> segments;
+    for (size_t i = 0; i < exp.size(); i += 1000) {
+        segments.push_back({ &exp[i], std::min<size_t>(1000, exp.size() - i) });
+    }
+    dev.transmitAsync(segments.data(), segments.size()).get();
+
+    BOOST_REQUIRE_EQUAL(slave->frames.size(), 2);
+    BOOST_REQUIRE(slave->frames[1] == exp);
+}
+
+BOOST_FIXTURE_TEST_CASE(transfer, fixture)
+{
+    auto tx = pattern(10000);
+    auto exp = pattern(10001);
+    exp.erase(exp.begin());
+    slave->miso.assign(exp.begin(), exp.end());
+
+    std::vector<uint8_t> rx(tx.size());
+    dev.transfer(tx.data(), rx.data(), tx.size());
+
+    BOOST_REQUIRE(slave->frames.at(0) == tx);
+    BOOST_REQUIRE(rx == exp);
+}
+
+BOOST_FIXTURE_TEST_CASE(receive, fixture)
+{
+    auto exp = pattern(100000);
+    slave->miso.assign(exp.begin(), exp.end());
+
+    std::vector<uint8_t> rx(exp.size());
+    dev.receive(rx.data(), rx.size());
+
+    BOOST_REQUIRE(rx == exp);
+    BOOST_REQUIRE_EQUAL(slave->frames.at(0).size(), exp.size());
+}
+
+/* An adapter whose replies dribble in, with an empty poll between bytes. */
+class trickle_emulator : public mpsse_emulator
+{
+public:
+    size_t read(uint8_t *data, size_t size) override
+    {
+        if (!trickle) {
+            return mpsse_emulator::read(data, size);
+        }
+        if (size == 0 || (polls_++ & 1) == 0) {
+            return 0;
+        }
+        return mpsse_emulator::read(data, 1);
+    }
+
+    /* Off while spi opens: its sync handshake expects whole replies. */
+    bool trickle = false;
+
+private:
+    uint64_t polls_ = 0;
+};
+
+BOOST_AUTO_TEST_CASE(slow_reply)
+{
+    auto slave = std::make_shared<recording_slave>();
+    auto emu = new trickle_emulator;
+    emu->attach(spi::dbus3, slave);
+    spi dev { spi::dbus3, std::unique_ptr<transport> { emu } };
+    emu->trickle = true;
+
+    /* Far more empty polls in total than spi tolerates in a row. */
+    auto exp = pattern(1000);
+    slave->miso.assign(exp.begin(), exp.end());
+
+    std::vector<uint8_t> rx(exp.size());
+    dev.receive(rx.data(), rx.size());
+    BOOST_REQUIRE(rx == exp);
+}
+
+BOOST_FIXTURE_TEST_CASE(batch_single_write, fixture)
+{
+    auto regs = std::make_shared<register_slave>();
+    emu->attach(spi::dbus4, regs);
+
+    spi::batch b;
+    for (uint8_t i = 0; i < 100; ++i) {
+        b.transmit(packet { uint8_t(i), uint8_t(i ^ 0x5a) });
+    }
+    uint8_t rx[4];
+    b.select(spi::dbus4).write(packet { uint8_t(0x80 | 10) })
+        .read(rx, sizeof(rx)).deselect();
+    BOOST_REQUIRE_EQUAL(b.transactions(), 101);
+
+    /* Send the register writes to the register file, not the recorder. */
+    spi::batch retargeted;
+    retargeted.append(b, spi::dbus4);
+
+    auto writes = emu->writes();
+    dev.execute(retargeted);
+
+    BOOST_REQUIRE_EQUAL(emu->writes() - writes, 1);
+    for (uint8_t i = 0; i < 100; ++i) {
+        BOOST_REQUIRE_EQUAL(regs->registers[i], i ^ 0x5a);
+    }
+    for (uint8_t i = 0; i < 4; ++i) {
+        BOOST_REQUIRE_EQUAL(rx[i], (10 + i) ^ 0x5a);
+    }
+    BOOST_REQUIRE(slave->frames.empty());
+}
+
+BOOST_FIXTURE_TEST_CASE(batch_distributes_reads, fixture)
+{
+    auto exp = pattern(30);
+    slave->miso.assign(exp.begin(), exp.end());
+
+    uint8_t a[10], b[10], c[10];
+    spi::batch batch;
+    batch.receive(a, 10).receive(b, 10).receive(c, 10);
+    dev.execute(batch);
+
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(a, a + 10, exp.begin(), exp.begin() + 10);
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(b, b + 10, exp.begin() + 10, exp.begin() + 20);
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(c, c + 10, exp.begin() + 20, exp.end());
+    BOOST_REQUIRE_EQUAL(slave->frames.size(), 3);
+}
+
+BOOST_FIXTURE_TEST_CASE(pipelined, fixture)
+{
+    auto first = dev.submitted();
+    dev.setPipelined(true, 16);
+    for (int i = 0; i < 40; ++i) {
+        dev.transmit(packet { i });
+    }
+    dev.fence();
+    dev.setPipelined(false);
+
+    BOOST_REQUIRE_EQUAL(dev.submitted() - first, 40);
+    BOOST_REQUIRE_EQUAL(slave->frames.size(), 40);
+}
+
+BOOST_FIXTURE_TEST_CASE(async, fixture)
+{
+    auto tx = pattern(5000);
+    auto exp = pattern(5000);
+    std::reverse(exp.begin(), exp.end());
+
+    /* The slave shifts out during the write-only frame too. */
+    slave->miso.assign(tx.size(), 0);
+    slave->miso.insert(slave->miso.end(), exp.begin(), exp.end());
+
+    std::vector<uint8_t> rx(exp.size());
+    auto sent = dev.transmitAsync(tx.data(), tx.size());
+    auto received = dev.receiveAsync(rx.data(), rx.size());
+    sent.get();
+    received.get();
+
+    BOOST_REQUIRE(rx == exp);
+    BOOST_REQUIRE_EQUAL(slave->frames.size(), 2);
+    BOOST_REQUIRE(slave->frames[0] == tx);
+}
+
+namespace {
+
+/*
+ * An emulator whose submitted reads only complete when waited on, as on
+ * real hardware, and which can't overlap them, like libftdi. It logs a
+ * 'W' for every write submitted and an 'R' for every read completed.
+ */
+class deferred_emulator : public mpsse_emulator
+{
+public:
+    std::unique_ptr<pending> submitWrite(
+        const uint8_t *data, size_t size) override
+    {
+        log('W');
+        return mpsse_emulator::submitWrite(data, size);
+    }
+
+    std::unique_ptr<pending> submitRead(uint8_t *data, size_t size) override
+    {
+        return std::unique_ptr<pending> { new read_op { this, data, size } };
+    }
+
+    std::string events() const
+    {
+        std::lock_guard<std::mutex> lock { events_mutex_ };
+        return events_;
+    }
+
+private:
+    class read_op : public pending
+    {
+    public:
+        read_op(deferred_emulator *owner, uint8_t *data, size_t size) :
+            owner(owner),
+            data(data),
+            size(size)
+        { }
+
+        size_t wait() override
+        {
+            auto done = owner->mpsse_emulator::submitRead(data, size);
+            owner->log('R');
+            return done->wait();
+        }
+
+    private:
+        deferred_emulator *owner;
+        uint8_t *data;
+        size_t size;
+    };
+
+    void log(char event)
+    {
+        std::lock_guard<std::mutex> lock { events_mutex_ };
+        events_ += event;
+    }
+
+    mutable std::mutex events_mutex_;
+    std::string events_;
+};
+
+}
+
+BOOST_AUTO_TEST_CASE(async_write_ahead_of_read)
+{
+    auto slave = std::make_shared<recording_slave>();
+    auto emu = new deferred_emulator;
+    emu->attach(spi::dbus3, slave);
+    spi dev { spi::dbus3, std::unique_ptr<transport> { emu } };
+
+    /* Full duplex beyond the FIFO size: one segment per FIFO's worth. */
+    auto tx = pattern(10000);
+    auto exp = pattern(10001);
+    exp.erase(exp.begin());
+    slave->miso.assign(exp.begin(), exp.end());
+
+    std::vector<uint8_t> rx(exp.size());
+    dev.transferAsync(tx.data(), rx.data(), tx.size()).get();
+    BOOST_REQUIRE(rx == exp);
+
+    /* Reads can't overlap, but the next write mustn't wait for them. */
+    auto events = emu->events();
+    BOOST_TEST_MESSAGE("transport events: " << events);
+    BOOST_REQUIRE_GE(events.size(), 4);
+    BOOST_REQUIRE_EQUAL(events.substr(0, 2), "WW");
+}
+
+BOOST_FIXTURE_TEST_CASE(async_empty_batch, fixture)
+{
+    spi::batch b;
+    auto writes = emu->writes();
+
+    auto done = dev.executeAsync(b);
+    BOOST_REQUIRE(
+        done.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+    done.get();
+
+    bool called = false;
+    dev.executeAsync(b, [&](std::exception_ptr e) { called = !e; });
+    BOOST_REQUIRE(called);
+    BOOST_REQUIRE_EQUAL(emu->writes(), writes);
+}
+
+namespace {
+
+/* An emulator that hands back one byte too few for the next read. */
+class short_read_emulator : public mpsse_emulator
+{
+public:
+    std::unique_ptr<pending> submitRead(uint8_t *data, size_t size) override
+    {
+        if (!shorten || size < 2) {
+            return mpsse_emulator::submitRead(data, size);
+        }
+        shorten = false;
+        return mpsse_emulator::submitRead(data, size - 1);
+    }
+
+    bool shorten = false;
+};
+
+}
+
+BOOST_AUTO_TEST_CASE(async_short_read)
+{
+    auto slave = std::make_shared<recording_slave>();
+    auto emu = new short_read_emulator;
+    emu->attach(spi::dbus3, slave);
+    spi dev { spi::dbus3, std::unique_ptr<transport> { emu } };
+
+    auto tx = pattern(16);
+    auto miso = pattern(48);
+    slave->miso.assign(miso.begin(), miso.end());
+
+    std::vector<uint8_t> first(16), second(16), third(16);
+    emu->shorten = true;
+    auto a = dev.transferAsync(tx.data(), first.data(), first.size());
+    auto b = dev.transferAsync(tx.data(), second.data(), second.size());
+    BOOST_REQUIRE_THROW(a.get(), error);
+
+    /* Queued behind the failure it may be abandoned, but never misread. */
+    try {
+        b.get();
+        BOOST_REQUIRE_EQUAL_COLLECTIONS(second.begin(), second.end(),
+            miso.begin() + 16, miso.begin() + 32);
+    } catch (const error& e) {
+        BOOST_TEST_MESSAGE("second job: " << e.what());
+    }
+
+    /* The leftover byte is gone and the chip select is released. */
+    BOOST_REQUIRE(!slave->selected);
+    dev.transferAsync(tx.data(), third.data(), third.size()).get();
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(third.begin(), third.end(),
+        miso.begin() + 32, miso.end());
+}
+
+BOOST_FIXTURE_TEST_CASE(usb_settings, fixture)
+{
+    dev.setLatencyTimer(2);
+    dev.setChunkSizes(8192, 1024);
+    BOOST_REQUIRE_EQUAL(emu->latencyTimer(), 2);
+    BOOST_REQUIRE_EQUAL(emu->writeChunkSize(), 8192);
+    BOOST_REQUIRE_EQUAL(emu->readChunkSize(), 1024);
+    BOOST_REQUIRE_EQUAL(dev.usbSettings().latency_ms, 2);
+    BOOST_REQUIRE_THROW(dev.setLatencyTimer(0), error);
+
+    auto pins = emu->lowPins();
+    auto tuned = dev.autoTune(spi::tune_throughput);
+    BOOST_REQUIRE_EQUAL(emu->latencyTimer(), tuned.latency_ms);
+    BOOST_REQUIRE_EQUAL(emu->writeChunkSize(), tuned.write_chunk);
+    BOOST_REQUIRE_EQUAL(emu->readChunkSize(), tuned.read_chunk);
+
+    /* Tuning mustn't have selected anything. */
+    BOOST_REQUIRE_EQUAL(emu->lowPins(), pins);
+    BOOST_REQUIRE(slave->frames.empty());
+
+    dev.transmit(packet { uint8_t(0x5a) });
+    BOOST_REQUIRE_EQUAL(slave->frames.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(tune_at_open)
+{
+    auto emu = new mpsse_emulator;
+    spi dev {
+        spi::dbus3, std::unique_ptr<transport> { emu },
+        spi::default_clock_hz, spi::tune_latency
+    };
+    BOOST_REQUIRE_EQUAL(emu->latencyTimer(), dev.usbSettings().latency_ms);
+    BOOST_REQUIRE_LE(dev.usbSettings().latency_ms, 16);
+}
+
+BOOST_FIXTURE_TEST_CASE(metrics, fixture)
+{
+    auto before = dev.metrics();
+    if (!before.enabled) {
+        return;
+    }
+    BOOST_REQUIRE_EQUAL(before.syncs, 1);
+    auto reads = emu->reads();
+
+    auto data = pattern(1000);
+    std::vector<uint8_t> rx(16);
+    dev.transmit(data.data(), data.size());
+    dev.receive(rx.data(), rx.size());
+
+    spi::batch b;
+    b.transmit(data.data(), 10).transmit(data.data(), 20);
+    dev.execute(b);
+    dev.transmitAsync(data.data(), 100).get();
+
+    auto m = dev.metrics();
+    BOOST_REQUIRE_EQUAL(m.transactions - before.transactions, 5);
+    BOOST_REQUIRE_EQUAL(m.payload_bytes - before.payload_bytes, 1146);
+    BOOST_REQUIRE_EQUAL(m.latency[size_t(transaction_type::transmit)].count, 2);
+    BOOST_REQUIRE_EQUAL(m.latency[size_t(transaction_type::receive)].count, 1);
+    BOOST_REQUIRE_EQUAL(m.latency[size_t(transaction_type::execute)].count, 1);
+    BOOST_REQUIRE_EQUAL(m.usb_writes - before.usb_writes, 4);
+    BOOST_REQUIRE_EQUAL(m.usb_write_bytes, emu->bytesWritten());
+    BOOST_REQUIRE_EQUAL(m.usb_reads - before.usb_reads, emu->reads() - reads);
+    BOOST_REQUIRE_EQUAL(m.syncs, 1);
+    BOOST_REQUIRE_EQUAL(m.errors, 0);
+
+    uint64_t bucketed = 0;
+    for (auto n : m.latency[size_t(transaction_type::transmit)].counts) {
+        bucketed += n;
+    }
+    BOOST_REQUIRE_EQUAL(bucketed, 2);
+}
+
+BOOST_FIXTURE_TEST_CASE(set_clock, fixture)
+{
+    BOOST_REQUIRE_EQUAL(dev.setClock(30000000), 30000000);
+    BOOST_REQUIRE_EQUAL(emu->clock(), 30000000);
+    BOOST_REQUIRE_EQUAL(dev.setClock(7000000), 6000000);
+    BOOST_REQUIRE_EQUAL(emu->clock(), 6000000);
+    BOOST_REQUIRE_EQUAL(dev.setClock(200), 200);
+    BOOST_REQUIRE_EQUAL(emu->clock(), 200);
+
+    /* The divisor tops out just above 91.55 Hz. */
+    BOOST_REQUIRE_LE(dev.setClock(92), 92);
+    BOOST_REQUIRE_THROW(dev.setClock(91), error);
+    BOOST_REQUIRE_THROW(dev.setClock(1), error);
+    BOOST_REQUIRE_LE(emu->clock(), 92);
+
+    spi::batch b;
+    BOOST_REQUIRE_THROW(b.setClock(91), error);
+}
+
+BOOST_FIXTURE_TEST_CASE(wait_for_gpio, fixture)
+{
+    uint8_t data[] = { 0x5a };
+    spi::batch b;
+    b.waitHigh(5000).transmit(data, 1);
+    emu->setInputs(0, 0);
+
+    std::thread raise { [this]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        emu->setInputs(spi::gpiol1, 0);
+    } };
+    dev.execute(b);
+    raise.join();
+
+    BOOST_REQUIRE(!emu->waiting());
+    BOOST_REQUIRE_EQUAL(slave->frames.size(), 1);
+    BOOST_REQUIRE_EQUAL(slave->frames[0][0], 0x5a);
+
+    /* Already low, so this one goes straight through. */
+    emu->setInputs(0, 0);
+    b.clear();
+    b.select().waitLow(10).write(data, 1).deselect();
+    dev.execute(b);
+    BOOST_REQUIRE_EQUAL(slave->frames.size(), 2);
+}
+
+BOOST_FIXTURE_TEST_CASE(wait_timeout, fixture)
+{
+    uint8_t data[] = { 0x5a };
+    spi::batch b;
+    b.waitLow(20).transmit(data, 1);
+
+    /* Unconnected inputs float high. */
+    BOOST_REQUIRE_THROW(dev.execute(b), ft2232h_spi::wait_timeout);
+    BOOST_REQUIRE(!emu->waiting());
+    BOOST_REQUIRE(slave->frames.empty());
+
+    /* The channel was reset and set up again. */
+    BOOST_REQUIRE_EQUAL(emu->clock(), 1000000);
+    dev.transmit(data, 1);
+    BOOST_REQUIRE_EQUAL(slave->frames.size(), 1);
+}
+
+BOOST_FIXTURE_TEST_CASE(delay, fixture)
+{
+    uint8_t data[] = { 0x01, 0x02 };
+    spi::batch b;
+    b.transmit(data, 2).delay(std::chrono::microseconds(20)).transmit(data, 2);
+
+    auto cycles = emu->cycles();
+    auto writes = emu->writes();
+    dev.execute(b);
+
+    /* 20 us at 1 MHz, clocked between the frames in the same write. */
+    BOOST_REQUIRE_EQUAL(emu->cycles() - cycles, 2 * 16 + 20);
+    BOOST_REQUIRE_EQUAL(emu->writes() - writes, 1);
+    BOOST_REQUIRE_EQUAL(slave->frames.size(), 2);
+
+    /* Inside a frame SCK has to stay put. */
+    b.clear();
+    b.select().write(data, 1).delay(std::chrono::microseconds(1))
+        .write(data + 1, 1).deselect();
+    auto bytes = emu->bytesWritten();
+    cycles = emu->cycles();
+    dev.execute(b);
+
+    BOOST_REQUIRE_EQUAL(emu->cycles() - cycles, 16);
+    BOOST_REQUIRE_GE(emu->bytesWritten() - bytes, 20 * 3);
+    BOOST_REQUIRE_EQUAL(slave->frames.size(), 3);
+    BOOST_REQUIRE_EQUAL(slave->frames[2].size(), 2);
+    BOOST_REQUIRE(!slave->selected);
+}
+
+BOOST_FIXTURE_TEST_CASE(delay_limits, fixture)
+{
+    /* Pin commands for this long would be a lot of USB traffic. */
+    spi::batch b;
+    b.select();
+    b.delay(std::chrono::nanoseconds(spi::max_framed_delay_ns));
+    BOOST_REQUIRE_THROW(
+        b.delay(std::chrono::nanoseconds(spi::max_framed_delay_ns + 1)),
+        error);
+
+    /* Long enough that ns * Hz would overflow 64 bits. */
+    b.clear();
+    b.setClock(30000000).delay(std::chrono::minutes(20));
+    auto cycles = emu->cycles();
+    dev.execute(b);
+    BOOST_REQUIRE_EQUAL(emu->cycles() - cycles, 20 * 60 * 30000000ull);
+}
+
+BOOST_FIXTURE_TEST_CASE(gpio, fixture)
+{
+    uint8_t command = 0x2c;
+    uint8_t pixels[] = { 0x12, 0x34 };
+    spi::batch b;
+    b.select()
+        .gpioClear(spi::adbus4)
+        .write(&command, 1)
+        .gpioSet(spi::adbus4)
+        .write(pixels, 2)
+        .deselect()
+        .gpioSet(spi::acbus0 | spi::acbus7);
+
+    auto writes = emu->writes();
+    dev.execute(b);
+
+    BOOST_REQUIRE_EQUAL(emu->writes() - writes, 1);
+    BOOST_REQUIRE_EQUAL(slave->frames.size(), 1);
+    BOOST_REQUIRE_EQUAL(slave->frames[0].size(), 3);
+    BOOST_REQUIRE(!slave->selected);
+    BOOST_REQUIRE_EQUAL(emu->lowPins() & spi::adbus4, spi::adbus4);
+    BOOST_REQUIRE_EQUAL(emu->lowDirection() & spi::adbus4, spi::adbus4);
+    BOOST_REQUIRE_EQUAL(emu->highPins(), 0x81);
+    BOOST_REQUIRE_EQUAL(emu->highDirection(), 0x81);
+
+    /* Nothing changes, so nothing goes out. */
+    auto bytes = emu->bytesWritten();
+    b.clear();
+    b.gpioSet(spi::adbus4 | spi::acbus0);
+    dev.execute(b);
+    BOOST_REQUIRE_EQUAL(emu->bytesWritten(), bytes);
+
+    /* Chip-select frames keep the GPIO state. */
+    dev.transmit(pixels, 2);
+    BOOST_REQUIRE_EQUAL(emu->lowPins() & spi::adbus4, spi::adbus4);
+
+    /* Released pins read back whatever drives them. */
+    uint8_t levels[2];
+    emu->setInputs(0x00, 0x02);
+    b.clear();
+    b.gpioRelease(spi::acbus7).gpioRead(levels);
+    dev.execute(b);
+    BOOST_REQUIRE_EQUAL(emu->highDirection(), 0x01);
+    BOOST_REQUIRE_EQUAL(levels[0] & spi::adbus4, spi::adbus4);
+    BOOST_REQUIRE_EQUAL(levels[1], 0x03);
+}
+
+BOOST_FIXTURE_TEST_CASE(gpio_chip_select_clash, fixture)
+{
+    spi::batch b;
+    BOOST_REQUIRE_THROW(b.gpioSet(spi::dbus3), error);
+
+    dev.addChipSelect(spi::dbus4);
+    b.gpioSet(spi::adbus4);
+    BOOST_REQUIRE_THROW(dev.execute(b), error);
+
+    b.clear();
+    b.gpioSet(spi::adbus5);
+    dev.execute(b);
+    BOOST_REQUIRE_THROW(dev.addChipSelect(spi::dbus5), error);
+
+    /* SCK, MOSI and MISO can't double as chip selects either. */
+    b.clear();
+    BOOST_REQUIRE_THROW(b.select(spi::sck), error);
+    BOOST_REQUIRE_THROW(b.select(spi::pins(spi::dbus2 | spi::dbus4)), error);
+    BOOST_REQUIRE_THROW(dev.addChipSelect(spi::sdata), error);
+}
+
+namespace {
+
+/* Fails every write while broken is set. */
+class broken_emulator : public mpsse_emulator
+{
+public:
+    void write(const uint8_t *data, size_t size) override
+    {
+        if (broken) {
+            throw error(WHEN("write failed."));
+        }
+        mpsse_emulator::write(data, size);
+    }
+
+    bool broken = false;
+};
+
+}
+
+BOOST_AUTO_TEST_CASE(gpio_state_after_failure)
+{
+    auto emu = new broken_emulator;
+    spi dev { spi::dbus3, std::unique_ptr<transport> { emu } };
+
+    spi::batch b;
+    b.gpioSet(spi::acbus0);
+    emu->broken = true;
+    BOOST_REQUIRE_THROW(dev.execute(b), error);
+    emu->broken = false;
+    BOOST_REQUIRE_EQUAL(emu->highPins() & 0x01, 0);
+
+    /* The pin never went high, so setting it again mustn't be skipped. */
+    dev.execute(b);
+    BOOST_REQUIRE_EQUAL(emu->highPins() & 0x01, 0x01);
+}
+
+BOOST_AUTO_TEST_CASE(shared_bus)
+{
+    auto emu = new mpsse_emulator;
+    auto a = std::make_shared<register_slave>();
+    auto b = std::make_shared<register_slave>();
+    emu->attach(spi::dbus3, a);
+    emu->attach(spi::dbus4, b);
+
+    spi_bus bus { std::unique_ptr<transport> { emu } };
+    auto dev_a = bus.attach(spi::dbus3, 1000000);
+    auto dev_b = bus.attach(spi::dbus4, 10000000);
+
+    dev_a.transmit(packet { uint8_t(1), uint8_t(0xaa) }.data(), 2);
+    dev_b.transmit(packet { uint8_t(1), uint8_t(0xbb) }.data(), 2);
+
+    BOOST_REQUIRE_EQUAL(a->registers[1], 0xaa);
+    BOOST_REQUIRE_EQUAL(b->registers[1], 0xbb);
+    BOOST_REQUIRE_EQUAL(emu->clock(), 10000000);
+}
+
+BOOST_AUTO_TEST_CASE(shared_bus_bad_request)
+{
+    auto emu = new mpsse_emulator;
+    auto a = std::make_shared<register_slave>();
+    emu->attach(spi::dbus3, a);
+    emu->setInputs(0, 0);
+
+    spi_bus bus { std::unique_ptr<transport> { emu } };
+    auto dev_a = bus.attach(spi::dbus3);
+    bus.attach(spi::dbus4);
+
+    /* Hold the bus on a wait so the next two requests queue up together. */
+    spi::batch hold;
+    hold.waitHigh(5000);
+    auto held = dev_a.submit(hold);
+    while (!emu->waiting()) {
+        std::this_thread::yield();
+    }
+    auto executions = bus.executions();
+
+    uint8_t data[] = { 1, 0xaa };
+    spi::batch good;
+    good.transmit(data, 2);
+    spi::batch bad;
+    bad.gpioSet(spi::adbus4);
+    auto good_done = dev_a.submit(good);
+    auto bad_done = dev_a.submit(bad);
+
+    emu->setInputs(0xff, 0xff);
+    held.get();
+    good_done.get();
+    BOOST_REQUIRE_THROW(bad_done.get(), error);
+    BOOST_REQUIRE_EQUAL(a->registers[1], 0xaa);
+    BOOST_REQUIRE_EQUAL(bus.executions() - executions, 2);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,144 @@
+/* endpoint-table-tests.cpp
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <boost/test/unit_test.hpp>
+#include "ft2232h-spi/endpoint-table.h"
+#include "ft2232h-spi/ft2232h-spi.h"
+
+#include <string>
+#include <vector>
+
+using namespace ft2232h_spi;
+
+namespace {
+
+typedef endpoint_table<int> table;
+
+endpoint located(const std::string& path)
+{
+    return endpoint { 0x0403, 0x6010, "", "", "", path };
+}
+
+endpoint named(const std::string& path, const std::string& serial)
+{
+    return endpoint { 0x0403, 0x6010, "FTDI", "FT2232H", serial, path };
+}
+
+}
+
+BOOST_AUTO_TEST_SUITE(endpoint_table_tests)
+
+BOOST_AUTO_TEST_CASE(add)
+{
+    table t;
+    std::vector<table::entry> removed;
+    BOOST_REQUIRE(t.add(1, located("3-1.4"), removed));
+    BOOST_REQUIRE(t.add(2, located("3-1.2"), removed));
+    BOOST_REQUIRE(!t.add(1, located("3-1.4"), removed));
+    BOOST_REQUIRE(removed.empty());
+
+    /* Nothing is listed until its strings are in. */
+    BOOST_REQUIRE_EQUAL(t.size(), 0);
+    auto pending = t.unresolved();
+    BOOST_REQUIRE_EQUAL(pending.size(), 2);
+    BOOST_REQUIRE_EQUAL(pending[0].dev, 2);
+
+    BOOST_REQUIRE(t.resolve(1, named("3-1.4", "B")));
+    BOOST_REQUIRE(t.resolve(2, named("3-1.2", "A")));
+    BOOST_REQUIRE(t.unresolved().empty());
+
+    auto all = t.endpoints();
+    BOOST_REQUIRE_EQUAL(all.size(), 2);
+    BOOST_REQUIRE_EQUAL(all[0].path, "3-1.2");
+    BOOST_REQUIRE_EQUAL(all[1].serial, "B");
+    BOOST_REQUIRE_EQUAL(t.size(), 2);
+    BOOST_REQUIRE_EQUAL(t.at(1).path, "3-1.4");
+    BOOST_REQUIRE_THROW(t.at(2), error);
+}
+
+BOOST_AUTO_TEST_CASE(remove)
+{
+    table t;
+    std::vector<table::entry> removed;
+    t.add(1, located("1-1"), removed);
+    t.add(2, located("1-2"), removed);
+    t.resolve(1, named("1-1", "A"));
+
+    t.remove(3, removed);
+    BOOST_REQUIRE(removed.empty());
+
+    t.remove(1, removed);
+    BOOST_REQUIRE_EQUAL(removed.size(), 1);
+    BOOST_REQUIRE_EQUAL(removed[0].dev, 1);
+    BOOST_REQUIRE(removed[0].resolved);
+    BOOST_REQUIRE_EQUAL(removed[0].ep.serial, "A");
+    BOOST_REQUIRE_EQUAL(t.size(), 0);
+    BOOST_REQUIRE_THROW(t.at(0), error);
+
+    /* Strings read from a device that has since gone are dropped. */
+    t.remove(2, removed);
+    BOOST_REQUIRE(!removed[1].resolved);
+    BOOST_REQUIRE(!t.resolve(2, named("1-2", "B")));
+    BOOST_REQUIRE(t.devices().empty());
+}
+
+BOOST_AUTO_TEST_CASE(replug_at_same_path)
+{
+    table t;
+    std::vector<table::entry> removed;
+    t.add(1, located("2-3"), removed);
+    t.resolve(1, named("2-3", "old"));
+
+    /* The new device arrives before the old one's removal is seen. */
+    BOOST_REQUIRE(t.add(7, located("2-3"), removed));
+    BOOST_REQUIRE_EQUAL(removed.size(), 1);
+    BOOST_REQUIRE_EQUAL(removed[0].dev, 1);
+    BOOST_REQUIRE_EQUAL(removed[0].ep.serial, "old");
+    BOOST_REQUIRE_EQUAL(t.size(), 0);
+
+    /* A late read of the old device doesn't overwrite the new one. */
+    BOOST_REQUIRE(!t.resolve(1, named("2-3", "old")));
+    BOOST_REQUIRE(t.resolve(7, named("2-3", "new")));
+    BOOST_REQUIRE_EQUAL(t.at(0).serial, "new");
+
+    /* And the old device's removal, when it comes, changes nothing. */
+    removed.clear();
+    t.remove(1, removed);
+    BOOST_REQUIRE(removed.empty());
+    auto devices = t.devices();
+    BOOST_REQUIRE_EQUAL(devices.size(), 1);
+    BOOST_REQUIRE_EQUAL(devices[0], 7);
+}
+
+BOOST_AUTO_TEST_CASE(retain)
+{
+    table t;
+    std::vector<table::entry> removed;
+    t.add(1, located("1-1"), removed);
+    t.add(2, located("1-2"), removed);
+    t.add(3, located("1-3"), removed);
+
+    t.retain({ 3, 1, 9 }, removed);
+    BOOST_REQUIRE_EQUAL(removed.size(), 1);
+    BOOST_REQUIRE_EQUAL(removed[0].dev, 2);
+    auto devices = t.devices();
+    std::vector<int> expected { 1, 3 };
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(
+        devices.begin(), devices.end(), expected.begin(), expected.end());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
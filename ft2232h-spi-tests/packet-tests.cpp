@@ -16,6 +16,7 @@
  */
 
 #include <boost/test/unit_test.hpp>
+#include "ft2232h-spi/mpsse.h"
 #include "ft2232h-spi/packet.h"
 
 #include <cstdint>
@@ -162,4 +163,34 @@ BOOST_AUTO_TEST_CASE(append_medium)
     );
 }
 
+BOOST_AUTO_TEST_CASE(static_concat)
+{
+    constexpr static_packet<2> p1 { 1, 2 };
+    constexpr static_packet<3> p2 { 3, 4, 5 };
+    constexpr auto p = p1 + p2 + static_packet<0> {};
+    uint8_t exp[] = { 1, 2, 3, 4, 5 };
+
+    static_assert(p.size() == 5, "");
+    static_assert(p[0] == 1 && p[4] == 5, "");
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(
+        p.data(), p.data() + p.size(),
+        exp, exp + 5
+    );
+}
+
+BOOST_AUTO_TEST_CASE(static_commands)
+{
+    constexpr auto p =
+        commands::setLowBits(0x08, 0x0b) + commands::write(0x1234);
+    uint8_t exp[] = { 0x80, 0x08, 0x0b, 0x10, 0x33, 0x12 };
+
+    static_assert(p.size() == 6, "");
+    static_assert(commands::setClkdiv(0x05db)[1] == 0xdb, "");
+    static_assert(commands::read(0x10000)[2] == 0xff, "");
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(
+        p.data(), p.data() + p.size(),
+        exp, exp + 6
+    );
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,131 @@
+/* spi-display-tests.cpp
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <boost/test/unit_test.hpp>
+#include "ft2232h-spi/ft2232h-spi.h"
+#include "ft2232h-spi/mpsse-emulator.h"
+#include "ft2232h-spi/spi-display.h"
+
+#include <cstdint>
+#include <vector>
+
+using namespace ft2232h_spi;
+
+namespace {
+
+constexpr uint16_t width = 64;
+constexpr uint16_t height = 48;
+
+struct fixture
+{
+    fixture() :
+        emu(new mpsse_emulator),
+        panel(std::make_shared<panel_slave>(width, height, 2, spi::adbus4)),
+        dev(spi::dbus3, attach(emu, panel)),
+        display(dev, spi::adbus4, width, height),
+        frame(size_t(width) * height * 2)
+    {
+        for (size_t i = 0; i < frame.size(); ++i) {
+            frame[i] = uint8_t(i * 3);
+        }
+    }
+
+    static std::unique_ptr<transport> attach(
+        mpsse_emulator *emu, std::shared_ptr<panel_slave> panel)
+    {
+        emu->attach(spi::dbus3, panel);
+        return std::unique_ptr<transport> { emu };
+    }
+
+    void paint(uint16_t x, uint16_t y, uint8_t value)
+    {
+        frame[(y * width + x) * 2] = value;
+        frame[(y * width + x) * 2 + 1] = value;
+    }
+
+    mpsse_emulator *emu;
+    std::shared_ptr<panel_slave> panel;
+    spi dev;
+    spi_display display;
+    std::vector<uint8_t> frame;
+};
+
+}
+
+BOOST_AUTO_TEST_SUITE(spi_display_tests)
+
+BOOST_FIXTURE_TEST_CASE(first_push_is_full, fixture)
+{
+    auto writes = emu->writes();
+    auto result = display.push(frame.data());
+
+    BOOST_REQUIRE(result.full);
+    BOOST_REQUIRE_EQUAL(result.pixels, width * height);
+    BOOST_REQUIRE(panel->memory == frame);
+    BOOST_REQUIRE_EQUAL(emu->writes() - writes, 1);
+}
+
+BOOST_FIXTURE_TEST_CASE(unchanged_sends_nothing, fixture)
+{
+    display.push(frame.data());
+    auto bytes = emu->bytesWritten();
+    auto result = display.push(frame.data());
+
+    BOOST_REQUIRE_EQUAL(result.rects, 0);
+    BOOST_REQUIRE_EQUAL(emu->bytesWritten(), bytes);
+}
+
+BOOST_FIXTURE_TEST_CASE(dirty_rects, fixture)
+{
+    display.push(frame.data());
+    auto pixel_bytes = panel->pixel_bytes;
+
+    /* Two small areas far apart, one of them a diagonal. */
+    for (uint16_t i = 0; i < 4; ++i) {
+        paint(10 + i, 5 + i, 0xaa);
+    }
+    paint(50, 40, 0x55);
+
+    auto result = display.push(frame.data());
+    BOOST_REQUIRE(!result.full);
+    BOOST_REQUIRE_EQUAL(result.rects, 2);
+    BOOST_REQUIRE_EQUAL(display.dirty()[0].x, 10);
+    BOOST_REQUIRE_EQUAL(display.dirty()[0].y, 5);
+    BOOST_REQUIRE_EQUAL(display.dirty()[0].width, 4);
+    BOOST_REQUIRE_EQUAL(display.dirty()[0].height, 4);
+    BOOST_REQUIRE_EQUAL(display.dirty()[1].x, 50);
+    BOOST_REQUIRE_EQUAL(display.dirty()[1].width, 1);
+    BOOST_REQUIRE_EQUAL(panel->pixel_bytes - pixel_bytes, 2 * (16 + 1));
+    BOOST_REQUIRE(panel->memory == frame);
+}
+
+BOOST_FIXTURE_TEST_CASE(large_change_is_full, fixture)
+{
+    display.push(frame.data());
+    for (auto& b : frame) {
+        b ^= 0xff;
+    }
+    auto result = display.push(frame.data());
+
+    BOOST_REQUIRE(result.full);
+    BOOST_REQUIRE(panel->memory == frame);
+
+    display.invalidate();
+    BOOST_REQUIRE(display.push(frame.data()).full);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,154 @@
+/* spi-flash-tests.cpp
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <boost/test/unit_test.hpp>
+#include "ft2232h-spi/ft2232h-spi.h"
+#include "ft2232h-spi/mpsse-emulator.h"
+#include "ft2232h-spi/spi-flash.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+using namespace ft2232h_spi;
+
+namespace {
+
+struct fixture
+{
+    fixture() :
+        chip(std::make_shared<flash_slave>(0x100000)),
+        dev(spi::dbus3, attach(chip)),
+        flash(dev)
+    { }
+
+    static std::unique_ptr<transport> attach(std::shared_ptr<flash_slave> chip)
+    {
+        auto emu = new mpsse_emulator;
+        emu->attach(spi::dbus3, chip);
+        return std::unique_ptr<transport> { emu };
+    }
+
+    std::shared_ptr<flash_slave> chip;
+    spi dev;
+    spi_flash flash;
+};
+
+std::vector<uint8_t> image(size_t size)
+{
+    std::vector<uint8_t> result(size);
+    for (size_t i = 0; i < size; ++i) {
+        result[i] = uint8_t(i * 13 + (i >> 8));
+    }
+    return result;
+}
+
+}
+
+BOOST_AUTO_TEST_SUITE(spi_flash_tests)
+
+BOOST_FIXTURE_TEST_CASE(probe, fixture)
+{
+    auto id = flash.probe();
+    BOOST_REQUIRE_EQUAL(id.manufacturer, 0xef);
+    BOOST_REQUIRE_EQUAL(id.type, 0x40);
+    BOOST_REQUIRE_EQUAL(id.size(), 0x100000);
+
+    id.capacity = 0xff;
+    BOOST_REQUIRE_EQUAL(id.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(probe_no_chip)
+{
+    spi dev { spi::dbus3, std::unique_ptr<transport> { new mpsse_emulator } };
+    spi_flash flash { dev };
+    BOOST_REQUIRE_THROW(flash.probe(), error);
+}
+
+BOOST_FIXTURE_TEST_CASE(program_and_read, fixture)
+{
+    /* Unaligned at both ends and several batches long. */
+    auto data = image(70000);
+    uint32_t address = 0x1234;
+    auto t = flash.program(address, data.data(), data.size());
+
+    BOOST_REQUIRE_EQUAL(t.bytes, data.size());
+    BOOST_REQUIRE_GT(t.megabytesPerSecond(), 0);
+    BOOST_REQUIRE_EQUAL(flash.overruns(), 0);
+    BOOST_REQUIRE_EQUAL(chip->ignored, 0);
+    BOOST_REQUIRE(std::equal(
+        data.begin(), data.end(), chip->memory.begin() + address));
+    BOOST_REQUIRE_EQUAL(chip->memory[address - 1], 0xff);
+    BOOST_REQUIRE_EQUAL(chip->memory[address + data.size()], 0xff);
+
+    std::vector<uint8_t> readback(data.size());
+    flash.read(address, readback.data(), readback.size());
+    BOOST_REQUIRE(readback == data);
+    BOOST_REQUIRE(flash.verify(address, data.data(), data.size()));
+
+    data[500] ^= 1;
+    BOOST_REQUIRE(!flash.verify(address, data.data(), data.size()));
+}
+
+BOOST_FIXTURE_TEST_CASE(program_overrun, fixture)
+{
+    /* The chip takes about four times longer than we wait for. */
+    chip->program_bytes = 400;
+    auto data = image(4096);
+    flash.program(0, data.data(), data.size());
+
+    BOOST_REQUIRE_GT(flash.overruns(), 0);
+    BOOST_REQUIRE_GT(flash.pageProgramTime().count(), 800);
+    BOOST_REQUIRE(flash.verify(0, data.data(), data.size()));
+}
+
+BOOST_AUTO_TEST_CASE(program_traffic)
+{
+    auto chip = std::make_shared<flash_slave>(0x10000);
+    auto emu = new mpsse_emulator;
+    emu->attach(spi::dbus3, chip);
+    spi dev { spi::dbus3, std::unique_ptr<transport> { emu } };
+    dev.setClock(30000000);
+    spi_flash flash { dev };
+
+    /* The program time is waited out on-chip, not sent as padding. */
+    auto data = image(4096);
+    auto bytes = emu->bytesWritten();
+    flash.program(0, data.data(), data.size());
+
+    size_t pages = data.size() / spi_flash::page_size;
+    BOOST_REQUIRE_EQUAL(flash.overruns(), 0);
+    BOOST_REQUIRE_LE(emu->bytesWritten() - bytes, data.size() + pages * 64);
+    BOOST_REQUIRE(flash.verify(0, data.data(), data.size()));
+}
+
+BOOST_FIXTURE_TEST_CASE(erase, fixture)
+{
+    std::fill(chip->memory.begin(), chip->memory.end(), 0);
+    flash.erase(0x1000, 0x20000);
+
+    BOOST_REQUIRE_EQUAL(chip->memory[0x0fff], 0);
+    BOOST_REQUIRE_EQUAL(chip->memory[0x1000], 0xff);
+    BOOST_REQUIRE_EQUAL(chip->memory[0x20fff], 0xff);
+    BOOST_REQUIRE_EQUAL(chip->memory[0x21000], 0);
+    BOOST_REQUIRE_EQUAL(chip->ignored, 0);
+
+    BOOST_REQUIRE_THROW(flash.erase(0x800, 0x1000), error);
+    BOOST_REQUIRE_THROW(flash.erase(0, 0x2000000), error);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,220 @@
+/* spi-stream-tests.cpp
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <boost/test/unit_test.hpp>
+#include "ft2232h-spi/ft2232h-spi.h"
+#include "ft2232h-spi/mpsse-emulator.h"
+#include "ft2232h-spi/spi-stream.h"
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace ft2232h_spi;
+
+namespace {
+
+/* A converter whose samples count up by one, two bytes big-endian. */
+class counting_adc : public mpsse_emulator::slave
+{
+public:
+    void select() override { byte_ = 0; }
+
+    uint8_t exchange(uint8_t mosi) override
+    {
+        commands.push_back(mosi);
+        if (byte_++ == 0) {
+            return uint8_t(next_ >> 8);
+        }
+        return uint8_t(next_++);
+    }
+
+    std::vector<uint8_t> commands;
+
+private:
+    size_t byte_ = 0;
+    uint16_t next_ = 0;
+};
+
+struct fixture
+{
+    fixture() :
+        adc(std::make_shared<counting_adc>()),
+        dev(spi::dbus3, attach(adc))
+    { }
+
+    static std::unique_ptr<transport> attach(std::shared_ptr<counting_adc> adc)
+    {
+        auto emu = new mpsse_emulator;
+        emu->attach(spi::dbus3, adc);
+        return std::unique_ptr<transport> { emu };
+    }
+
+    std::shared_ptr<counting_adc> adc;
+    spi dev;
+};
+
+uint16_t value(const uint8_t *sample)
+{
+    return (sample[0] << 8) | sample[1];
+}
+
+/*
+ * An emulator whose submitted reads only complete when waited on, as on
+ * real hardware, and which can't overlap them, like libftdi. It logs a
+ * 'W' for every write submitted and an 'R' for every read completed.
+ */
+class deferred_emulator : public mpsse_emulator
+{
+public:
+    std::unique_ptr<pending> submitWrite(
+        const uint8_t *data, size_t size) override
+    {
+        log('W');
+        return mpsse_emulator::submitWrite(data, size);
+    }
+
+    std::unique_ptr<pending> submitRead(uint8_t *data, size_t size) override
+    {
+        return std::unique_ptr<pending> { new read_op { this, data, size } };
+    }
+
+    std::string events() const
+    {
+        std::lock_guard<std::mutex> lock { events_mutex_ };
+        return events_;
+    }
+
+private:
+    class read_op : public pending
+    {
+    public:
+        read_op(deferred_emulator *owner, uint8_t *data, size_t size) :
+            owner(owner),
+            data(data),
+            size(size)
+        { }
+
+        size_t wait() override
+        {
+            auto done = owner->mpsse_emulator::submitRead(data, size);
+            owner->log('R');
+            return done->wait();
+        }
+
+    private:
+        deferred_emulator *owner;
+        uint8_t *data;
+        size_t size;
+    };
+
+    void log(char event)
+    {
+        std::lock_guard<std::mutex> lock { events_mutex_ };
+        events_ += event;
+    }
+
+    mutable std::mutex events_mutex_;
+    std::string events_;
+};
+
+}
+
+BOOST_AUTO_TEST_SUITE(spi_stream_tests)
+
+BOOST_FIXTURE_TEST_CASE(samples_in_order, fixture)
+{
+    spi_stream stream {
+        dev, 2, { 0x80 }, std::chrono::microseconds(2), 1024, 64, 2
+    };
+    stream.start();
+
+    std::vector<uint8_t> samples(2 * 1000);
+    size_t got = 0;
+    while (got < 1000) {
+        got += stream.read(&samples[2 * got], 1000 - got);
+        std::this_thread::yield();
+    }
+    stream.stop();
+
+    for (size_t i = 0; i < got; ++i) {
+        BOOST_REQUIRE_EQUAL(value(&samples[2 * i]), i);
+    }
+    BOOST_REQUIRE_GE(stream.samples(), 1000);
+    BOOST_REQUIRE_EQUAL(adc->commands[0], 0x80);
+    BOOST_REQUIRE_EQUAL(adc->commands[1], 0x00);
+    BOOST_REQUIRE(!stream.running());
+}
+
+BOOST_FIXTURE_TEST_CASE(overrun, fixture)
+{
+    spi_stream stream { dev, 2, {}, std::chrono::nanoseconds(0), 128, 64, 2 };
+    stream.start();
+    while (stream.overruns() == 0) {
+        std::this_thread::yield();
+    }
+    stream.stop();
+
+    /* The oldest samples are kept; everything after a full ring is lost. */
+    BOOST_REQUIRE_EQUAL(stream.available(), 128);
+    std::vector<uint8_t> samples(2 * 128);
+    BOOST_REQUIRE_EQUAL(stream.read(samples.data(), 128), 128);
+    BOOST_REQUIRE_EQUAL(value(&samples[0]), 0);
+    BOOST_REQUIRE_EQUAL(value(&samples[2 * 127]), 127);
+    BOOST_REQUIRE_EQUAL(stream.samples(), 128);
+    BOOST_REQUIRE_EQUAL(stream.overruns() % 64, 0);
+}
+
+BOOST_AUTO_TEST_CASE(slots_queued_ahead_of_reads)
+{
+    auto adc = std::make_shared<counting_adc>();
+    auto emu = new deferred_emulator;
+    emu->attach(spi::dbus3, adc);
+    spi dev { spi::dbus3, std::unique_ptr<transport> { emu } };
+
+    spi_stream stream { dev, 2, {}, std::chrono::nanoseconds(0), 4096, 64 };
+    stream.start();
+    while (stream.samples() < 2000) {
+        std::vector<uint8_t> samples(2 * 256);
+        stream.read(samples.data(), 256);
+        std::this_thread::yield();
+    }
+    stream.stop();
+
+    /*
+     * Every slot has a read and they can't overlap. If the next slot's
+     * commands were only sent once the last read came back, writes and
+     * reads would strictly alternate.
+     */
+    auto events = emu->events();
+    BOOST_TEST_MESSAGE("transport events: " << events);
+    BOOST_REQUIRE(events.find("WW") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(bad_settings)
+{
+    spi dev { spi::dbus3, std::unique_ptr<transport> { new mpsse_emulator } };
+    BOOST_REQUIRE_THROW((spi_stream { dev, 0 }), error);
+    BOOST_REQUIRE_THROW((spi_stream { dev, 1, { 1, 2 } }), error);
+    BOOST_REQUIRE_THROW(
+        (spi_stream { dev, 2, {}, std::chrono::nanoseconds(0), 128, 64, 1 }),
+        error);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,134 @@
+/* trace-tests.cpp
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <boost/test/unit_test.hpp>
+#include "ft2232h-spi/ft2232h-spi.h"
+#include "ft2232h-spi/mpsse-emulator.h"
+#include "ft2232h-spi/packet.h"
+#include "ft2232h-spi/trace.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+using namespace ft2232h_spi;
+
+namespace {
+
+const char *trace_path = "ft2232h-spi-trace-test.bin";
+
+struct fixture
+{
+    ~fixture() { std::remove(trace_path); }
+};
+
+std::unique_ptr<transport> registers(mpsse_emulator *&emu)
+{
+    emu = new mpsse_emulator;
+    emu->attach(spi::dbus3, std::make_shared<register_slave>());
+    return std::unique_ptr<transport> { emu };
+}
+
+}
+
+BOOST_AUTO_TEST_SUITE(trace_tests)
+
+BOOST_FIXTURE_TEST_CASE(record_and_replay, fixture)
+{
+    mpsse_emulator *emu;
+    spi dev { spi::dbus3, registers(emu) };
+
+    dev.startTrace(trace_path);
+    auto writes = emu->writes();
+    dev.transmit(packet { uint8_t(0x10), uint8_t(0xaa), uint8_t(0xbb) });
+    uint8_t readback[3] = { 0x90, 0, 0 };
+    dev.transfer(readback, readback, sizeof(readback));
+    dev.transmitAsync(readback, 2).get();
+    writes = emu->writes() - writes;
+    BOOST_REQUIRE_EQUAL(dev.stopTrace(), 0);
+
+    BOOST_REQUIRE_EQUAL(readback[1], 0xaa);
+    BOOST_REQUIRE_EQUAL(readback[2], 0xbb);
+
+    /* Only the traced part of the session is in the file. */
+    trace_reader reader { trace_path };
+    trace_record r;
+    uint64_t recorded_writes = 0;
+    uint64_t last_ns = 0;
+    while (reader.next(r)) {
+        recorded_writes += r.event == trace_event::write;
+        BOOST_REQUIRE_GE(r.time_ns, last_ns);
+        last_ns = r.time_ns;
+    }
+    BOOST_REQUIRE_EQUAL(recorded_writes, writes);
+
+    /* A fresh device given the same stream answers the same way. */
+    mpsse_emulator *emu2;
+    auto io = registers(emu2);
+    auto result = replay(trace_path, *io);
+    BOOST_REQUIRE_EQUAL(result.writes, writes);
+    BOOST_REQUIRE_GT(result.reads, 0);
+    BOOST_REQUIRE_EQUAL(result.mismatches, 0);
+
+    /* The device carries on normally once tracing stops. */
+    dev.transmit(packet { uint8_t(0x20), uint8_t(0x01) });
+}
+
+BOOST_FIXTURE_TEST_CASE(replay_detects_divergence, fixture)
+{
+    mpsse_emulator *emu;
+    spi dev { spi::dbus3, registers(emu) };
+    dev.transmit(packet { uint8_t(0x00), uint8_t(0x42) });
+
+    dev.startTrace(trace_path);
+    uint8_t readback[2] = { 0x80, 0 };
+    dev.transfer(readback, readback, sizeof(readback));
+    dev.stopTrace();
+    BOOST_REQUIRE_EQUAL(readback[1], 0x42);
+
+    /* Register 0 was never written on this device. */
+    mpsse_emulator *emu2;
+    auto io = registers(emu2);
+    auto result = replay(trace_path, *io);
+    BOOST_REQUIRE_EQUAL(result.mismatches, 1);
+}
+
+BOOST_AUTO_TEST_CASE(disk_full)
+{
+    mpsse_emulator *emu;
+    spi dev { spi::dbus3, registers(emu) };
+
+    /* Every write to /dev/full fails with ENOSPC. */
+    dev.startTrace("/dev/full");
+    std::vector<uint8_t> data(100000, 0x55);
+    dev.transmit(data.data(), data.size());
+    BOOST_REQUIRE_THROW(dev.stopTrace(), error);
+
+    /* The device is untraced and usable again. */
+    BOOST_REQUIRE_EQUAL(dev.stopTrace(), 0);
+    dev.transmit(packet { uint8_t(0x20), uint8_t(0x01) });
+}
+
+BOOST_AUTO_TEST_CASE(bad_file)
+{
+    mpsse_emulator *emu;
+    spi dev { spi::dbus3, registers(emu) };
+    BOOST_REQUIRE_THROW(dev.startTrace("/nonexistent/dir/trace.bin"), error);
+    dev.transmit(packet { uint8_t(0x00), uint8_t(0x01) });
+    BOOST_REQUIRE_THROW(trace_reader { "/nonexistent/dir/trace.bin" }, error);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,216 @@
+/* batch.cpp
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ft2232h-spi.h"
+
+#include "mpsse.h"
+#include "packet.h"
+
+namespace ft2232h_spi {
+
+using batch = spi::batch;
+
+batch& batch::select(pins cs)
+{
+    if (selected_) {
+        throw error(WHEN("chip select is already asserted."));
+    }
+    if (cs & serial_pins) {
+        throw error(WHEN("ADBUS0-2 can't be used as a chip select."));
+    }
+    selected_ = true;
+    selects_ |= cs;
+    steps_.push_back({ step_type::select, nullptr, nullptr, cs, 0 });
+    return *this;
+}
+
+batch& batch::deselect()
+{
+    if (!selected_) {
+        throw error(WHEN("chip select is not asserted."));
+    }
+    selected_ = false;
+    ++transactions_;
+    steps_.push_back({ step_type::deselect, nullptr, nullptr, 0, 0 });
+    return *this;
+}
+
+batch& batch::write(const uint8_t *data, size_t size)
+{
+    return this->data(step_type::write, data, nullptr, size);
+}
+
+batch& batch::write(const packet& p)
+{
+    /* Validate before copying so a rejected packet leaves nothing behind. */
+    size_t offset = storage_.size();
+    data(step_type::write, nullptr, nullptr, p.size());
+    steps_.back().offset = offset;
+    storage_.insert(storage_.end(), p.data(), p.data() + p.size());
+    return *this;
+}
+
+batch& batch::read(uint8_t *rx, size_t size)
+{
+    return data(step_type::read, nullptr, rx, size);
+}
+
+batch& batch::exchange(const uint8_t *tx, uint8_t *rx, size_t size)
+{
+    return data(step_type::read_write, tx, rx, size);
+}
+
+batch& batch::transmit(const uint8_t *data, size_t size)
+{
+    return select().write(data, size).deselect();
+}
+
+batch& batch::transmit(const packet& p)
+{
+    return select().write(p).deselect();
+}
+
+batch& batch::transfer(const uint8_t *tx, uint8_t *rx, size_t size)
+{
+    return select().exchange(tx, rx, size).deselect();
+}
+
+batch& batch::receive(uint8_t *rx, size_t size)
+{
+    return select().read(rx, size).deselect();
+}
+
+batch& batch::setClock(uint32_t hz)
+{
+    if (hz < min_clock_hz) {
+        throw error(WHEN("clock is below what the divisor can reach."));
+    }
+    steps_.push_back({ step_type::set_clock, nullptr, nullptr, hz, 0 });
+    return *this;
+}
+
+batch& batch::waitHigh(uint32_t timeout_ms)
+{
+    ++waits_;
+    steps_.push_back({ step_type::wait_high, nullptr, nullptr, timeout_ms, 0 });
+    return *this;
+}
+
+batch& batch::waitLow(uint32_t timeout_ms)
+{
+    ++waits_;
+    steps_.push_back({ step_type::wait_low, nullptr, nullptr, timeout_ms, 0 });
+    return *this;
+}
+
+batch& batch::delay(std::chrono::nanoseconds t)
+{
+    if (t.count() < 0) {
+        throw error(WHEN("can't delay for a negative time."));
+    }
+    if (selected_ && uint64_t(t.count()) > max_framed_delay_ns) {
+        throw error(WHEN("delay is too long for inside a frame."));
+    }
+    steps_.push_back({ step_type::delay, nullptr, nullptr, size_t(t.count()), 0 });
+    return *this;
+}
+
+batch& batch::gpioSet(uint16_t mask)
+{
+    return gpio(step_type::gpio_set, mask);
+}
+
+batch& batch::gpioClear(uint16_t mask)
+{
+    return gpio(step_type::gpio_clear, mask);
+}
+
+batch& batch::gpioRelease(uint16_t mask)
+{
+    return gpio(step_type::gpio_release, mask);
+}
+
+batch& batch::gpioRead(uint8_t *levels)
+{
+    steps_.push_back({ step_type::gpio_read, nullptr, levels, 0, 0 });
+    return *this;
+}
+
+batch& batch::append(const batch& other, pins cs)
+{
+    if (selected_ || other.selected_) {
+        throw error(WHEN("can't append a batch inside a chip-select frame."));
+    }
+
+    size_t base = storage_.size();
+    storage_.insert(storage_.end(), other.storage_.begin(), other.storage_.end());
+
+    for (auto s : other.steps_) {
+        if (s.type == step_type::select && s.size == 0) {
+            s.size = cs;
+            selects_ |= cs;
+        }
+        if (s.type == step_type::write && !s.out) {
+            s.offset += base;
+        }
+        steps_.push_back(s);
+    }
+    transactions_ += other.transactions_;
+    payload_ += other.payload_;
+    waits_ += other.waits_;
+    gpio_ |= other.gpio_;
+    selects_ |= other.selects_;
+    return *this;
+}
+
+void batch::clear()
+{
+    steps_.clear();
+    storage_.clear();
+    transactions_ = 0;
+    payload_ = 0;
+    waits_ = 0;
+    selected_ = false;
+    gpio_ = 0;
+    selects_ = 0;
+}
+
+batch& batch::data(
+    step_type type, const uint8_t *out, uint8_t *in, size_t size)
+{
+    if (!selected_) {
+        throw error(WHEN("data steps must be inside a chip-select frame."));
+    }
+    if (size < 1) {
+        throw error(WHEN("can't queue a step with <1 bytes."));
+    }
+    steps_.push_back({ type, out, in, size, 0 });
+    payload_ += size;
+    return *this;
+}
+
+batch& batch::gpio(step_type type, uint16_t mask)
+{
+    if (mask & ~uint16_t(0xfff0)) {
+        throw error(WHEN("ADBUS0-3 can't be used as GPIO."));
+    }
+    gpio_ |= mask;
+    steps_.push_back({ type, nullptr, nullptr, mask, 0 });
+    return *this;
+}
+
+} /* namespace ft2232h_spi */
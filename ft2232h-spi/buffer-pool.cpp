@@ -0,0 +1,172 @@
+/* buffer-pool.cpp
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "buffer-pool.h"
+
+#include <utility>
+
+namespace ft2232h_spi {
+
+namespace {
+
+/*
+ * Over-allocate by the alignment and stash the distance back to the start
+ * of the block in the byte just before the aligned pointer.
+ */
+uint8_t *allocateAligned(size_t size)
+{
+    auto block = new uint8_t[size + buffer_pool::alignment];
+    auto offset = buffer_pool::alignment -
+        (reinterpret_cast<uintptr_t>(block) & (buffer_pool::alignment - 1));
+    auto result = block + offset;
+    result[-1] = uint8_t(offset);
+    return result;
+}
+
+void freeAligned(uint8_t *data)
+{
+    delete[] (data - data[-1]);
+}
+
+}
+
+constexpr size_t buffer_pool::alignment;
+
+buffer_pool::buffer::buffer(buffer&& other) noexcept :
+    pool_(other.pool_),
+    data_(other.data_)
+{
+    other.pool_ = nullptr;
+    other.data_ = nullptr;
+}
+
+buffer_pool::buffer& buffer_pool::buffer::operator=(buffer&& other) noexcept
+{
+    if (this != &other) {
+        reset();
+        std::swap(pool_, other.pool_);
+        std::swap(data_, other.data_);
+    }
+    return *this;
+}
+
+size_t buffer_pool::buffer::size() const
+{
+    return pool_ ? pool_->bufferSize() : 0;
+}
+
+void buffer_pool::buffer::reset()
+{
+    if (data_) {
+        pool_->release(data_);
+        pool_ = nullptr;
+        data_ = nullptr;
+    }
+}
+
+buffer_pool::buffer_pool(size_t buffer_size, size_t high_water) :
+    buffer_size_(buffer_size),
+    high_water_(high_water)
+{
+}
+
+buffer_pool::~buffer_pool()
+{
+    for (auto data : idle_) {
+        freeAligned(data);
+    }
+}
+
+buffer_pool::buffer buffer_pool::acquire()
+{
+    {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        if (!idle_.empty()) {
+            ++hits_;
+            ++borrowed_;
+            auto data = idle_.back();
+            idle_.pop_back();
+            return buffer { this, data };
+        }
+        ++misses_;
+    }
+
+    buffer result { this, allocateAligned(buffer_size_) };
+    std::lock_guard<std::mutex> lock { mutex_ };
+    ++borrowed_;
+    return result;
+}
+
+void buffer_pool::setHighWater(size_t buffers)
+{
+    std::vector<uint8_t*> excess;
+    {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        high_water_ = buffers;
+        while (idle_.size() > high_water_) {
+            excess.push_back(idle_.back());
+            idle_.pop_back();
+        }
+    }
+    for (auto data : excess) {
+        freeAligned(data);
+    }
+}
+
+size_t buffer_pool::highWater() const
+{
+    std::lock_guard<std::mutex> lock { mutex_ };
+    return high_water_;
+}
+
+size_t buffer_pool::idle() const
+{
+    std::lock_guard<std::mutex> lock { mutex_ };
+    return idle_.size();
+}
+
+size_t buffer_pool::borrowed() const
+{
+    std::lock_guard<std::mutex> lock { mutex_ };
+    return borrowed_;
+}
+
+uint64_t buffer_pool::hits() const
+{
+    std::lock_guard<std::mutex> lock { mutex_ };
+    return hits_;
+}
+
+uint64_t buffer_pool::misses() const
+{
+    std::lock_guard<std::mutex> lock { mutex_ };
+    return misses_;
+}
+
+void buffer_pool::release(uint8_t *data)
+{
+    {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        --borrowed_;
+        if (idle_.size() < high_water_) {
+            idle_.push_back(data);
+            return;
+        }
+    }
+    freeAligned(data);
+}
+
+} /* namespace ft2232h_spi */
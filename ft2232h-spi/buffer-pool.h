@@ -0,0 +1,102 @@
+/* buffer-pool.h
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef FT2232H_SPI_BUFFER_POOL_H
+#define FT2232H_SPI_BUFFER_POOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace ft2232h_spi
+{
+
+/*
+ * A free list of equally sized, cache-line aligned transfer buffers.
+ * Buffers are borrowed with acquire() and go back to the pool when their
+ * handle is destroyed. At most high_water idle buffers are kept; any
+ * returned beyond that are freed, so a device that has finished a burst
+ * of traffic doesn't sit on its peak footprint.
+ *
+ * Safe to use from several threads. The pool must outlive every buffer
+ * borrowed from it.
+ */
+class buffer_pool
+{
+public:
+    static constexpr size_t alignment = 64;
+
+    class buffer
+    {
+    public:
+        buffer() noexcept { }
+        buffer(buffer&& other) noexcept;
+        buffer& operator=(buffer&& other) noexcept;
+        buffer(const buffer&) = delete;
+        buffer& operator=(const buffer&) = delete;
+        ~buffer() { reset(); }
+
+        uint8_t *data() const { return data_; }
+        size_t size() const;
+        explicit operator bool() const { return data_ != nullptr; }
+
+        /* Hand the buffer back to its pool early. */
+        void reset();
+
+    private:
+        friend class buffer_pool;
+
+        buffer(buffer_pool *pool, uint8_t *data) : pool_(pool), data_(data) { }
+
+        buffer_pool *pool_ = nullptr;
+        uint8_t *data_ = nullptr;
+    };
+
+    buffer_pool(size_t buffer_size, size_t high_water);
+    buffer_pool(const buffer_pool&) = delete;
+    buffer_pool& operator=(const buffer_pool&) = delete;
+    ~buffer_pool();
+
+    /* An idle buffer if there is one (a hit), otherwise a new one. */
+    buffer acquire();
+
+    void setHighWater(size_t buffers);
+    size_t highWater() const;
+
+    size_t bufferSize() const { return buffer_size_; }
+    size_t idle() const;
+
+    /* Buffers currently handed out and not yet returned. */
+    size_t borrowed() const;
+    uint64_t hits() const;
+    uint64_t misses() const;
+
+private:
+    void release(uint8_t *data);
+
+    const size_t buffer_size_;
+    mutable std::mutex mutex_;
+    std::vector<uint8_t*> idle_;
+    size_t high_water_;
+    size_t borrowed_ = 0;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+};
+
+} /* namespace ft2232h_spi */
+
+#endif /* FT2232H_SPI_BUFFER_POOL_H */
@@ -0,0 +1,113 @@
+/* command-buffer.cpp
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "command-buffer.h"
+
+#include <algorithm>
+#include <atomic>
+
+namespace ft2232h_spi {
+
+namespace {
+
+std::atomic<uint64_t> allocation_count { 0 };
+
+}
+
+constexpr size_t command_buffer::inline_capacity;
+
+command_buffer::command_buffer(buffer_pool::buffer block) noexcept :
+    data_(block ? block.data() : inline_),
+    capacity_(block ? block.size() : inline_capacity),
+    block_(std::move(block))
+{
+}
+
+command_buffer::command_buffer(command_buffer&& other) noexcept
+{
+    take(other);
+}
+
+command_buffer& command_buffer::operator=(command_buffer&& other) noexcept
+{
+    if (this != &other) {
+        release();
+        take(other);
+    }
+    return *this;
+}
+
+command_buffer::~command_buffer()
+{
+    release();
+}
+
+void command_buffer::reserve(size_t capacity)
+{
+    if (capacity <= capacity_) {
+        return;
+    }
+
+    auto block = new uint8_t[capacity];
+    ++allocation_count;
+    if (size_ > 0) {
+        memcpy(block, data_, size_);
+    }
+    release();
+    data_ = block;
+    capacity_ = capacity;
+}
+
+uint64_t command_buffer::allocations()
+{
+    return allocation_count;
+}
+
+void command_buffer::grow(size_t needed)
+{
+    reserve(std::max(needed, 2 * capacity_));
+}
+
+void command_buffer::release()
+{
+    if (block_) {
+        block_.reset();
+    } else if (onHeap()) {
+        delete[] data_;
+    }
+    data_ = inline_;
+    capacity_ = inline_capacity;
+}
+
+void command_buffer::take(command_buffer& other)
+{
+    if (other.onHeap()) {
+        data_ = other.data_;
+        capacity_ = other.capacity_;
+    } else {
+        data_ = inline_;
+        capacity_ = inline_capacity;
+        memcpy(inline_, other.inline_, other.size_);
+    }
+    size_ = other.size_;
+    block_ = std::move(other.block_);
+
+    other.data_ = other.inline_;
+    other.capacity_ = inline_capacity;
+    other.size_ = 0;
+}
+
+} /* namespace ft2232h_spi */
@@ -0,0 +1,109 @@
+/* command-buffer.h
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef FT2232H_SPI_COMMAND_BUFFER_H
+#define FT2232H_SPI_COMMAND_BUFFER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "ft2232h-spi/buffer-pool.h"
+#include "ft2232h-spi/packet.h"
+
+namespace ft2232h_spi
+{
+
+/*
+ * A growable byte buffer for MPSSE command streams. Short control
+ * sequences stay in the inline buffer; anything bigger spills to a heap
+ * block that is kept across clear() so a buffer that's reused for every
+ * transfer stops allocating once it has reached its working size.
+ *
+ * Buffers are move-only: moving hands over the heap block rather than
+ * copying it. A buffer can also start out in a block borrowed from a
+ * buffer_pool, which goes back to the pool when the buffer is done with it.
+ */
+class command_buffer
+{
+public:
+    /* Big enough for any of the fixed control sequences. */
+    static constexpr size_t inline_capacity = 64;
+
+    command_buffer() noexcept { }
+    explicit command_buffer(size_t capacity) { reserve(capacity); }
+    explicit command_buffer(buffer_pool::buffer block) noexcept;
+    command_buffer(command_buffer&& other) noexcept;
+    command_buffer& operator=(command_buffer&& other) noexcept;
+    command_buffer(const command_buffer&) = delete;
+    command_buffer& operator=(const command_buffer&) = delete;
+    ~command_buffer();
+
+    void reserve(size_t capacity);
+
+    /*
+     * Grow by size bytes and return where they start, so callers can
+     * encode straight into the buffer.
+     */
+    uint8_t *extend(size_t size)
+    {
+        if (size > capacity_ - size_) {
+            grow(size_ + size);
+        }
+        auto result = data_ + size_;
+        size_ += size;
+        return result;
+    }
+
+    void append(const uint8_t *data, size_t size)
+    {
+        if (size > 0) {
+            memcpy(extend(size), data, size);
+        }
+    }
+
+    void append(const packet& p) { append(p.data(), p.size()); }
+
+    template<size_t N>
+    void append(const static_packet<N>& p) { memcpy(extend(N), p.data(), N); }
+
+    void clear() { size_ = 0; }
+
+    const uint8_t *data() const { return data_; }
+    uint8_t *data() { return data_; }
+    size_t size() const { return size_; }
+    size_t capacity() const { return capacity_; }
+    bool empty() const { return size_ == 0; }
+    bool onHeap() const { return data_ != inline_; }
+
+    /* Heap blocks allocated by all command buffers in this process. */
+    static uint64_t allocations();
+
+private:
+    void grow(size_t needed);
+    void release();
+    void take(command_buffer& other);
+
+    uint8_t *data_ = inline_;
+    size_t size_ = 0;
+    size_t capacity_ = inline_capacity;
+    buffer_pool::buffer block_;
+    uint8_t inline_[inline_capacity];
+};
+
+} /* namespace ft2232h_spi */
+
+#endif /* FT2232H_SPI_COMMAND_BUFFER_H */
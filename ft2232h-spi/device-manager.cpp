@@ -0,0 +1,176 @@
+/* device-manager.cpp
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "device-manager.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace ft2232h_spi {
+
+struct device_manager::device
+{
+    device(const endpoint& ep, spi::busses bus) :
+        ep(ep),
+        bus(bus)
+    { }
+    ~device();
+
+    void start();
+    std::future<void> post(std::function<void()> fn);
+    void run();
+
+    endpoint ep;
+    spi::busses bus;
+    std::unique_ptr<spi> dev;
+
+    std::mutex mutex;
+    std::condition_variable work;
+    std::deque<std::packaged_task<void()>> tasks;
+    bool stopping = false;
+    std::thread thread;
+};
+
+device_manager::device::~device()
+{
+    if (thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock { mutex };
+            stopping = true;
+        }
+        work.notify_all();
+        thread.join();
+    }
+}
+
+void device_manager::device::start()
+{
+    thread = std::thread { [this]() { run(); } };
+}
+
+std::future<void> device_manager::device::post(std::function<void()> fn)
+{
+    std::packaged_task<void()> task { std::move(fn) };
+    auto result = task.get_future();
+    {
+        std::lock_guard<std::mutex> lock { mutex };
+        tasks.push_back(std::move(task));
+    }
+    work.notify_one();
+    return result;
+}
+
+void device_manager::device::run()
+{
+    std::unique_lock<std::mutex> lock { mutex };
+    for (;;) {
+        work.wait(lock, [this]() { return stopping || !tasks.empty(); });
+        if (tasks.empty()) {
+            return;
+        }
+
+        auto task = std::move(tasks.front());
+        tasks.pop_front();
+        lock.unlock();
+        task();
+        lock.lock();
+    }
+}
+
+device_manager::device_manager(
+    int vid, int pid, spi::pins cs_pin,
+    const std::vector<spi::busses>& busses,
+    uint32_t clock_hz) :
+        device_manager(
+            getAvailableEndpoints(vid, pid), cs_pin, busses, clock_hz)
+{
+}
+
+device_manager::device_manager(
+    const std::vector<endpoint>& endpoints, spi::pins cs_pin,
+    const std::vector<spi::busses>& busses,
+    uint32_t clock_hz)
+{
+    for (auto& ep : endpoints) {
+        for (auto bus : busses) {
+            devices_.emplace_back(new device { ep, bus });
+        }
+    }
+
+    /* Opening a device takes a while, so open them all at once. */
+    std::vector<std::future<void>> opened;
+    opened.reserve(devices_.size());
+    for (auto& d : devices_) {
+        d->start();
+        auto dev = d.get();
+        opened.push_back(dev->post([dev, cs_pin, clock_hz]() {
+            dev->dev.reset(new spi { cs_pin, dev->ep, dev->bus, clock_hz });
+        }));
+    }
+    for (auto& f : opened) {
+        f.get();
+    }
+}
+
+device_manager::~device_manager()
+{
+}
+
+const endpoint& device_manager::endpointAt(size_t index) const
+{
+    return devices_.at(index)->ep;
+}
+
+spi::busses device_manager::busAt(size_t index) const
+{
+    return devices_.at(index)->bus;
+}
+
+std::future<void> device_manager::submit(
+    size_t index, std::function<void(spi&)> fn)
+{
+    auto dev = devices_.at(index).get();
+    return dev->post([dev, fn]() { fn(*dev->dev); });
+}
+
+void device_manager::forEach(std::function<void(size_t, spi&)> fn)
+{
+    std::vector<std::future<void>> done;
+    done.reserve(devices_.size());
+    for (size_t i = 0; i < devices_.size(); ++i) {
+        auto dev = devices_[i].get();
+        done.push_back(dev->post([dev, fn, i]() { fn(i, *dev->dev); }));
+    }
+
+    std::exception_ptr first;
+    for (auto& f : done) {
+        try {
+            f.get();
+        } catch (...) {
+            if (!first) {
+                first = std::current_exception();
+            }
+        }
+    }
+    if (first) {
+        std::rethrow_exception(first);
+    }
+}
+
+} /* namespace ft2232h_spi */
@@ -0,0 +1,79 @@
+/* device-manager.h
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef FT2232H_SPI_DEVICE_MANAGER_H
+#define FT2232H_SPI_DEVICE_MANAGER_H
+
+#include <functional>
+#include <future>
+#include <memory>
+#include <vector>
+
+#include "ft2232h-spi/ft2232h-spi.h"
+
+namespace ft2232h_spi
+{
+
+/*
+ * Opens every matching adapter (and every requested channel on each) and
+ * drives each resulting spi from its own thread, so independent devices
+ * run in parallel instead of taking turns on one handle.
+ */
+class device_manager
+{
+public:
+    device_manager(
+        int vid, int pid, spi::pins cs_pin,
+        const std::vector<spi::busses>& busses = { spi::bus_a },
+        uint32_t clock_hz = spi::default_clock_hz);
+
+    /*
+     * Open the given adapters, e.g. from an endpoint_cache, rather than
+     * scanning the bus for them again.
+     */
+    device_manager(
+        const std::vector<endpoint>& endpoints, spi::pins cs_pin,
+        const std::vector<spi::busses>& busses = { spi::bus_a },
+        uint32_t clock_hz = spi::default_clock_hz);
+    ~device_manager();
+
+    device_manager(const device_manager&) = delete;
+    device_manager& operator=(const device_manager&) = delete;
+
+    size_t size() const { return devices_.size(); }
+    const endpoint& endpointAt(size_t index) const;
+    spi::busses busAt(size_t index) const;
+
+    /*
+     * Queue fn to run against device index on that device's thread. Work
+     * for one device runs in submission order.
+     */
+    std::future<void> submit(size_t index, std::function<void(spi&)> fn);
+
+    /*
+     * Run fn against every device in parallel and wait for all of them.
+     * The first exception thrown, if any, is rethrown once all are done.
+     */
+    void forEach(std::function<void(size_t, spi&)> fn);
+
+private:
+    struct device;
+    std::vector<std::unique_ptr<device>> devices_;
+};
+
+} /* namespace ft2232h_spi */
+
+#endif /* FT2232H_SPI_DEVICE_MANAGER_H */
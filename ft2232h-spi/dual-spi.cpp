@@ -0,0 +1,158 @@
+/* dual-spi.cpp
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "dual-spi.h"
+
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <vector>
+
+#include "transport.h"
+
+namespace ft2232h_spi {
+
+namespace {
+
+typedef std::chrono::steady_clock steady_clock;
+
+double secondsSince(steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(steady_clock::now() - start).count();
+}
+
+}
+
+constexpr size_t dual_spi::channels;
+constexpr size_t dual_spi::default_stripe_size;
+
+dual_spi::dual_spi(spi::pins cs_pin, const endpoint& ep, uint32_t clock_hz)
+{
+    channels_[0].reset(new spi { cs_pin, ep, spi::bus_a, clock_hz });
+    channels_[1].reset(new spi { cs_pin, ep, spi::bus_b, clock_hz });
+}
+
+dual_spi::dual_spi(
+    spi::pins cs_pin, std::unique_ptr<transport> a,
+    std::unique_ptr<transport> b, uint32_t clock_hz)
+{
+    channels_[0].reset(new spi { cs_pin, std::move(a), clock_hz });
+    channels_[1].reset(new spi { cs_pin, std::move(b), clock_hz });
+}
+
+dual_spi::result dual_spi::transmitStriped(
+    const uint8_t *data, size_t size, size_t stripe_size)
+{
+    if (stripe_size < 1) {
+        throw error(WHEN("can't stripe in pieces of <1 bytes."));
+    }
+
+    std::vector<spi::segment> shares[channels];
+    for (size_t offset = 0, i = 0; offset < size; offset += stripe_size, ++i) {
+        size_t piece = std::min(stripe_size, size - offset);
+        shares[i % channels].push_back({ data + offset, piece });
+    }
+
+    return run([&](spi& s, size_t index) -> uint64_t {
+        auto& share = shares[index];
+        if (share.empty()) {
+            return 0;
+        }
+        s.transmit(share.data(), share.size());
+        uint64_t bytes = 0;
+        for (auto& seg : share) {
+            bytes += seg.size;
+        }
+        return bytes;
+    });
+}
+
+dual_spi::result dual_spi::receiveStriped(
+    uint8_t *data, size_t size, size_t stripe_size)
+{
+    if (stripe_size < 1) {
+        throw error(WHEN("can't stripe in pieces of <1 bytes."));
+    }
+
+    spi::batch shares[channels];
+    for (auto& b : shares) {
+        b.select();
+    }
+    for (size_t offset = 0, i = 0; offset < size; offset += stripe_size, ++i) {
+        size_t piece = std::min(stripe_size, size - offset);
+        shares[i % channels].read(data + offset, piece);
+    }
+    for (auto& b : shares) {
+        b.deselect();
+    }
+
+    return run([&](spi& s, size_t index) -> uint64_t {
+        auto& b = shares[index];
+        if (b.payload() == 0) {
+            return 0;
+        }
+        s.execute(b);
+        return b.payload();
+    });
+}
+
+dual_spi::result dual_spi::transmitMirrored(const uint8_t *data, size_t size)
+{
+    return run([&](spi& s, size_t) -> uint64_t {
+        s.transmit(data, size);
+        return size;
+    });
+}
+
+dual_spi::result dual_spi::run(
+    const std::function<uint64_t(spi&, size_t)>& fn)
+{
+    result r {};
+    auto start = steady_clock::now();
+
+    std::future<void> done[channels];
+    for (size_t i = 0; i < channels; ++i) {
+        done[i] = std::async(std::launch::async, [&, i]() {
+            auto started = steady_clock::now();
+            r.channel[i].bytes = fn(*channels_[i], i);
+            r.channel[i].seconds = secondsSince(started);
+        });
+    }
+
+    /* Let both finish before reporting either one's failure. */
+    std::exception_ptr failure;
+    for (auto& f : done) {
+        try {
+            f.get();
+        } catch (...) {
+            if (!failure) {
+                failure = std::current_exception();
+            }
+        }
+    }
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+
+    r.total.seconds = secondsSince(start);
+    for (auto& c : r.channel) {
+        r.total.bytes += c.bytes;
+    }
+    return r;
+}
+
+} /* namespace ft2232h_spi */
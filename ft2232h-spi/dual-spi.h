@@ -0,0 +1,88 @@
+/* dual-spi.h
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef FT2232H_SPI_DUAL_SPI_H
+#define FT2232H_SPI_DUAL_SPI_H
+
+#include <functional>
+
+#include "ft2232h-spi/ft2232h-spi.h"
+
+namespace ft2232h_spi
+{
+
+/*
+ * Both MPSSE channels of one FT2232H, driven in parallel. Each channel
+ * is an ordinary spi with its own USB context and I/O thread, so the two
+ * never wait on each other. The helpers below run one thread per channel
+ * and time each channel separately.
+ */
+class dual_spi
+{
+public:
+    static constexpr size_t channels = 2;
+    static constexpr size_t default_stripe_size = 4096;
+
+    /* Per-channel figures, plus the total against wall-clock time. */
+    struct result
+    {
+        throughput channel[channels];
+        throughput total;
+    };
+
+    /* Open channels A and B of ep, both with chip select cs_pin. */
+    dual_spi(
+        spi::pins cs_pin, const endpoint& ep,
+        uint32_t clock_hz = spi::default_clock_hz);
+
+    /* Drive already-open channels, e.g. two mpsse_emulators. */
+    dual_spi(
+        spi::pins cs_pin, std::unique_ptr<transport> a,
+        std::unique_ptr<transport> b,
+        uint32_t clock_hz = spi::default_clock_hz);
+
+    spi& channel(size_t index) { return *channels_[index]; }
+
+    /*
+     * Deal data out in stripe_size pieces, alternately to A and B, like
+     * RAID 0: each channel sends its share as one chip-select frame.
+     */
+    result transmitStriped(
+        const uint8_t *data, size_t size,
+        size_t stripe_size = default_stripe_size);
+
+    /* The reverse: gather the stripes read from A and B back into data. */
+    result receiveStriped(
+        uint8_t *data, size_t size, size_t stripe_size = default_stripe_size);
+
+    /* Send the same data on both channels at once. */
+    result transmitMirrored(const uint8_t *data, size_t size);
+
+    /*
+     * Run fn(channel, index) on both channels concurrently, e.g. to
+     * program two identical flash chips with spi_flash. fn returns the
+     * number of bytes it moved, for the throughput figures. The first
+     * exception thrown by either is rethrown once both have finished.
+     */
+    result run(const std::function<uint64_t(spi&, size_t)>& fn);
+
+private:
+    std::unique_ptr<spi> channels_[channels];
+};
+
+} /* namespace ft2232h_spi */
+
+#endif /* FT2232H_SPI_DUAL_SPI_H */
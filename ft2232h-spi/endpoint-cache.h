@@ -0,0 +1,75 @@
+/* endpoint-cache.h
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef FT2232H_SPI_ENDPOINT_CACHE_H
+#define FT2232H_SPI_ENDPOINT_CACHE_H
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "ft2232h-spi/ft2232h-spi.h"
+
+namespace ft2232h_spi
+{
+
+/*
+ * The adapters with a given vid/pid, kept up to date as they come and go.
+ * Entries are keyed by USB location (endpoint::path), so an adapter's
+ * strings are read once, when it first appears, rather than on every
+ * scan. Where libusb supports hotplug, a background thread applies
+ * arrivals and removals as they happen. Elsewhere each query rescans the
+ * device list, which doesn't open anything.
+ *
+ * Endpoints come back sorted by path, so an index keeps naming the same
+ * socket, and open by location.
+ */
+class endpoint_cache
+{
+public:
+    /* Called with the endpoint and true on arrival, false on removal. */
+    typedef std::function<void(const endpoint&, bool)> listener;
+
+    endpoint_cache(int vid, int pid);
+    ~endpoint_cache();
+
+    endpoint_cache(const endpoint_cache&) = delete;
+    endpoint_cache& operator=(const endpoint_cache&) = delete;
+
+    std::vector<endpoint> endpoints();
+    size_t size();
+
+    /* The index-th adapter by path; throws if there are fewer. */
+    endpoint at(size_t index);
+
+    /* False if changes are only picked up when the cache is queried. */
+    bool hotplug() const;
+
+    /*
+     * Called from the hotplug thread, or from a query when there isn't
+     * one, once a new adapter's strings have been read or as soon as one
+     * has gone. Must not call back into the cache.
+     */
+    void setListener(listener fn);
+
+private:
+    struct impl;
+    std::unique_ptr<impl> impl_;
+};
+
+} /* namespace ft2232h_spi */
+
+#endif /* FT2232H_SPI_ENDPOINT_CACHE_H */
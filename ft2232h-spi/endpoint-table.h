@@ -0,0 +1,177 @@
+/* endpoint-table.h
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef FT2232H_SPI_ENDPOINT_TABLE_H
+#define FT2232H_SPI_ENDPOINT_TABLE_H
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ft2232h-spi/ft2232h-spi.h"
+
+namespace ft2232h_spi
+{
+
+/*
+ * The bookkeeping behind endpoint_cache: one entry per USB location
+ * (endpoint::path), holding whichever Device is plugged in there. Device
+ * is an opaque handle, a libusb_device* in the cache, and the table
+ * neither locks nor counts references; entries it drops are handed back
+ * so the caller can release them and report the ones it had announced.
+ */
+template<class Device>
+class endpoint_table
+{
+public:
+    struct entry
+    {
+        Device dev;
+        endpoint ep;
+
+        /* Whether ep's strings have been read yet. */
+        bool resolved;
+    };
+
+    /*
+     * Record dev at ep.path with its strings still to be read. Returns
+     * false if dev is already there. A different device at the same path,
+     * i.e. one re-plugged before its removal was seen, is moved to removed.
+     */
+    bool add(Device dev, const endpoint& ep, std::vector<entry>& removed)
+    {
+        auto it = entries_.find(ep.path);
+        if (it != entries_.end()) {
+            if (it->second.dev == dev) {
+                return false;
+            }
+            removed.push_back(std::move(it->second));
+            entries_.erase(it);
+        }
+        entries_.emplace(ep.path, entry { dev, ep, false });
+        return true;
+    }
+
+    /* Move dev's entry, if it has one, to removed. */
+    void remove(Device dev, std::vector<entry>& removed)
+    {
+        auto it = std::find_if(
+            entries_.begin(), entries_.end(),
+            [dev](const typename map::value_type& e) {
+                return e.second.dev == dev;
+            });
+        if (it != entries_.end()) {
+            removed.push_back(std::move(it->second));
+            entries_.erase(it);
+        }
+    }
+
+    /* Move the entries of devices not in present to removed. */
+    void retain(
+        const std::vector<Device>& present, std::vector<entry>& removed)
+    {
+        for (auto it = entries_.begin(); it != entries_.end(); ) {
+            auto dev = it->second.dev;
+            if (std::find(present.begin(), present.end(), dev) ==
+                present.end())
+            {
+                removed.push_back(std::move(it->second));
+                it = entries_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    /* Entries whose strings haven't been read. */
+    std::vector<entry> unresolved() const
+    {
+        std::vector<entry> result;
+        for (auto& e : entries_) {
+            if (!e.second.resolved) {
+                result.push_back(e.second);
+            }
+        }
+        return result;
+    }
+
+    /*
+     * Store the strings read from dev. Returns false, leaving the table
+     * alone, if dev is no longer at ep.path.
+     */
+    bool resolve(Device dev, const endpoint& ep)
+    {
+        auto it = entries_.find(ep.path);
+        if (it == entries_.end() || it->second.dev != dev) {
+            return false;
+        }
+        it->second.ep = ep;
+        it->second.resolved = true;
+        return true;
+    }
+
+    /* Resolved endpoints, sorted by path. */
+    std::vector<endpoint> endpoints() const
+    {
+        std::vector<endpoint> result;
+        for (auto& e : entries_) {
+            if (e.second.resolved) {
+                result.push_back(e.second.ep);
+            }
+        }
+        return result;
+    }
+
+    size_t size() const
+    {
+        return std::count_if(
+            entries_.begin(), entries_.end(),
+            [](const typename map::value_type& e) {
+                return e.second.resolved;
+            });
+    }
+
+    /* The index-th of endpoints(); throws if there are fewer. */
+    const endpoint& at(size_t index) const
+    {
+        for (auto& e : entries_) {
+            if (e.second.resolved && index-- == 0) {
+                return e.second.ep;
+            }
+        }
+        throw error(WHEN("no adapter at that index."));
+    }
+
+    /* Every device held, resolved or not. */
+    std::vector<Device> devices() const
+    {
+        std::vector<Device> result;
+        for (auto& e : entries_) {
+            result.push_back(e.second.dev);
+        }
+        return result;
+    }
+
+private:
+    typedef std::map<std::string, entry> map;
+
+    map entries_;
+};
+
+} /* namespace ft2232h_spi */
+
+#endif /* FT2232H_SPI_ENDPOINT_TABLE_H */
@@ -17,6 +17,7 @@
 #ifndef FT2232H_SPI_EXCEPTIONS_H
 #define FT2232H_SPI_EXCEPTIONS_H
 
+#include <cstdint>
 #include <stdexcept>
 
 namespace ft2232h_spi {
@@ -33,6 +34,36 @@ public:
     { }
 };
 
+/*
+ * Raised when a pipelined fence finds the command stream out of step.
+ * Transfers are numbered from 1 in submission order; the error applies
+ * to every transfer in [first, last], none of which can be assumed to
+ * have reached the device intact.
+ */
+class pipeline_error : public error
+{
+public:
+    pipeline_error(const std::string& what, uint64_t first, uint64_t last) :
+        error(what),
+        first(first),
+        last(last)
+    { }
+
+    uint64_t first;
+    uint64_t last;
+};
+
+/*
+ * Raised when a wait-on-GPIO step doesn't see its level within the
+ * timeout. The channel has been reset and reinitialised by the time this
+ * is thrown, so none of the transfers in [first, last] completed.
+ */
+class wait_timeout : public pipeline_error
+{
+public:
+    using pipeline_error::pipeline_error;
+};
+
 } /* namespace ft2232h_spi */
 
 #endif /* FT2232H_SPI_EXCEPTIONS_H */
@@ -17,110 +17,162 @@
 
 #include "ft2232h-spi.h"
 
-#include <sstream>
+#include <array>
+#include <atomic>
 #include <ftdi.h>
+#include <mutex>
+#include <thread>
 
-#include "packet.h"
+#include "endpoint-cache.h"
+#include "endpoint-table.h"
+#include "transport.h"
 #include "util.h"
 
 namespace ft2232h_spi {
 
 namespace {
 
-ftdi_context *getContext()
-{
-    static std::unique_ptr<ftdi_context, decltype(&ftdi_free)> global_ctxt
-    { nullptr, &ftdi_free };
-    if (!global_ctxt) {
-        global_ctxt = { ftdi_new(), &ftdi_free };
-    }
-
-    return global_ctxt.get();
-}
-
-constexpr uint16_t spi_clkdiv = 0x05db; /* 1 MHz */
-constexpr uint8_t bad_opcode_reply = 0xfa;
-}
+typedef std::unique_ptr<ftdi_context, decltype(&ftdi_free)> context_ptr;
 
-struct spi::impl
+context_ptr newContext()
 {
-    impl(pins cs_pin, busses bus) :
-        ctxt(getContext()),
-        cs_pin(cs_pin)
-    {
+    context_ptr result { ftdi_new(), &ftdi_free };
+    if (!result) {
+        throw error(WHEN("ftdi_new failed."));
     }
+    return result;
+}
 
-    packet csPacket(bool cs_high);
-    void init(const endpoint& ep);
-    void sendRaw(const packet& p);
-    void sync();
-    void expectResponse(const packet& p);
-    void expectEmptyResponse();
-    void onError(const std::string& when);
+/* USB string descriptors are at most 255 bytes, plus the terminator. */
+constexpr size_t max_string_size = 256;
 
-    struct ftdi_context *ctxt;
-    pins cs_pin;
-    busses bus;
-};
+/* How long the hotplug thread blocks in libusb between checks. */
+constexpr long hotplug_poll_us = 100000;
 
-spi::~spi()
+/* The bus, then the port on each hub, as in "3-1.4". */
+std::string usbPath(libusb_device *dev)
 {
+    /* USB allows at most 7 tiers. */
+    uint8_t ports[7];
+    int depth = libusb_get_port_numbers(dev, ports, sizeof(ports));
+
+    std::string result = std::to_string(libusb_get_bus_number(dev));
+    for (int i = 0; i < depth; ++i) {
+        result += i == 0 ? '-' : '.';
+        result += std::to_string(ports[i]);
+    }
+    return result;
 }
 
-spi::spi(
-    pins cs, const endpoint& ep, busses bus)
-    noexcept(false) :
-    d(new impl { cs, bus })
+/* Checks the cached device descriptor, so nothing is opened. */
+bool matches(libusb_device *dev, int vid, int pid)
 {
-    d->init(ep);
+    libusb_device_descriptor desc;
+    return libusb_get_device_descriptor(dev, &desc) == LIBUSB_SUCCESS &&
+        equal_or_defaulted(vid, int(desc.idVendor)) &&
+        equal_or_defaulted(pid, int(desc.idProduct));
 }
 
-spi::spi(spi&& other) noexcept(true)
-    : d(std::move(other.d))
+/* Opens dev to fill in ep's strings; false if they couldn't be read. */
+bool readStrings(ftdi_context *ctxt, libusb_device *dev, endpoint& ep)
 {
-}
+    std::array<char, max_string_size> mfg_buff;
+    std::array<char, max_string_size> descr_buff;
+    std::array<char, max_string_size> serial_buff;
+
+    if (ftdi_usb_get_strings(
+        ctxt, dev,
+        mfg_buff.data(), mfg_buff.size(),
+        descr_buff.data(), descr_buff.size(),
+        serial_buff.data(), serial_buff.size()))
+    {
+        return false;
+    }
 
-spi& spi::operator=(spi&& other) noexcept(true)
-{
-    std::swap(d, other.d);
-    return *this;
+    ep.manufacturer = mfg_buff.data();
+    ep.description = descr_buff.data();
+    ep.serial = serial_buff.data();
+    return true;
 }
 
-void spi::transmit(const packet& payload)
+class device_list
 {
-    if (payload.size() < 1) {
-        throw error(WHEN("can't send a packet with <1 bytes."));
+public:
+    explicit device_list(libusb_context *usb) :
+        size_(libusb_get_device_list(usb, &list_))
+    {
+        if (size_ < 0) {
+            throw error(WHEN("libusb_get_device_list failed."));
+        }
     }
 
-    packet p;
-    p.append(d->csPacket(false));
-    p.append({ opcodes::write, uint16_t(payload.size() - 1) });
-    p.append(payload);
-    p.append(d->csPacket(true));
-    d->sendRaw(p);
-    d->expectEmptyResponse();
-}
+    ~device_list() { libusb_free_device_list(list_, 1); }
+
+    device_list(const device_list&) = delete;
+    device_list& operator=(const device_list&) = delete;
+
+    libusb_device **begin() const { return list_; }
+    libusb_device **end() const { return list_ + size_; }
 
-void spi::impl::sendRaw(const packet& p)
+private:
+    libusb_device **list_ = nullptr;
+    ssize_t size_;
+};
+
+class libftdi_transport : public transport
 {
-    if (ftdi_write_data(ctxt, const_cast<uint8_t*>(p.data()), p.size()) != p.size()) {
-        onError(WHEN("ftdi_write_data"));
-    }
-}
+public:
+    libftdi_transport(const endpoint& ep, spi::busses bus);
+
+    void write(const uint8_t *data, size_t size) override;
+    size_t read(uint8_t *data, size_t size) override;
+    std::unique_ptr<pending> submitWrite(
+        const uint8_t *data, size_t size) override;
+    std::unique_ptr<pending> submitRead(uint8_t *data, size_t size) override;
+    void setLatencyTimer(uint8_t ms) override;
+    void setChunkSizes(uint32_t write_chunk, uint32_t read_chunk) override;
+    void reset() override;
+
+private:
+    class transfer;
+
+    void openPath(const endpoint& ep);
+    void onError(const std::string& when);
 
-packet spi::impl::csPacket(bool cs_high)
+    /* Each transport owns its context so adapters and channels don't clash. */
+    context_ptr context;
+    ftdi_context *ctxt;
+};
+
+class libftdi_transport::transfer : public transport::pending
 {
-    uint8_t pin_state =
-        spi::pins::sck |
-        (cs_high ? cs_pin : 0);
-    return {
-        opcodes::set_low_bits,
-        pin_state,
-        uint8_t(pins::sck | pins::sdata | cs_pin)
-    };
-}
+public:
+    transfer(
+        libftdi_transport *owner, ftdi_transfer_control *tc,
+        const char *when) :
+            owner(owner),
+            tc(tc),
+            when(when)
+    { }
+
+    size_t wait() override
+    {
+        int rc = ftdi_transfer_data_done(tc);
+        if (rc < 0) {
+            owner->onError(when);
+        }
+        return rc;
+    }
+
+private:
+    libftdi_transport *owner;
+    ftdi_transfer_control *tc;
+    const char *when;
+};
 
-void spi::impl::init(const endpoint& ep)
+libftdi_transport::libftdi_transport(const endpoint& ep, spi::busses bus) :
+    context(newContext()),
+    ctxt(context.get())
 {
     if (ftdi_set_interface(ctxt, (ftdi_interface)bus)) {
         onError(WHEN("ftdi_set_interface"));
@@ -129,7 +181,9 @@ void spi::impl::init(const endpoint& ep)
     auto descr = ep.description.empty() ? nullptr : ep.description.c_str();
     auto serial = ep.serial.empty() ? nullptr : ep.serial.c_str();
 
-    if (ftdi_usb_open_desc(ctxt, ep.vid, ep.pid, descr, serial)) {
+    if (!ep.path.empty()) {
+        openPath(ep);
+    } else if (ftdi_usb_open_desc(ctxt, ep.vid, ep.pid, descr, serial)) {
         onError(WHEN("ftdi_usb_open_desc"));
     }
 
@@ -140,78 +194,111 @@ void spi::impl::init(const endpoint& ep)
     if (ftdi_set_bitmode(ctxt, 0, BITMODE_MPSSE)) {
         onError(WHEN("ftdi_set_bitmode"));
     }
+}
 
-    sync();
-
-    /* Set up basic parameters. */
-    sendRaw({
-        opcodes::clkdiv_5_enable,
-        opcodes::adaptive_clk_disable,
-        opcodes::three_phase_disable
-    });
-
-    /* Set the baudrate. */
-    sendRaw({
-        opcodes::set_clkdiv, spi_clkdiv
-    });
+void libftdi_transport::write(const uint8_t *data, size_t size)
+{
+    int rc = ftdi_write_data(ctxt, const_cast<uint8_t*>(data), size);
+    if (rc < 0 || size_t(rc) != size) {
+        onError(WHEN("ftdi_write_data"));
+    }
+}
 
-    /* Configure pin states. */
-    sendRaw(csPacket(true));
-    sendRaw({
-        opcodes::set_high_bits,
-        uint8_t(0),
-        uint8_t(0)
-    });
-    expectEmptyResponse();
+size_t libftdi_transport::read(uint8_t *data, size_t size)
+{
+    int rc = ftdi_read_data(ctxt, data, size);
+    if (rc < 0) {
+        onError(WHEN("ftdi_read_data"));
+    }
+    return rc;
 }
 
-void spi::impl::sync()
+std::unique_ptr<transport::pending> libftdi_transport::submitWrite(
+    const uint8_t *data, size_t size)
 {
-    uint8_t buffer[2];
-    sendRaw(opcodes::loopback_enable);
-    expectEmptyResponse();
+    auto tc = ftdi_write_data_submit(ctxt, const_cast<uint8_t*>(data), size);
+    if (!tc) {
+        onError(WHEN("ftdi_write_data_submit"));
+    }
+    return std::unique_ptr<pending> {
+        new transfer { this, tc, WHEN("ftdi_write_data") }
+    };
+}
 
-    sendRaw(opcodes::bogus);
+std::unique_ptr<transport::pending> libftdi_transport::submitRead(
+    uint8_t *data, size_t size)
+{
+    auto tc = ftdi_read_data_submit(ctxt, data, size);
+    if (!tc) {
+        onError(WHEN("ftdi_read_data_submit"));
+    }
+    return std::unique_ptr<pending> {
+        new transfer { this, tc, WHEN("ftdi_read_data") }
+    };
+}
 
-    expectResponse({
-        bad_opcode_reply,
-        opcodes::bogus,
-    });
-    expectEmptyResponse();
+void libftdi_transport::setLatencyTimer(uint8_t ms)
+{
+    if (ftdi_set_latency_timer(ctxt, ms)) {
+        onError(WHEN("ftdi_set_latency_timer"));
+    }
+}
 
-    sendRaw(opcodes::loopback_disable);
+void libftdi_transport::setChunkSizes(uint32_t write_chunk, uint32_t read_chunk)
+{
+    if (ftdi_write_data_set_chunksize(ctxt, write_chunk)) {
+        onError(WHEN("ftdi_write_data_set_chunksize"));
+    }
+    if (ftdi_read_data_set_chunksize(ctxt, read_chunk)) {
+        onError(WHEN("ftdi_read_data_set_chunksize"));
+    }
 }
 
-void spi::impl::expectResponse(const packet& p)
+void libftdi_transport::reset()
 {
-    uint8_t buffer[p.size()];
-    int rc = ftdi_read_data(ctxt, buffer, p.size());
-    if (rc != p.size()) {
-        std::ostringstream what;
-        what << WHEN()
-             << "expected " << p.size() << " byte reply but got "
-             << rc << " bytes.";
-        onError(what.str());
+    if (ftdi_set_bitmode(ctxt, 0, BITMODE_RESET)) {
+        onError(WHEN("ftdi_set_bitmode"));
+    }
+
+    if (ftdi_usb_purge_buffers(ctxt)) {
+        onError(WHEN("ftdi_usb_purge_buffers"));
     }
 
-    if (memcmp(p.data(), buffer, p.size()) != 0) {
-        onError(WHEN("did not receive expected reply"));
+    if (ftdi_set_bitmode(ctxt, 0, BITMODE_MPSSE)) {
+        onError(WHEN("ftdi_set_bitmode"));
     }
 }
 
-void spi::impl::expectEmptyResponse()
+/* Find the adapter by location, without opening any other device. */
+void libftdi_transport::openPath(const endpoint& ep)
 {
-    expectResponse(packet {});
+    for (auto dev : device_list { ctxt->usb_ctx }) {
+        if (matches(dev, ep.vid, ep.pid) && usbPath(dev) == ep.path) {
+            if (ftdi_usb_open_dev(ctxt, dev)) {
+                onError(WHEN("ftdi_usb_open_dev"));
+            }
+            return;
+        }
+    }
+    throw error(WHEN("no adapter at USB path ") + ep.path);
 }
 
-void spi::impl::onError(const std::string& when)
+void libftdi_transport::onError(const std::string& when)
 {
     throw error(when + ": " + ftdi_get_error_string(ctxt));
 }
 
+}
+
+std::unique_ptr<transport> openTransport(const endpoint& ep, spi::busses bus)
+{
+    return std::unique_ptr<transport> { new libftdi_transport { ep, bus } };
+}
+
 std::vector<endpoint> getAvailableEndpoints(int vid, int pid)
 {
-    auto ctxt = getContext();
+    auto context = newContext();
+    auto ctxt = context.get();
     ftdi_device_list *devlist = nullptr;
     auto rc = ftdi_usb_find_all(ctxt, &devlist, vid, pid);
 
@@ -226,32 +313,281 @@ std::vector<endpoint> getAvailableEndpoints(int vid, int pid)
     std::vector<endpoint> result;
     result.reserve(rc);
 
-    std::array<char, 32> mfg_buff;
-    std::array<char, 32> descr_buff;
-    std::array<char, 32> serial_buff;
-
     auto curr_dev = devlist;
     for (int i = 0; i < rc; ++i, curr_dev = curr_dev->next) {
-        if (ftdi_usb_get_strings(
-            ctxt, curr_dev->dev,
-            mfg_buff.data(), mfg_buff.size(),
-            descr_buff.data(), descr_buff.size(),
-            serial_buff.data(), serial_buff.size()))
-        {
+        endpoint ep { vid, pid, "", "", "", usbPath(curr_dev->dev) };
+        if (!readStrings(ctxt, curr_dev->dev, ep)) {
             throw error {
                 std::string { WHEN("ftdi_usb_get_strings2: ") } + ftdi_get_error_string(ctxt)
             };
         }
-
-        result.emplace_back(
-            vid, pid,
-            std::string { mfg_buff.data() },
-            std::string { descr_buff.data() },
-            std::string { serial_buff.data() }
-        );
+        result.push_back(std::move(ep));
     }
     return result;
 }
 
-} /* namespace ft2232h_spi */
+struct endpoint_cache::impl
+{
+    typedef endpoint_table<libusb_device*> table;
+
+    impl(int vid, int pid);
+    ~impl();
+
+    static int LIBUSB_CALL onHotplug(
+        libusb_context *usb, libusb_device *dev, libusb_hotplug_event event,
+        void *user);
+
+    void start();
+    void update();
+    void rescan();
+    void resolve();
+    void arrived(libusb_device *dev);
+    void left(libusb_device *dev);
+    void release(const std::vector<table::entry>& removed);
+    void notify(const endpoint& ep, bool present);
+    void eventLoop();
+
+    int vid;
+    int pid;
+    libusb_context *usb = nullptr;
+    bool hotplug = false;
+    libusb_hotplug_callback_handle handle;
+
+    /* For reading strings, which libftdi does through its own context. */
+    context_ptr strings;
+
+    /* Guards entries and on_change. */
+    std::mutex mutex;
+    table entries;
+    listener on_change;
+
+    /* Held while reading strings, so a device is only opened once. */
+    std::mutex resolving;
+
+    std::atomic<bool> stopping { false };
+    std::thread events;
+};
+
+endpoint_cache::impl::impl(int vid, int pid) :
+    vid(vid),
+    pid(pid),
+    strings(newContext())
+{
+    if (libusb_init(&usb) < 0) {
+        throw error(WHEN("libusb_init failed."));
+    }
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        return;
+    }
 
+    /* Reading strings isn't allowed in the callback: update() does it. */
+    int rc = libusb_hotplug_register_callback(
+        usb,
+        LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+        LIBUSB_HOTPLUG_ENUMERATE,
+        vid ? vid : LIBUSB_HOTPLUG_MATCH_ANY,
+        pid ? pid : LIBUSB_HOTPLUG_MATCH_ANY,
+        LIBUSB_HOTPLUG_MATCH_ANY,
+        &onHotplug, this, &handle);
+    hotplug = rc == LIBUSB_SUCCESS;
+}
+
+endpoint_cache::impl::~impl()
+{
+    stopping = true;
+    if (hotplug) {
+        libusb_hotplug_deregister_callback(usb, handle);
+        libusb_interrupt_event_handler(usb);
+    }
+    if (events.joinable()) {
+        events.join();
+    }
+
+    for (auto dev : entries.devices()) {
+        libusb_unref_device(dev);
+    }
+    libusb_exit(usb);
+}
+
+int LIBUSB_CALL endpoint_cache::impl::onHotplug(
+    libusb_context *, libusb_device *dev, libusb_hotplug_event event,
+    void *user)
+{
+    auto self = static_cast<impl*>(user);
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+        self->arrived(dev);
+    } else {
+        self->left(dev);
+    }
+    return 0;
+}
+
+void endpoint_cache::impl::start()
+{
+    if (hotplug) {
+        events = std::thread { [this]() { eventLoop(); } };
+    }
+}
+
+/* Bring entries up to date with the bus. */
+void endpoint_cache::impl::update()
+{
+    if (!hotplug) {
+        rescan();
+    }
+    resolve();
+}
+
+/* Without hotplug: diff the device list against what we already have. */
+void endpoint_cache::impl::rescan()
+{
+    std::vector<libusb_device*> present;
+    device_list list { usb };
+    for (auto dev : list) {
+        if (matches(dev, vid, pid)) {
+            arrived(dev);
+            present.push_back(dev);
+        }
+    }
+
+    std::vector<table::entry> gone;
+    {
+        std::lock_guard<std::mutex> lock { mutex };
+        entries.retain(present, gone);
+    }
+    release(gone);
+}
+
+/*
+ * Read the strings of adapters that have appeared since last time. An
+ * adapter whose strings can't be read, e.g. because it's in use, is kept
+ * with only its location; that's enough to open it.
+ */
+void endpoint_cache::impl::resolve()
+{
+    std::lock_guard<std::mutex> serialise { resolving };
+
+    std::vector<table::entry> pending;
+    {
+        std::lock_guard<std::mutex> lock { mutex };
+        pending = entries.unresolved();
+        for (auto& p : pending) {
+            libusb_ref_device(p.dev);
+        }
+    }
+
+    for (auto& p : pending) {
+        readStrings(strings.get(), p.dev, p.ep);
+
+        bool still_present;
+        {
+            std::lock_guard<std::mutex> lock { mutex };
+            still_present = entries.resolve(p.dev, p.ep);
+        }
+        libusb_unref_device(p.dev);
+
+        if (still_present) {
+            notify(p.ep, true);
+        }
+    }
+}
+
+void endpoint_cache::impl::arrived(libusb_device *dev)
+{
+    endpoint ep { vid, pid, "", "", "", usbPath(dev) };
+    std::vector<table::entry> replaced;
+    {
+        std::lock_guard<std::mutex> lock { mutex };
+        if (entries.add(dev, ep, replaced)) {
+            libusb_ref_device(dev);
+        }
+    }
+    release(replaced);
+}
+
+void endpoint_cache::impl::left(libusb_device *dev)
+{
+    std::vector<table::entry> removed;
+    {
+        std::lock_guard<std::mutex> lock { mutex };
+        entries.remove(dev, removed);
+    }
+    release(removed);
+}
+
+/* Drop entries taken out of the table, reporting those we announced. */
+void endpoint_cache::impl::release(const std::vector<table::entry>& removed)
+{
+    for (auto& e : removed) {
+        libusb_unref_device(e.dev);
+        if (e.resolved) {
+            notify(e.ep, false);
+        }
+    }
+}
+
+void endpoint_cache::impl::notify(const endpoint& ep, bool present)
+{
+    listener fn;
+    {
+        std::lock_guard<std::mutex> lock { mutex };
+        fn = on_change;
+    }
+    if (fn) {
+        fn(ep, present);
+    }
+}
+
+void endpoint_cache::impl::eventLoop()
+{
+    while (!stopping) {
+        timeval tv { 0, hotplug_poll_us };
+        libusb_handle_events_timeout_completed(usb, &tv, nullptr);
+        resolve();
+    }
+}
+
+endpoint_cache::endpoint_cache(int vid, int pid) :
+    impl_(new impl { vid, pid })
+{
+    impl_->update();
+    impl_->start();
+}
+
+endpoint_cache::~endpoint_cache()
+{
+}
+
+std::vector<endpoint> endpoint_cache::endpoints()
+{
+    impl_->update();
+    std::lock_guard<std::mutex> lock { impl_->mutex };
+    return impl_->entries.endpoints();
+}
+
+size_t endpoint_cache::size()
+{
+    impl_->update();
+    std::lock_guard<std::mutex> lock { impl_->mutex };
+    return impl_->entries.size();
+}
+
+endpoint endpoint_cache::at(size_t index)
+{
+    impl_->update();
+    std::lock_guard<std::mutex> lock { impl_->mutex };
+    return impl_->entries.at(index);
+}
+
+bool endpoint_cache::hotplug() const
+{
+    return impl_->hotplug;
+}
+
+void endpoint_cache::setListener(listener fn)
+{
+    std::lock_guard<std::mutex> lock { impl_->mutex };
+    impl_->on_change = std::move(fn);
+}
+
+} /* namespace ft2232h_spi */
@@ -0,0 +1,1932 @@
+/* ft2232h-spi.cpp
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ft2232h-spi.h"
+
+#ifndef FT2232H_SPI_METRICS
+#define FT2232H_SPI_METRICS 0
+#endif
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include "buffer-pool.h"
+#include "command-buffer.h"
+#include "mpsse.h"
+#include "packet.h"
+#include "trace.h"
+#include "transport.h"
+#include "util.h"
+
+namespace ft2232h_spi {
+
+namespace {
+
+/* The MPSSE length field is 16 bits wide and encodes length - 1. */
+constexpr size_t max_write_length = 0x10000;
+
+/*
+ * Size of the FT2232H's per-channel FIFOs. If more than this much read
+ * data is outstanding while we're still writing clock data, the chip
+ * stalls waiting for us to drain it and the write never finishes.
+ */
+constexpr size_t fifo_size = 4096;
+
+/*
+ * How long to back off between empty reads once max_empty_reads is used
+ * up while the stream is held by a wait-on-GPIO command.
+ */
+constexpr auto wait_poll_interval = std::chrono::microseconds(100);
+
+/*
+ * A lower bound on how long the MPSSE takes over a set_low_bits command:
+ * it can't consume its 3 bytes faster than one per 60 MHz cycle. Delays
+ * built from them therefore never come out short.
+ */
+constexpr uint64_t pin_command_ns = 50;
+
+/* Bulk transfers the async I/O thread keeps queued in the USB stack. */
+constexpr size_t max_in_flight = 8;
+
+/*
+ * Pooled async buffers must hold a whole segment: up to just under one
+ * full write command's worth of earlier commands, plus one more full
+ * command, plus framing.
+ */
+constexpr size_t pool_buffer_size = 2 * max_write_length + fifo_size;
+constexpr size_t default_pool_high_water = 4;
+
+/*
+ * Segments no bigger than this are copied out of the encoder's pooled
+ * block into a buffer of their own sized to fit, so a short frame doesn't
+ * tie up a whole block while it waits in the queue.
+ */
+constexpr size_t max_copied_segment = fifo_size;
+
+/* Pooled blocks that queued async jobs may hold between them. */
+constexpr size_t default_pool_limit = 16;
+
+/* What autoTune() tries, and how much traffic it times for each pair. */
+constexpr uint8_t tune_latencies_ms[] = { 1, 2, 4, 8, 16 };
+constexpr uint32_t tune_chunk_sizes[] = { 512, 4096, 16384, 65536 };
+constexpr int tune_round_trips = 8;
+constexpr int tune_bulk_rounds = 4;
+
+/* Fixed parts of the open sequence, folded into constant bytes. */
+constexpr auto init_modes =
+    commands::adaptiveClkDisable() + commands::threePhaseDisable();
+
+/*
+ * What a cut-short async job is cleaned up with: the modes, the clock and
+ * the idle pin states, much as init() sends them.
+ */
+using restore_packet = static_packet<12>;
+
+constexpr restore_packet restoreCommands(
+    bool div5, uint16_t divisor,
+    const static_packet<3>& low, const static_packet<3>& high)
+{
+    return init_modes +
+        (div5 ? commands::clkdiv5Enable() : commands::clkdiv5Disable()) +
+        commands::setClkdiv(divisor) + low + high;
+}
+
+struct clock_setting
+{
+    bool div5;
+    uint16_t divisor;
+    uint32_t hz;
+};
+
+clock_setting clockFor(uint32_t hz)
+{
+    if (hz == 0) {
+        throw error(WHEN("can't set a 0 Hz clock."));
+    }
+
+    /* Round the divisor up so we never clock faster than asked. */
+    auto divisorFor = [hz](uint32_t base) {
+        return (uint64_t(base) + 2ull * hz - 1) / (2ull * hz) - 1;
+    };
+
+    bool div5 = false;
+    uint32_t base = base_clock_hz;
+    uint64_t divisor = divisorFor(base);
+    if (divisor > 0xffff) {
+        div5 = true;
+        base = base_clock_div5_hz;
+        divisor = divisorFor(base);
+    }
+    if (divisor > 0xffff) {
+        std::ostringstream what;
+        what << WHEN() << "can't clock slower than " << min_clock_hz << " Hz.";
+        throw error(what.str());
+    }
+
+    return { div5, uint16_t(divisor), uint32_t(base / (2 * (divisor + 1))) };
+}
+
+/*
+ * The counters behind spi::metrics(). Updates are relaxed atomic adds so
+ * callers and the I/O thread never wait on each other. With
+ * FT2232H_SPI_METRICS off the class is empty and every member compiles
+ * down to nothing.
+ */
+class counters
+{
+public:
+    typedef std::chrono::steady_clock::time_point timestamp;
+
+#if FT2232H_SPI_METRICS
+    static timestamp now() { return std::chrono::steady_clock::now(); }
+
+    void usbWrite(size_t bytes)
+    {
+        add(usb_writes_, 1);
+        add(usb_write_bytes_, bytes);
+    }
+
+    void usbRead(size_t bytes)
+    {
+        add(usb_reads_, 1);
+        add(usb_read_bytes_, bytes);
+    }
+
+    void sync() { add(syncs_, 1); }
+    void resync() { add(resyncs_, 1); }
+    void failure() { add(errors_, 1); }
+
+    void transaction(
+        transaction_type type, uint64_t frames, uint64_t payload,
+        timestamp started)
+    {
+        add(transactions_, frames);
+        add(payload_bytes_, payload);
+
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            now() - started).count();
+        uint64_t us = ns / 1000;
+        size_t bucket = us ? 64 - __builtin_clzll(us) : 0;
+        bucket = std::min(bucket, latency_histogram::buckets - 1);
+
+        auto& h = latency_[size_t(type)];
+        add(h.counts[bucket], 1);
+        add(h.count, 1);
+        add(h.total_ns, ns);
+    }
+
+    metrics_snapshot snapshot() const
+    {
+        metrics_snapshot result {};
+        result.enabled = true;
+        result.transactions = get(transactions_);
+        result.payload_bytes = get(payload_bytes_);
+        result.usb_writes = get(usb_writes_);
+        result.usb_write_bytes = get(usb_write_bytes_);
+        result.usb_reads = get(usb_reads_);
+        result.usb_read_bytes = get(usb_read_bytes_);
+        result.syncs = get(syncs_);
+        result.resyncs = get(resyncs_);
+        result.errors = get(errors_);
+        for (size_t t = 0; t < transaction_types; ++t) {
+            for (size_t b = 0; b < latency_histogram::buckets; ++b) {
+                result.latency[t].counts[b] = get(latency_[t].counts[b]);
+            }
+            result.latency[t].count = get(latency_[t].count);
+            result.latency[t].total_ns = get(latency_[t].total_ns);
+        }
+        return result;
+    }
+
+private:
+    typedef std::atomic<uint64_t> counter;
+
+    static void add(counter& c, uint64_t n)
+    {
+        c.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    static uint64_t get(const counter& c)
+    {
+        return c.load(std::memory_order_relaxed);
+    }
+
+    struct histogram
+    {
+        counter counts[latency_histogram::buckets] {};
+        counter count { 0 };
+        counter total_ns { 0 };
+    };
+
+    counter transactions_ { 0 };
+    counter payload_bytes_ { 0 };
+    counter usb_writes_ { 0 };
+    counter usb_write_bytes_ { 0 };
+    counter usb_reads_ { 0 };
+    counter usb_read_bytes_ { 0 };
+    counter syncs_ { 0 };
+    counter resyncs_ { 0 };
+    counter errors_ { 0 };
+    histogram latency_[transaction_types];
+#else
+    static timestamp now() { return timestamp {}; }
+    void usbWrite(size_t) { }
+    void usbRead(size_t) { }
+    void sync() { }
+    void resync() { }
+    void failure() { }
+    void transaction(transaction_type, uint64_t, uint64_t, timestamp) { }
+    metrics_snapshot snapshot() const { return metrics_snapshot {}; }
+#endif
+};
+
+size_t totalSize(const spi::segment *segments, size_t count)
+{
+    size_t size = 0;
+    for (size_t i = 0; i < count; ++i) {
+        size += segments[i].size;
+    }
+    return size;
+}
+}
+
+constexpr uint32_t spi::default_clock_hz;
+constexpr uint64_t spi::max_framed_delay_ns;
+
+struct spi::impl
+{
+    impl(pins cs_pin, std::unique_ptr<transport> io, uint32_t clock_hz) :
+        io(std::move(io)),
+        pool(pool_buffer_size, default_pool_high_water),
+        cs_pin(cs_pin),
+        clock_hz(clock_hz),
+        tx(pool.acquire()),
+        rx(pool.acquire())
+    {
+        useChipSelect(cs_pin);
+    }
+    ~impl();
+
+    /*
+     * One unit of asynchronous work. The encoder splits it into segments
+     * at the same points where the synchronous path would flush or wait
+     * for a reply, so each segment is one write plus an optional read.
+     */
+    struct job
+    {
+        struct segment
+        {
+            command_buffer tx;
+            std::vector<std::pair<uint8_t*, size_t>> rx;
+            size_t rx_size = 0;
+            command_buffer scratch;
+        };
+
+        std::vector<segment> segments;
+        size_t blocks = 0;
+        size_t next_segment = 0;
+        size_t outstanding = 0;
+        std::exception_ptr failure;
+        completion done;
+
+        /*
+         * What the channel has to be put back to if the job is cut short:
+         * its modes, clock and idle pins as of the end of the job, and
+         * whether a wait-on-GPIO may still be holding the MPSSE up.
+         */
+        restore_packet restore = restoreCommands(
+            false, 0, commands::setLowBits(0, 0), commands::setHighBits(0, 0));
+        bool waited = false;
+
+        transaction_type type;
+        uint64_t frames;
+        uint64_t payload;
+        counters::timestamp started;
+    };
+
+    /* A bulk transfer the I/O thread has queued with the transport. */
+    struct transfer
+    {
+        std::shared_ptr<transport::pending> io;
+        job *owner;
+        size_t segment;
+        bool read;
+    };
+
+    void useChipSelect(uint8_t pin);
+    static_packet<3> pinState(uint8_t selected) const;
+    bool clashes(const batch& b) const;
+    void queueGpio(batch::step_type type, uint16_t mask, uint8_t selected);
+    void init();
+    void sendRaw(const packet& p);
+    void sendRaw(const uint8_t *data, size_t size);
+    template<size_t N> void sendRaw(const static_packet<N>& p);
+    void queue(const packet& p);
+    template<size_t N> void queue(const static_packet<N>& p);
+    void queueWrite(const uint8_t *data, size_t size);
+    void queueData(opcodes op, const uint8_t *out, uint8_t *in, size_t size);
+    void queueGather(const segment *segments, size_t count, size_t size);
+    void flush();
+    void collect();
+    void finish();
+    void collectFenced();
+    void resync();
+    void recover();
+    void discardReplies();
+    void applyUsb(const usb_settings& settings);
+    usb_settings autoTune(tuning_profile profile);
+    double roundTripSeconds();
+    double bulkBytesPerSecond();
+    void readExact(uint8_t *buffer, size_t size);
+    void sync();
+    void expectResponse(const packet& p);
+    void expectEmptyResponse();
+    void onError(const std::string& when);
+
+    void frame(opcodes op, const uint8_t *out, uint8_t *in, size_t size);
+    void frame(const segment *segments, size_t count, size_t size);
+    uint32_t queueClock(uint32_t hz);
+    void queueDelay(uint64_t ns, const static_packet<3> *hold);
+    void encode(const batch& b);
+    void closeSegment();
+    template<class Encode>
+    void run(
+        transaction_type type, uint64_t frames, uint64_t payload,
+        Encode encode);
+    void beginJob(transaction_type type, uint64_t frames, uint64_t payload);
+    void checkBatch(const batch& b) const;
+    bool beginBatchJob(const batch& b);
+    void submitJob(completion done);
+    std::future<void> submitJob();
+    void drain();
+    void ioLoop();
+    bool submitSegmentWrite(
+        job& j, size_t index, std::deque<transfer>& in_flight);
+    bool submitSegmentRead(
+        job& j, size_t index, std::deque<transfer>& in_flight);
+    void completeSegment(const transfer& t);
+    void finishJob(std::unique_lock<std::mutex>& lock, job *owner);
+    void recoverJobs(std::unique_lock<std::mutex>& lock);
+    void fail(job& j, const std::string& when);
+
+    /* Each device owns its transport so adapters and channels don't clash. */
+    std::unique_ptr<transport> io;
+
+    /* io itself while a trace is being recorded, otherwise null. */
+    trace_transport *tracer = nullptr;
+
+    /*
+     * Transfer buffers. Async segments borrow theirs while in flight; the
+     * synchronous path keeps one each for commands and replies. Declared
+     * early so it outlives everything that uses it.
+     */
+    buffer_pool pool;
+    pins cs_pin;
+
+    /* All chip selects in use on this channel. */
+    uint8_t cs_mask = 0;
+
+    /*
+     * The set_low_bits commands that frame a transfer to cs_pin. They only
+     * change when a chip select is added, so they're built once up front
+     * rather than for every transfer.
+     */
+    static_packet<3> cs_select = commands::setLowBits(0, 0);
+    static_packet<3> cs_deselect = commands::setLowBits(0, 0);
+
+    /*
+     * GPIO levels and directions as of the end of the encoded stream:
+     * ADBUS4-7 share the low byte with the chip selects, ACBUS0-7 have
+     * the high byte to themselves.
+     */
+    uint8_t gpio_low = 0;
+    uint8_t gpio_low_dir = 0;
+    uint8_t gpio_high = 0;
+    uint8_t gpio_high_dir = 0;
+
+    /*
+     * Set when a transfer fails: the pins may not have reached the state
+     * above, so it's driven again before the next batch builds on it.
+     * Failed async jobs set it from the I/O thread.
+     */
+    std::atomic<bool> pins_stale { false };
+
+    /*
+     * The clock as of the end of the encoded stream. clkdiv5 is -1 until
+     * the clock has been sent for the first time.
+     */
+    uint32_t clock_hz;
+    int clkdiv5 = -1;
+    uint16_t clkdiv = 0;
+
+    /*
+     * Commands waiting to be handed to the transport in one go. Everything
+     * is encoded straight into this, so it's the only copy of the payload.
+     */
+    command_buffer tx;
+
+    /*
+     * Destinations for the MISO data that the queued (or already flushed)
+     * commands will produce, in stream order.
+     */
+    std::vector<std::pair<uint8_t*, size_t>> rx_pending;
+    size_t rx_pending_size = 0;
+
+    /* Where replies split across several destinations are read into. */
+    command_buffer rx;
+
+    counters stats;
+
+    /* The USB layer's own defaults until someone changes them. */
+    usb_settings usb { 16, 4096, 4096 };
+
+    bool pipelined = false;
+    uint64_t fence_interval = 0;
+    uint64_t submitted = 0;
+    uint64_t confirmed = 0;
+    uint8_t fence_reply[2];
+
+    /*
+     * Sum of the timeouts of the wait-on-GPIO commands queued since the
+     * last fence; how long a reply may legitimately be held up.
+     */
+    uint64_t wait_budget_ms = 0;
+
+    /* Non-null while an async operation is being encoded. */
+    std::unique_ptr<job> building;
+
+    /*
+     * Async jobs in submission order. Everything before submit_it has
+     * had all of its segments handed to the transport. The I/O thread is
+     * the only thread that touches the transport while jobs are
+     * outstanding. queued_blocks counts the pooled blocks the queued jobs
+     * hold; submitJob() waits on io_room while that's over block_limit.
+     */
+    std::mutex io_mutex;
+    std::condition_variable io_work;
+    std::condition_variable io_idle;
+    std::condition_variable io_room;
+    size_t queued_blocks = 0;
+    size_t block_limit = default_pool_limit;
+    std::list<std::unique_ptr<job>> jobs;
+    std::list<std::unique_ptr<job>>::iterator submit_it = jobs.end();
+    std::thread io_thread;
+    bool stopping = false;
+};
+
+spi::impl::~impl()
+{
+    if (io_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock { io_mutex };
+            stopping = true;
+        }
+        io_work.notify_all();
+        io_thread.join();
+    }
+}
+
+spi::~spi()
+{
+}
+
+spi::spi(
+    pins cs, const endpoint& ep, busses bus, uint32_t clock_hz,
+    tuning_profile tune)
+    noexcept(false) :
+    spi(cs, openTransport(ep, bus), clock_hz, tune)
+{
+}
+
+spi::spi(
+    pins cs, std::unique_ptr<transport> io, uint32_t clock_hz,
+    tuning_profile tune)
+    noexcept(false) :
+    d(new impl { cs, std::move(io), clock_hz })
+{
+    d->init();
+    if (tune != tune_none) {
+        d->autoTune(tune);
+    }
+}
+
+spi::spi(spi&& other) noexcept(true)
+    : d(std::move(other.d))
+{
+}
+
+spi& spi::operator=(spi&& other) noexcept(true)
+{
+    std::swap(d, other.d);
+    return *this;
+}
+
+void spi::transmit(const packet& payload)
+{
+    transmit(payload.data(), payload.size());
+}
+
+void spi::transmit(const uint8_t *data, size_t size)
+{
+    if (size < 1) {
+        throw error(WHEN("can't send a packet with <1 bytes."));
+    }
+
+    d->run(transaction_type::transmit, 1, size, [&]() {
+        d->frame(opcodes::write, data, nullptr, size);
+    });
+}
+
+void spi::transmit(const segment *segments, size_t count)
+{
+    size_t size = totalSize(segments, count);
+    if (size < 1) {
+        throw error(WHEN("can't send a packet with <1 bytes."));
+    }
+
+    d->run(transaction_type::transmit, 1, size, [&]() {
+        d->frame(segments, count, size);
+    });
+}
+
+void spi::transmit(std::initializer_list<segment> segments)
+{
+    transmit(segments.begin(), segments.size());
+}
+
+void spi::transfer(const uint8_t *tx, uint8_t *rx, size_t size)
+{
+    if (size < 1) {
+        throw error(WHEN("can't transfer <1 bytes."));
+    }
+
+    d->run(transaction_type::transfer, 1, size, [&]() {
+        d->frame(opcodes::read_write, tx, rx, size);
+    });
+}
+
+void spi::receive(uint8_t *rx, size_t size)
+{
+    if (size < 1) {
+        throw error(WHEN("can't receive <1 bytes."));
+    }
+
+    d->run(transaction_type::receive, 1, size, [&]() {
+        d->frame(opcodes::read, nullptr, rx, size);
+    });
+}
+
+void spi::execute(const batch& b)
+{
+    d->checkBatch(b);
+    if (b.empty()) {
+        return;
+    }
+
+    d->run(
+        transaction_type::execute, b.transactions(), b.payload(),
+        [&]() { d->encode(b); }
+    );
+}
+
+void spi::check(const batch& b) const
+{
+    d->checkBatch(b);
+}
+
+std::future<void> spi::transmitAsync(const uint8_t *data, size_t size)
+{
+    if (size < 1) {
+        throw error(WHEN("can't send a packet with <1 bytes."));
+    }
+
+    d->beginJob(transaction_type::transmit, 1, size);
+    d->frame(opcodes::write, data, nullptr, size);
+    return d->submitJob();
+}
+
+std::future<void> spi::transmitAsync(
+    const segment *segments, size_t count)
+{
+    size_t size = totalSize(segments, count);
+    if (size < 1) {
+        throw error(WHEN("can't send a packet with <1 bytes."));
+    }
+
+    d->beginJob(transaction_type::transmit, 1, size);
+    d->frame(segments, count, size);
+    return d->submitJob();
+}
+
+std::future<void> spi::transferAsync(
+    const uint8_t *tx, uint8_t *rx, size_t size)
+{
+    if (size < 1) {
+        throw error(WHEN("can't transfer <1 bytes."));
+    }
+
+    d->beginJob(transaction_type::transfer, 1, size);
+    d->frame(opcodes::read_write, tx, rx, size);
+    return d->submitJob();
+}
+
+std::future<void> spi::receiveAsync(uint8_t *rx, size_t size)
+{
+    if (size < 1) {
+        throw error(WHEN("can't receive <1 bytes."));
+    }
+
+    d->beginJob(transaction_type::receive, 1, size);
+    d->frame(opcodes::read, nullptr, rx, size);
+    return d->submitJob();
+}
+
+std::future<void> spi::executeAsync(const batch& b)
+{
+    if (!d->beginBatchJob(b)) {
+        std::promise<void> nothing;
+        nothing.set_value();
+        return nothing.get_future();
+    }
+    return d->submitJob();
+}
+
+void spi::executeAsync(const batch& b, completion done)
+{
+    if (!d->beginBatchJob(b)) {
+        done(nullptr);
+        return;
+    }
+    d->submitJob(std::move(done));
+}
+
+void spi::wait()
+{
+    d->drain();
+}
+
+uint32_t spi::setClock(uint32_t hz)
+{
+    d->drain();
+    auto achieved = d->queueClock(hz);
+    d->finish();
+    return achieved;
+}
+
+uint32_t spi::clock() const
+{
+    return d->clock_hz;
+}
+
+void spi::addChipSelect(pins cs)
+{
+    if (cs & serial_pins) {
+        throw error(WHEN("ADBUS0-2 can't be used as a chip select."));
+    }
+    if (cs & d->gpio_low_dir) {
+        throw error(WHEN("pin is already in use as a GPIO."));
+    }
+    d->drain();
+    d->useChipSelect(cs);
+    d->queue(d->cs_deselect);
+    d->finish();
+}
+
+void spi::setBufferHighWater(size_t buffers)
+{
+    d->pool.setHighWater(buffers);
+}
+
+void spi::setBufferLimit(size_t limit)
+{
+    {
+        std::lock_guard<std::mutex> lock { d->io_mutex };
+        d->block_limit = limit;
+    }
+    d->io_room.notify_all();
+}
+
+const buffer_pool& spi::buffers() const
+{
+    return d->pool;
+}
+
+void spi::setLatencyTimer(uint8_t ms)
+{
+    if (ms == 0) {
+        throw error(WHEN("the latency timer must be at least 1 ms."));
+    }
+
+    d->drain();
+    auto settings = d->usb;
+    settings.latency_ms = ms;
+    d->applyUsb(settings);
+}
+
+void spi::setChunkSizes(uint32_t write_chunk, uint32_t read_chunk)
+{
+    if (write_chunk == 0 || read_chunk == 0) {
+        throw error(WHEN("chunk sizes must be at least 1 byte."));
+    }
+
+    d->drain();
+    auto settings = d->usb;
+    settings.write_chunk = write_chunk;
+    settings.read_chunk = read_chunk;
+    d->applyUsb(settings);
+}
+
+spi::usb_settings spi::usbSettings() const
+{
+    return d->usb;
+}
+
+spi::usb_settings spi::autoTune(tuning_profile profile)
+{
+    d->drain();
+    return d->autoTune(profile);
+}
+
+metrics_snapshot spi::metrics() const
+{
+    return d->stats.snapshot();
+}
+
+void spi::startTrace(const std::string& path, size_t ring_size)
+{
+    if (d->tracer) {
+        throw error(WHEN("a trace is already being recorded."));
+    }
+
+    d->drain();
+    auto tracer = new trace_transport {
+        std::move(d->io), path,
+        ring_size ? ring_size : trace_transport::default_ring_size
+    };
+    d->io.reset(tracer);
+    d->tracer = tracer;
+}
+
+uint64_t spi::stopTrace()
+{
+    if (!d->tracer) {
+        return 0;
+    }
+
+    d->drain();
+    auto dropped = d->tracer->dropped();
+    auto inner = d->tracer->release();
+    bool failed = d->tracer->failed();
+    d->tracer = nullptr;
+    d->io = std::move(inner);
+
+    if (failed) {
+        throw error(WHEN("couldn't write the whole trace file."));
+    }
+    return dropped;
+}
+
+void spi::setPipelined(bool enabled, uint64_t fence_interval)
+{
+    if (d->pipelined && !enabled) {
+        fence();
+    }
+    d->pipelined = enabled;
+    d->fence_interval = fence_interval;
+}
+
+void spi::fence()
+{
+    d->drain();
+    d->collectFenced();
+}
+
+uint64_t spi::submitted() const
+{
+    return d->submitted;
+}
+
+void spi::impl::frame(
+    opcodes op, const uint8_t *out, uint8_t *in, size_t size)
+{
+    queue(cs_select);
+    queueData(op, out, in, size);
+    queue(cs_deselect);
+}
+
+void spi::impl::frame(const segment *segments, size_t count, size_t size)
+{
+    queue(cs_select);
+    queueGather(segments, count, size);
+    queue(cs_deselect);
+}
+
+void spi::impl::encode(const batch& b)
+{
+    /* The chip select asserted at this point of the stream. */
+    uint8_t active = 0;
+    bool framed = false;
+
+    if (pins_stale.exchange(false)) {
+        queue(cs_deselect);
+        queue(commands::setHighBits(gpio_high, gpio_high_dir));
+    }
+
+    for (auto& s : b.steps_) {
+        switch (s.type) {
+        case batch::step_type::select:
+            active = s.size == 0 ? uint8_t(cs_pin) : uint8_t(s.size);
+            if (active == cs_pin) {
+                queue(cs_select);
+            } else {
+                useChipSelect(active);
+                queue(pinState(active));
+            }
+            framed = true;
+            break;
+        case batch::step_type::deselect:
+            queue(cs_deselect);
+            active = 0;
+            framed = false;
+            break;
+        case batch::step_type::write:
+            queueWrite(s.out ? s.out : &b.storage_[s.offset], s.size);
+            break;
+        case batch::step_type::read:
+            queueData(opcodes::read, nullptr, s.in, s.size);
+            break;
+        case batch::step_type::read_write:
+            queueData(opcodes::read_write, s.out, s.in, s.size);
+            break;
+        case batch::step_type::set_clock:
+            queueClock(uint32_t(s.size));
+            break;
+        case batch::step_type::wait_high:
+            queue(commands::waitOnHigh());
+            wait_budget_ms += s.size;
+            break;
+        case batch::step_type::wait_low:
+            queue(commands::waitOnLow());
+            wait_budget_ms += s.size;
+            break;
+        case batch::step_type::delay: {
+            auto held = pinState(active);
+            queueDelay(s.size, framed ? &held : nullptr);
+            break;
+        }
+        case batch::step_type::gpio_set:
+        case batch::step_type::gpio_clear:
+        case batch::step_type::gpio_release:
+            queueGpio(s.type, uint16_t(s.size), active);
+            break;
+        case batch::step_type::gpio_read:
+            queue(commands::getLowBits() + commands::getHighBits());
+            rx_pending.emplace_back(s.in, 2);
+            rx_pending_size += 2;
+            break;
+        }
+    }
+}
+
+uint32_t spi::impl::queueClock(uint32_t hz)
+{
+    auto setting = clockFor(hz);
+    bool unknown = clkdiv5 < 0;
+
+    if (clkdiv5 != int(setting.div5)) {
+        queue(setting.div5 ?
+            commands::clkdiv5Enable() :
+            commands::clkdiv5Disable()
+        );
+        clkdiv5 = setting.div5;
+    }
+    if (unknown || clkdiv != setting.divisor) {
+        queue(commands::setClkdiv(setting.divisor));
+        clkdiv = setting.divisor;
+    }
+
+    clock_hz = setting.hz;
+    return clock_hz;
+}
+
+/*
+ * Queue commands that take at least ns to execute. Outside a frame that's
+ * idle SCK cycles at the current clock; inside one, where clocking would
+ * shift data into the device, hold is repeated instead.
+ */
+void spi::impl::queueDelay(uint64_t ns, const static_packet<3> *hold)
+{
+    if (hold) {
+        /* batch::delay() keeps this to a few KiB. */
+        size_t repeats = size_t((ns + pin_command_ns - 1) / pin_command_ns);
+        if (tx.size() + repeats * hold->size() > max_write_length) {
+            flush();
+        }
+        for (size_t n = 0; n < repeats; ++n) {
+            queue(*hold);
+        }
+        return;
+    }
+
+    /* Whole seconds first, so long delays can't overflow. */
+    uint64_t cycles = ns / 1000000000 * clock_hz +
+        (ns % 1000000000 * clock_hz + 999999999) / 1000000000;
+    while (cycles >= 8) {
+        size_t bytes = size_t(std::min<uint64_t>(cycles / 8, max_write_length));
+        queue(commands::clockBytes(bytes));
+        cycles -= 8 * bytes;
+    }
+    if (cycles > 0) {
+        queue(commands::clockBits(size_t(cycles)));
+    }
+}
+
+void spi::impl::sendRaw(const packet& p)
+{
+    sendRaw(p.data(), p.size());
+}
+
+void spi::impl::sendRaw(const uint8_t *data, size_t size)
+{
+    io->write(data, size);
+    stats.usbWrite(size);
+}
+
+template<size_t N>
+void spi::impl::sendRaw(const static_packet<N>& p)
+{
+    io->write(p.data(), N);
+    stats.usbWrite(N);
+}
+
+void spi::impl::queue(const packet& p)
+{
+    tx.append(p);
+}
+
+template<size_t N>
+void spi::impl::queue(const static_packet<N>& p)
+{
+    tx.append(p);
+}
+
+void spi::impl::queueWrite(const uint8_t *data, size_t size)
+{
+    queueData(opcodes::write, data, nullptr, size);
+}
+
+void spi::impl::queueData(
+    opcodes op, const uint8_t *out, uint8_t *in, size_t size)
+{
+    /*
+     * A read-only command is three bytes on the wire, so nothing we write
+     * after it can back up behind its reply. Anything that also clocks
+     * data out has to be kept within the FIFO or we'll deadlock.
+     */
+    size_t max_chunk = (out && in) ? fifo_size : max_write_length;
+
+    while (size > 0) {
+        size_t chunk = std::min(size, max_chunk);
+
+        if (out && rx_pending_size > 0 &&
+            rx_pending_size + (in ? chunk : 0) > fifo_size)
+        {
+            collect();
+        }
+
+        queue(commands::data(op, chunk));
+        if (out) {
+            tx.append(out, chunk);
+            out += chunk;
+        }
+        if (in && !rx_pending.empty() &&
+            rx_pending.back().first + rx_pending.back().second == in)
+        {
+            rx_pending.back().second += chunk;
+            rx_pending_size += chunk;
+            in += chunk;
+        } else if (in) {
+            rx_pending.emplace_back(in, chunk);
+            rx_pending_size += chunk;
+            in += chunk;
+        }
+        size -= chunk;
+
+        /*
+         * Keep CS asserted but hand each full command to the USB layer
+         * as soon as it's built so the buffer stays bounded.
+         */
+        if (tx.size() >= max_write_length) {
+            flush();
+        }
+    }
+}
+
+void spi::impl::queueGather(
+    const segment *segments, size_t count, size_t size)
+{
+    /*
+     * Same chunking as queueData() for a write, except that each command
+     * gathers its payload from however many segments it covers.
+     */
+    const uint8_t *src = count ? segments->data : nullptr;
+    size_t left_in_segment = count ? segments->size : 0;
+
+    while (size > 0) {
+        size_t chunk = std::min(size, max_write_length);
+
+        if (rx_pending_size > fifo_size) {
+            collect();
+        }
+
+        queue(commands::write(chunk));
+        auto dst = tx.extend(chunk);
+        for (size_t left = chunk; left > 0; ) {
+            while (left_in_segment == 0) {
+                ++segments;
+                src = segments->data;
+                left_in_segment = segments->size;
+            }
+            size_t n = std::min(left, left_in_segment);
+            memcpy(dst, src, n);
+            dst += n;
+            src += n;
+            left -= n;
+            left_in_segment -= n;
+        }
+        size -= chunk;
+
+        if (tx.size() >= max_write_length) {
+            flush();
+        }
+    }
+}
+
+void spi::impl::flush()
+{
+    if (building) {
+        closeSegment();
+        return;
+    }
+
+    if (tx.empty()) {
+        return;
+    }
+
+    scope_guard clear { [this]() { tx.clear(); } };
+    sendRaw(tx.data(), tx.size());
+}
+
+void spi::impl::collect()
+{
+    if (rx_pending_size > 0) {
+        queue(commands::sendImmediate());
+    }
+    flush();
+
+    if (building || rx_pending.empty()) {
+        return;
+    }
+
+    scope_guard clear { [this]() {
+        rx_pending.clear();
+        rx_pending_size = 0;
+    } };
+
+    /*
+     * Pull the whole reply in one go, straight into the caller's buffer
+     * when there's only one, otherwise into scratch space to be handed out.
+     */
+    if (rx_pending.size() == 1) {
+        readExact(rx_pending.front().first, rx_pending.front().second);
+        return;
+    }
+
+    rx.clear();
+    readExact(rx.extend(rx_pending_size), rx_pending_size);
+
+    auto src = rx.data();
+    for (auto& dst : rx_pending) {
+        memcpy(dst.first, src, dst.second);
+        src += dst.second;
+    }
+}
+
+void spi::impl::finish()
+{
+    ++submitted;
+
+    /* A fence is the only way to tell a wait that never ended. */
+    if (wait_budget_ms > 0) {
+        collectFenced();
+        return;
+    }
+
+    if (!pipelined) {
+        bool reads = rx_pending_size > 0;
+        collect();
+        if (!reads) {
+            expectEmptyResponse();
+        }
+        confirmed = submitted;
+        return;
+    }
+
+    /* We have to wait for a reply anyway, so piggyback a fence on it. */
+    if (rx_pending_size > 0 ||
+        (fence_interval && submitted - confirmed >= fence_interval))
+    {
+        collectFenced();
+        return;
+    }
+
+    flush();
+}
+
+void spi::impl::collectFenced()
+{
+    /*
+     * An invalid opcode makes the MPSSE echo bad_opcode_reply followed by
+     * the opcode, so seeing exactly that after everything else we expect
+     * proves the device has consumed the stream up to this point.
+     */
+    queue(commands::bogus());
+    rx_pending.emplace_back(fence_reply, sizeof(fence_reply));
+    rx_pending_size += sizeof(fence_reply);
+
+    uint64_t first = confirmed + 1;
+    bool waited = wait_budget_ms > 0;
+    std::string what;
+    try {
+        collect();
+        wait_budget_ms = 0;
+        if (fence_reply[0] == bad_opcode_reply &&
+            fence_reply[1] == uint8_t(opcodes::bogus))
+        {
+            confirmed = submitted;
+            return;
+        }
+        what = WHEN("fence did not receive expected reply");
+    } catch (const error& e) {
+        what = e.what();
+    }
+
+    /*
+     * Get back to a known state so later transfers have a chance. A wait
+     * that's still pending would swallow anything we sent, so that takes
+     * a reset of the channel rather than a resync.
+     */
+    wait_budget_ms = 0;
+    confirmed = submitted;
+    try {
+        if (waited) {
+            recover();
+        } else {
+            resync();
+        }
+    } catch (const error&) {
+    }
+
+    std::ostringstream msg;
+    msg << what << " (transfers " << first << "-" << submitted << ")";
+    if (waited) {
+        throw wait_timeout(msg.str(), first, submitted);
+    }
+    throw pipeline_error(msg.str(), first, submitted);
+}
+
+void spi::impl::applyUsb(const usb_settings& settings)
+{
+    io->setLatencyTimer(settings.latency_ms);
+    io->setChunkSizes(settings.write_chunk, settings.read_chunk);
+    usb = settings;
+}
+
+spi::usb_settings spi::impl::autoTune(tuning_profile profile)
+{
+    if (profile == tune_none) {
+        return usb;
+    }
+
+    /* Start from a verified, empty stream. */
+    collectFenced();
+
+    usb_settings best = usb;
+    double best_score = 0;
+    bool first = true;
+    for (auto latency : tune_latencies_ms) {
+        for (auto chunk : tune_chunk_sizes) {
+            usb_settings candidate { latency, chunk, chunk };
+            applyUsb(candidate);
+
+            /* Both scores are "bigger is better". */
+            double score = profile == tune_latency ?
+                -roundTripSeconds() :
+                bulkBytesPerSecond();
+            if (first || score > best_score) {
+                best = candidate;
+                best_score = score;
+                first = false;
+            }
+        }
+    }
+
+    applyUsb(best);
+    return best;
+}
+
+double spi::impl::roundTripSeconds()
+{
+    /*
+     * What a synchronous write costs beyond the data itself: a fenced
+     * reply, then the empty read that checks nothing else came back.
+     */
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < tune_round_trips; ++i) {
+        collectFenced();
+        expectEmptyResponse();
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return elapsed.count() / tune_round_trips;
+}
+
+double spi::impl::bulkBytesPerSecond()
+{
+    /*
+     * Writes are runs of the set_low_bits command that's already in
+     * effect, so the pins don't move. Reads sample the low pins, one
+     * reply byte per command, a FIFO's worth at a time.
+     */
+    size_t bytes = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < tune_bulk_rounds; ++i) {
+        while (tx.size() + cs_deselect.size() <= max_write_length) {
+            queue(cs_deselect);
+        }
+        bytes += tx.size();
+        flush();
+    }
+
+    rx.clear();
+    rx.extend(fifo_size);
+    for (int i = 0; i < tune_bulk_rounds; ++i) {
+        for (size_t n = 0; n < fifo_size; ++n) {
+            queue(commands::getLowBits());
+        }
+        queue(commands::sendImmediate());
+        flush();
+        readExact(rx.data(), rx.size());
+        bytes += rx.size();
+    }
+
+    expectEmptyResponse();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return bytes / elapsed.count();
+}
+
+void spi::impl::resync()
+{
+    stats.resync();
+    tx.clear();
+    rx_pending.clear();
+    rx_pending_size = 0;
+    discardReplies();
+    sync();
+}
+
+/* Throw away whatever is left of any replies still in flight. */
+void spi::impl::discardReplies()
+{
+    uint8_t discard[512];
+    for (int i = 0; i < max_empty_reads; ++i) {
+        size_t rc = io->read(discard, sizeof(discard));
+        stats.usbRead(rc);
+        if (rc == 0) {
+            break;
+        }
+    }
+}
+
+void spi::impl::recover()
+{
+    stats.resync();
+    tx.clear();
+    rx_pending.clear();
+    rx_pending_size = 0;
+    io->reset();
+
+    /* The reset took the clock settings with it. */
+    clkdiv5 = -1;
+    init();
+}
+
+void spi::impl::readExact(uint8_t *buffer, size_t size)
+{
+    /* A queued wait-on-GPIO command may hold the reply back this long. */
+    auto deadline = std::chrono::steady_clock::now() +
+        std::chrono::milliseconds(wait_budget_ms);
+
+    size_t got = 0;
+    int empty_reads = 0;
+    while (got < size) {
+        size_t rc = io->read(buffer + got, size - got);
+        stats.usbRead(rc);
+        if (rc == 0 && empty_reads >= max_empty_reads &&
+            std::chrono::steady_clock::now() < deadline)
+        {
+            std::this_thread::sleep_for(wait_poll_interval);
+            continue;
+        }
+        if (rc == 0 && ++empty_reads > max_empty_reads) {
+            std::ostringstream what;
+            what << WHEN()
+                 << "expected " << size << " byte reply but got "
+                 << got << " bytes.";
+            throw error(what.str());
+        }
+        if (rc > 0) {
+            /* Only give up after that many misses in a row. */
+            empty_reads = 0;
+            deadline = std::chrono::steady_clock::now() +
+                std::chrono::milliseconds(wait_budget_ms);
+        }
+        got += rc;
+    }
+}
+
+void spi::impl::closeSegment()
+{
+    if (tx.empty()) {
+        return;
+    }
+
+    job::segment seg;
+    if (tx.size() > max_copied_segment) {
+        seg.tx = std::move(tx);
+        tx = command_buffer { pool.acquire() };
+        ++building->blocks;
+    } else {
+        seg.tx = command_buffer { tx.size() };
+        seg.tx.append(tx.data(), tx.size());
+        tx.clear();
+    }
+    seg.rx.swap(rx_pending);
+    seg.rx_size = rx_pending_size;
+    rx_pending_size = 0;
+    building->segments.push_back(std::move(seg));
+}
+
+template<class Encode>
+void spi::impl::run(
+    transaction_type type, uint64_t frames, uint64_t payload, Encode encode)
+{
+    auto started = counters::now();
+    try {
+        drain();
+        encode();
+        finish();
+    } catch (...) {
+        stats.failure();
+        pins_stale = true;
+        throw;
+    }
+    stats.transaction(type, frames, payload, started);
+}
+
+void spi::impl::beginJob(
+    transaction_type type, uint64_t frames, uint64_t payload)
+{
+    building.reset(new job);
+    building->type = type;
+    building->frames = frames;
+    building->payload = payload;
+    building->started = counters::now();
+}
+
+void spi::impl::checkBatch(const batch& b) const
+{
+    if (b.selected_) {
+        throw error(WHEN("batch ends with chip select asserted."));
+    }
+    if (clashes(b)) {
+        throw error(WHEN("batch uses a chip select as a GPIO."));
+    }
+}
+
+/* Check b and encode it as the next job; false if there's nothing to do. */
+bool spi::impl::beginBatchJob(const batch& b)
+{
+    checkBatch(b);
+    if (b.empty()) {
+        return false;
+    }
+
+    beginJob(transaction_type::execute, b.transactions(), b.payload());
+    encode(b);
+    return true;
+}
+
+std::future<void> spi::impl::submitJob()
+{
+    auto result = std::make_shared<std::promise<void>>();
+    submitJob([result](std::exception_ptr e) {
+        if (e) {
+            result->set_exception(e);
+        } else {
+            result->set_value();
+        }
+    });
+    return result->get_future();
+}
+
+void spi::impl::submitJob(completion done)
+{
+    collect();
+
+    std::unique_ptr<job> j;
+    j.swap(building);
+    j->done = std::move(done);
+    j->restore = restoreCommands(clkdiv5 > 0, clkdiv, cs_deselect,
+        commands::setHighBits(gpio_high, gpio_high_dir));
+    j->waited = wait_budget_ms > 0;
+    ++submitted;
+
+    /* The I/O thread doesn't time waits out; see batch::waitHigh(). */
+    wait_budget_ms = 0;
+
+    {
+        /*
+         * Hold the caller back while queued jobs have their share of the
+         * pool, unless there's nothing queued for it to wait on. A
+         * completion submitting more work runs on the I/O thread itself
+         * and mustn't wait for it.
+         */
+        std::unique_lock<std::mutex> lock { io_mutex };
+        if (std::this_thread::get_id() != io_thread.get_id()) {
+            io_room.wait(lock, [this, &j]() {
+                return queued_blocks == 0 ||
+                    queued_blocks + j->blocks <= block_limit;
+            });
+        }
+        queued_blocks += j->blocks;
+        jobs.push_back(std::move(j));
+        if (submit_it == jobs.end()) {
+            submit_it = std::prev(jobs.end());
+        }
+        if (!io_thread.joinable()) {
+            io_thread = std::thread { [this]() { ioLoop(); } };
+        }
+    }
+    io_work.notify_one();
+}
+
+void spi::impl::drain()
+{
+    std::unique_lock<std::mutex> lock { io_mutex };
+    io_idle.wait(lock, [this]() { return jobs.empty(); });
+}
+
+void spi::impl::ioLoop()
+{
+    std::deque<transfer> in_flight;
+    bool read_in_flight = false;
+
+    /*
+     * A segment whose write is already queued but whose read has to wait
+     * for the one in flight, on transports that can't overlap reads.
+     */
+    job *held = nullptr;
+    size_t held_segment = 0;
+
+    /*
+     * Set once a segment has failed. Nothing more goes out until what's
+     * in flight has drained and the channel has been brought back to a
+     * known state by recoverJobs().
+     */
+    bool recovering = false;
+
+    std::unique_lock<std::mutex> lock { io_mutex };
+    for (;;) {
+        if (held && !read_in_flight && !recovering) {
+            job& j = *held;
+            held = nullptr;
+            lock.unlock();
+            --j.outstanding;
+            read_in_flight = submitSegmentRead(j, held_segment, in_flight);
+            lock.lock();
+
+            if (!read_in_flight) {
+                recovering = true;
+            } else if (j.outstanding == 0 &&
+                j.next_segment == j.segments.size())
+            {
+                finishJob(lock, &j);
+            }
+        }
+
+        if (recovering && in_flight.empty()) {
+            if (held) {
+                /* Its read never went out; the reply is discarded. */
+                --held->outstanding;
+                held = nullptr;
+            }
+            recoverJobs(lock);
+            recovering = false;
+            continue;
+        }
+
+        /*
+         * Keep the USB stack topped up. Writes always go straight out so
+         * the MPSSE never runs dry; only reads are held back unless the
+         * transport says overlapping them is safe.
+         */
+        while (!recovering && in_flight.size() < max_in_flight &&
+            submit_it != jobs.end())
+        {
+            job& j = **submit_it;
+            size_t index = j.next_segment;
+            bool reads = j.segments[index].rx_size > 0;
+            bool hold = reads && read_in_flight && !io->overlappedReads();
+            if (hold && held) {
+                break;
+            }
+            if (++j.next_segment == j.segments.size()) {
+                ++submit_it;
+            }
+
+            lock.unlock();
+            bool ok = submitSegmentWrite(j, index, in_flight);
+            if (ok && hold) {
+                /* Counted so the job can't finish before its read is in. */
+                ++j.outstanding;
+                held = &j;
+                held_segment = index;
+            } else if (ok && reads) {
+                ok = submitSegmentRead(j, index, in_flight);
+                read_in_flight = read_in_flight || ok;
+            }
+            lock.lock();
+
+            if (!ok) {
+                recovering = true;
+            }
+        }
+
+        if (in_flight.empty()) {
+            /* Only jobs that failed before anything was queued are left. */
+            while (!jobs.empty() && jobs.begin() != submit_it) {
+                finishJob(lock, jobs.front().get());
+            }
+
+            if (jobs.empty()) {
+                io_idle.notify_all();
+                if (stopping) {
+                    return;
+                }
+                io_work.wait(lock);
+            }
+            continue;
+        }
+
+        transfer t = in_flight.front();
+        in_flight.pop_front();
+        lock.unlock();
+
+        completeSegment(t);
+        if (t.read) {
+            read_in_flight = false;
+        }
+
+        lock.lock();
+        if (t.owner->failure) {
+            recovering = true;
+        } else if (!recovering && t.owner->outstanding == 0 &&
+            t.owner->next_segment == t.owner->segments.size())
+        {
+            finishJob(lock, t.owner);
+        }
+    }
+}
+
+void spi::impl::recoverJobs(std::unique_lock<std::mutex>& lock)
+{
+    /*
+     * Anything that went out alongside the failed segment may have been
+     * read out of step, and a frame may have been cut off with its chip
+     * select still asserted, so no job that reached the transport can be
+     * trusted. Jobs that haven't started yet are left queued.
+     */
+    auto end = submit_it;
+    if (end != jobs.end() && (*end)->next_segment > 0) {
+        (*end)->next_segment = (*end)->segments.size();
+        submit_it = ++end;
+    }
+
+    bool waited = false;
+    size_t abandoned = 0;
+    for (auto it = jobs.begin(); it != end; ++it) {
+        waited = waited || (*it)->waited;
+        fail(**it, WHEN("abandoned after an earlier transfer failed."));
+        ++abandoned;
+    }
+    if (abandoned == 0) {
+        return;
+    }
+    auto restore = (*std::prev(end))->restore;
+
+    /*
+     * As collectFenced() does: a wait that's still pending would swallow
+     * anything we sent, so that takes a reset of the channel rather than
+     * a resync. Either way the pins are driven to where the last of
+     * these jobs would have left them before the queue carries on.
+     */
+    lock.unlock();
+    try {
+        stats.resync();
+        if (waited) {
+            io->reset();
+        } else {
+            discardReplies();
+        }
+        sync();
+        sendRaw(restore);
+        expectEmptyResponse();
+    } catch (const error&) {
+    }
+    lock.lock();
+
+    /* Counted, as more jobs may be queued while each one completes. */
+    while (abandoned-- > 0) {
+        finishJob(lock, jobs.front().get());
+    }
+}
+
+void spi::impl::finishJob(std::unique_lock<std::mutex>& lock, job *owner)
+{
+    auto it = std::find_if(jobs.begin(), jobs.end(),
+        [owner](const std::unique_ptr<job>& j) { return j.get() == owner; });
+    auto j = std::move(*it);
+    jobs.erase(it);
+
+    /* Give the blocks back before making room for more. */
+    j->segments.clear();
+    queued_blocks -= j->blocks;
+    io_room.notify_all();
+
+    if (j->failure) {
+        stats.failure();
+        pins_stale = true;
+    } else {
+        stats.transaction(j->type, j->frames, j->payload, j->started);
+    }
+
+    lock.unlock();
+    if (j->done) {
+        j->done(j->failure);
+    }
+    lock.lock();
+}
+
+bool spi::impl::submitSegmentWrite(
+    job& j, size_t index, std::deque<transfer>& in_flight)
+{
+    auto& seg = j.segments[index];
+    std::shared_ptr<transport::pending> write_io;
+    try {
+        write_io = io->submitWrite(seg.tx.data(), seg.tx.size());
+    } catch (const error& e) {
+        fail(j, e.what());
+        return false;
+    }
+    ++j.outstanding;
+    in_flight.push_back({ write_io, &j, index, false });
+    return true;
+}
+
+bool spi::impl::submitSegmentRead(
+    job& j, size_t index, std::deque<transfer>& in_flight)
+{
+    auto& seg = j.segments[index];
+    uint8_t *dest = seg.rx.front().first;
+    if (seg.rx.size() > 1) {
+        seg.scratch = command_buffer { seg.rx_size };
+        dest = seg.scratch.extend(seg.rx_size);
+    }
+
+    std::shared_ptr<transport::pending> read_io;
+    try {
+        read_io = io->submitRead(dest, seg.rx_size);
+    } catch (const error& e) {
+        fail(j, e.what());
+        return false;
+    }
+    ++j.outstanding;
+    in_flight.push_back({ read_io, &j, index, true });
+    return true;
+}
+
+void spi::impl::completeSegment(const transfer& t)
+{
+    job& j = *t.owner;
+    auto& seg = j.segments[t.segment];
+    size_t expected = t.read ? seg.rx_size : seg.tx.size();
+
+    size_t rc = 0;
+    try {
+        rc = t.io->wait();
+    } catch (const error& e) {
+        --j.outstanding;
+        fail(j, e.what());
+        return;
+    }
+    --j.outstanding;
+
+    if (t.read) {
+        stats.usbRead(rc);
+    } else {
+        stats.usbWrite(rc);
+    }
+
+    if (rc != expected) {
+        std::ostringstream what;
+        what << WHEN()
+             << "expected to transfer " << expected << " bytes but got "
+             << rc << " bytes.";
+        fail(j, what.str());
+        return;
+    }
+
+    if (t.read && !seg.scratch.empty()) {
+        auto src = seg.scratch.data();
+        for (auto& dst : seg.rx) {
+            memcpy(dst.first, src, dst.second);
+            src += dst.second;
+        }
+    }
+}
+
+void spi::impl::fail(job& j, const std::string& when)
+{
+    if (!j.failure) {
+        j.failure = std::make_exception_ptr(error(when));
+    }
+}
+
+void spi::impl::useChipSelect(uint8_t pin)
+{
+    /*
+     * Every chip select we've seen is kept driven high so that devices
+     * sharing the bus stay deselected while another one is addressed.
+     */
+    cs_mask |= pin;
+    cs_select = pinState(cs_pin);
+    cs_deselect = pinState(0);
+}
+
+static_packet<3> spi::impl::pinState(uint8_t selected) const
+{
+    return commands::setLowBits(
+        uint8_t(pins::sck | (cs_mask & ~selected) | gpio_low),
+        uint8_t(pins::sck | pins::sdata | cs_mask | gpio_low_dir)
+    );
+}
+
+
+bool spi::impl::clashes(const batch& b) const
+{
+    return uint8_t(b.gpio_) & (cs_mask | cs_pin | b.selects_);
+}
+
+/*
+ * Apply a GPIO step to the tracked pin state, queueing a command only
+ * for a byte that actually changed. selected is the chip select that is
+ * asserted at this point of the stream, if any, so that it stays so.
+ */
+void spi::impl::queueGpio(
+    batch::step_type type, uint16_t mask, uint8_t selected)
+{
+    uint8_t low = uint8_t(mask);
+    uint8_t high = uint8_t(mask >> 8);
+    uint8_t old_low = gpio_low;
+    uint8_t old_low_dir = gpio_low_dir;
+    uint8_t old_high = gpio_high;
+    uint8_t old_high_dir = gpio_high_dir;
+
+    switch (type) {
+    case batch::step_type::gpio_set:
+        gpio_low |= low;
+        gpio_high |= high;
+        gpio_low_dir |= low;
+        gpio_high_dir |= high;
+        break;
+    case batch::step_type::gpio_clear:
+        gpio_low &= ~low;
+        gpio_high &= ~high;
+        gpio_low_dir |= low;
+        gpio_high_dir |= high;
+        break;
+    default:
+        gpio_low &= ~low;
+        gpio_high &= ~high;
+        gpio_low_dir &= ~low;
+        gpio_high_dir &= ~high;
+        break;
+    }
+
+    if (gpio_low != old_low || gpio_low_dir != old_low_dir) {
+        cs_select = pinState(cs_pin);
+        cs_deselect = pinState(0);
+        queue(pinState(selected));
+    }
+    if (gpio_high != old_high || gpio_high_dir != old_high_dir) {
+        queue(commands::setHighBits(gpio_high, gpio_high_dir));
+    }
+}
+
+void spi::impl::init()
+{
+    sync();
+
+    /* Set up basic parameters. */
+    sendRaw(init_modes);
+
+    /* Set the baudrate. */
+    queueClock(clock_hz);
+    flush();
+
+    /* Configure pin states. */
+    sendRaw(cs_deselect + commands::setHighBits(gpio_high, gpio_high_dir));
+    expectEmptyResponse();
+}
+
+void spi::impl::sync()
+{
+    stats.sync();
+    sendRaw(commands::loopbackEnable());
+    expectEmptyResponse();
+
+    sendRaw(commands::bogus());
+
+    expectResponse({
+        bad_opcode_reply,
+        opcodes::bogus,
+    });
+    expectEmptyResponse();
+
+    sendRaw(commands::loopbackDisable());
+}
+
+void spi::impl::expectResponse(const packet& p)
+{
+    uint8_t buffer[packet::capacity];
+    size_t rc = io->read(buffer, p.size());
+    stats.usbRead(rc);
+    if (rc != p.size()) {
+        std::ostringstream what;
+        what << WHEN()
+             << "expected " << p.size() << " byte reply but got "
+             << rc << " bytes.";
+        onError(what.str());
+    }
+
+    if (memcmp(p.data(), buffer, p.size()) != 0) {
+        onError(WHEN("did not receive expected reply"));
+    }
+}
+
+void spi::impl::expectEmptyResponse()
+{
+    expectResponse(packet {});
+}
+
+void spi::impl::onError(const std::string& when)
+{
+    throw error(when);
+}
+
+} /* namespace ft2232h_spi */
@@ -17,16 +17,24 @@
 #ifndef FT2232H_SPI_H
 #define FT2232H_SPI_H
 
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <initializer_list>
+#include <future>
 #include <memory>
 #include <vector>
 
 #include "ft2232h-spi/exceptions.h"
+#include "ft2232h-spi/metrics.h"
 #include "ft2232h-spi/util.h"
 
 namespace ft2232h_spi
 {
 
-struct packet;
+class buffer_pool;
+class packet;
+class transport;
 struct endpoint
 {
     int vid;
@@ -35,19 +43,30 @@ struct endpoint
     std::string description;
     std::string serial;
 
+    /*
+     * Where the adapter is plugged in: the USB bus number, then the port
+     * on each hub from the root down, e.g. "3-1.4". When set, the adapter
+     * is opened by location, without reading any device's strings.
+     */
+    std::string path;
+
     endpoint() = default;
     endpoint(const endpoint&) = default;
     endpoint(endpoint&&) = default;
+    endpoint& operator=(const endpoint&) = default;
+    endpoint& operator=(endpoint&&) = default;
     endpoint(
         int vid, int pid,
         const std::string& manufacturer,
         const std::string& description,
-        const std::string& serial) :
+        const std::string& serial,
+        const std::string& path = std::string {}) :
             vid(vid),
             pid(pid),
             manufacturer(manufacturer),
             description(description),
-            serial(serial)
+            serial(serial),
+            path(path)
     { }
 
     bool match(const endpoint& other) const {
@@ -55,10 +74,15 @@ struct endpoint
             equal_or_defaulted(pid, other.pid) &&
             equal_or_defaulted(manufacturer, other.manufacturer) &&
             equal_or_defaulted(description, other.description) &&
-            equal_or_defaulted(serial, other.serial);
+            equal_or_defaulted(serial, other.serial) &&
+            equal_or_defaulted(path, other.path);
     }
 };
 
+/*
+ * Scans the bus and reads every matching adapter's strings, which means
+ * opening each one. Use an endpoint_cache to rescan often.
+ */
 std::vector<endpoint> getAvailableEndpoints(int vid, int pid);
 
 struct spi
@@ -75,7 +99,32 @@ public:
         dbus7 = 0x80,
 
         sck = dbus0,
-        sdata = dbus1
+        sdata = dbus1,
+
+        gpiol0 = dbus4,
+        gpiol1 = dbus5,
+        gpiol2 = dbus6,
+        gpiol3 = dbus7
+    };
+
+    /*
+     * Pins usable as GPIO, as a 16-bit mask: ADBUS in the low byte (only
+     * the pins not taken by SCK, MOSI, MISO and the usual chip select)
+     * and ACBUS in the high byte.
+     */
+    enum gpios : uint16_t {
+        adbus4 = 0x0010,
+        adbus5 = 0x0020,
+        adbus6 = 0x0040,
+        adbus7 = 0x0080,
+        acbus0 = 0x0100,
+        acbus1 = 0x0200,
+        acbus2 = 0x0400,
+        acbus3 = 0x0800,
+        acbus4 = 0x1000,
+        acbus5 = 0x2000,
+        acbus6 = 0x4000,
+        acbus7 = 0x8000
     };
     enum busses : uint8_t {
         bus_any = 0,
@@ -85,9 +134,191 @@ public:
         bus_d = 4
     };
 
+    /*
+     * A queue of chip-select frames to be encoded into one MPSSE command
+     * stream and submitted with a single USB write by spi::execute().
+     *
+     * Buffers passed by pointer are not copied; they must stay valid until
+     * the batch has been executed. Receive buffers are filled in by
+     * execute().
+     */
+    class batch
+    {
+    public:
+        /*
+         * Primitive steps. Data steps must sit between select/deselect.
+         * select() asserts the device's own chip select unless another
+         * pin is given; SCK, MOSI and MISO (ADBUS0-2) are refused.
+         */
+        batch& select(pins cs = pins(0));
+        batch& deselect();
+        batch& write(const uint8_t *data, size_t size);
+        batch& write(const packet& p);
+        batch& read(uint8_t *rx, size_t size);
+        batch& exchange(const uint8_t *tx, uint8_t *rx, size_t size);
+
+        /* Complete chip-select frames, mirroring the spi methods. */
+        batch& transmit(const uint8_t *data, size_t size);
+        batch& transmit(const packet& p);
+        batch& transfer(const uint8_t *tx, uint8_t *rx, size_t size);
+        batch& receive(uint8_t *rx, size_t size);
+
+        /*
+         * Change the SCK frequency for the steps that follow. Only the
+         * divisor commands that actually change are emitted.
+         */
+        batch& setClock(uint32_t hz);
+
+        /*
+         * Hold the rest of the batch on the chip until gpiol1 goes high
+         * (or low), without host-side polling. May sit inside or outside
+         * a frame. If the level doesn't arrive within timeout_ms the
+         * channel is reset and re-initialised and execute() throws
+         * wait_timeout; asynchronous execution doesn't enforce the timeout.
+         */
+        batch& waitHigh(uint32_t timeout_ms);
+        batch& waitLow(uint32_t timeout_ms);
+
+        /*
+         * Pause the command stream for at least t, timed by the MPSSE
+         * rather than the host. Between frames this is SCK cycles with
+         * no data at the clock in effect, so it's exact to a cycle.
+         * Inside a frame SCK must not move, so it's repeated pin state
+         * commands, three bytes of USB traffic per 50 ns, and may run
+         * somewhat long; there t is limited to max_framed_delay_ns.
+         */
+        batch& delay(std::chrono::nanoseconds t);
+
+        /*
+         * GPIO steps, which may sit inside or outside a frame, e.g. to
+         * flip a display's D/C line between the command and data bytes.
+         * gpioSet()/gpioClear() drive the pins in mask (a set of gpios)
+         * high/low, gpioRelease() turns them back into inputs and
+         * gpioRead() stores the ADBUS levels in levels[0] and the ACBUS
+         * levels in levels[1]. Pin state is tracked across batches and
+         * only commands that change it are sent, except after a failed
+         * transfer, when it's all driven again. A pin can't be both a
+         * GPIO and a chip select.
+         */
+        batch& gpioSet(uint16_t mask);
+        batch& gpioClear(uint16_t mask);
+        batch& gpioRelease(uint16_t mask);
+        batch& gpioRead(uint8_t *levels);
+
+        /*
+         * Copy every step of other onto the end of this batch. Frames in
+         * other that use the default chip select are retargeted to cs.
+         */
+        batch& append(const batch& other, pins cs = pins(0));
+
+        size_t transactions() const { return transactions_; }
+
+        /* Wait-on-GPIO steps, any of which can time the batch out. */
+        size_t waits() const { return waits_; }
+
+        /* Bytes clocked by the data steps, in either direction. */
+        size_t payload() const { return payload_; }
+
+        bool empty() const { return steps_.empty(); }
+        void clear();
+
+    private:
+        friend struct spi;
+
+        enum class step_type : uint8_t {
+            select,
+            deselect,
+            write,
+            read,
+            read_write,
+            set_clock,
+            wait_high,
+            wait_low,
+            delay,
+            gpio_set,
+            gpio_clear,
+            gpio_release,
+            gpio_read
+        };
+        struct step
+        {
+            step_type type;
+            const uint8_t *out;
+            uint8_t *in;
+            size_t size;
+            /*
+             * Offset into storage_ for writes copied into the batch. For
+             * select steps size holds the chip select, 0 for the default;
+             * for waits it holds the timeout in milliseconds, for
+             * delays the length in nanoseconds and for GPIO steps the
+             * pin mask.
+             */
+            size_t offset;
+        };
+
+        batch& data(step_type type, const uint8_t *out, uint8_t *in, size_t size);
+        batch& gpio(step_type type, uint16_t mask);
+
+        std::vector<step> steps_;
+        std::vector<uint8_t> storage_;
+        size_t transactions_ = 0;
+        size_t payload_ = 0;
+        size_t waits_ = 0;
+        bool selected_ = false;
+
+        /* Every GPIO and explicit chip select used, to catch clashes. */
+        uint16_t gpio_ = 0;
+        uint8_t selects_ = 0;
+    };
+
+    /* One piece of a payload scattered across buffers, like struct iovec. */
+    struct segment
+    {
+        const uint8_t *data;
+        size_t size;
+    };
+
+    /*
+     * USB transfer settings. latency_ms is how long the chip holds on to
+     * a partly filled reply buffer before sending it anyway (1-255 ms);
+     * the chunk sizes are the bulk transfer sizes the USB layer splits
+     * writes and reads into.
+     */
+    struct usb_settings
+    {
+        uint8_t latency_ms;
+        uint32_t write_chunk;
+        uint32_t read_chunk;
+    };
+
+    /* What autoTune() optimises for. */
+    enum tuning_profile : uint8_t {
+        tune_none,
+        tune_latency,
+        tune_throughput
+    };
+
+    static constexpr uint32_t default_clock_hz = 1000000;
+
+    /* The longest batch::delay() allowed inside a chip-select frame. */
+    static constexpr uint64_t max_framed_delay_ns = 50000;
+
     virtual ~spi() noexcept(true);
 
-    spi(pins cs_pin, const endpoint& ep, busses bus = bus_a);
+    /* A tuning profile other than tune_none runs autoTune() once open. */
+    spi(
+        pins cs_pin, const endpoint& ep, busses bus = bus_a,
+        uint32_t clock_hz = default_clock_hz,
+        tuning_profile tune = tune_none);
+
+    /*
+     * Drive an already-open channel through io, e.g. an mpsse_emulator.
+     * io must deliver the MPSSE stream to a device in MPSSE mode.
+     */
+    spi(
+        pins cs_pin, std::unique_ptr<transport> io,
+        uint32_t clock_hz = default_clock_hz,
+        tuning_profile tune = tune_none);
     spi(const spi&) = delete;
     spi(spi&&) noexcept(true);
 
@@ -96,24 +327,150 @@ public:
 
     void transmit(const packet& p);
 
-private:
-    enum class opcodes : uint8_t {
-        write                = 0x10,
-        set_low_bits         = 0x80,
-        set_high_bits        = 0x82,
-        loopback_enable      = 0x84,
-        loopback_disable     = 0x85,
-        set_clkdiv           = 0x86,
-        clkdiv_5_disable     = 0x8a,
-        clkdiv_5_enable      = 0x8b,
-        three_phase_enable   = 0x8c,
-        three_phase_disable  = 0x8d,
-        adaptive_clk_enable  = 0x96,
-        adaptive_clk_disable = 0x97,
-        bogus                = 0xab
-    };
+    /*
+     * Send an arbitrarily large payload in a single chip-select frame.
+     * The payload is split into 64 KiB MPSSE write commands and handed
+     * to the USB layer in large writes rather than per-packet round trips.
+     */
+    void transmit(const uint8_t *data, size_t size);
+
+    /*
+     * Send the concatenation of the segments in a single chip-select
+     * frame, e.g. a command, an address and a payload held in separate
+     * buffers. MPSSE write commands span segment boundaries, and each
+     * payload byte is copied once, straight into the USB buffer.
+     */
+    void transmit(const segment *segments, size_t count);
+    void transmit(std::initializer_list<segment> segments);
+
+    /*
+     * Clock out size bytes from tx while clocking the same number of
+     * bytes from MISO into rx, all in a single chip-select frame.
+     */
+    void transfer(const uint8_t *tx, uint8_t *rx, size_t size);
+
+    /* Clock size bytes from MISO into rx in a single chip-select frame. */
+    void receive(uint8_t *rx, size_t size);
+
+    /*
+     * Encode every step of b into one command stream, send it with a
+     * single write and distribute any read-back data to its buffers.
+     */
+    void execute(const batch& b);
+
+    /*
+     * Throw the error execute() would for a batch this device can't
+     * take, such as one left selected, without sending anything.
+     */
+    void check(const batch& b) const;
 
+    /*
+     * In pipelined mode write-only operations return as soon as their
+     * commands are handed to USB instead of checking for a reply. The
+     * stream is verified at fences: explicitly via fence(), implicitly
+     * by any operation that reads data back, and, when fence_interval is
+     * non-zero, after every fence_interval operations. A failed fence
+     * throws pipeline_error naming the unconfirmed transfers.
+     */
+    void setPipelined(bool enabled, uint64_t fence_interval = 0);
+    void fence();
 
+    /* Number of operations submitted so far; the id of the latest one. */
+    uint64_t submitted() const;
+
+    /* Completion callback for asynchronous operations; null on success. */
+    typedef std::function<void(std::exception_ptr)> completion;
+
+    /*
+     * Asynchronous counterparts of the operations above. Commands are
+     * encoded on the calling thread and handed to a per-device I/O thread
+     * that keeps several USB bulk transfers in flight at once. Receive
+     * buffers must stay valid until the operation completes; transmit
+     * data and batches may be released as soon as the call returns.
+     * Completions run on the I/O thread, except that an empty batch
+     * completes at once on the calling thread. Synchronous calls wait for
+     * any outstanding asynchronous work before touching the device. When
+     * an operation fails, every operation that had already reached the
+     * transport fails with it, the channel is resynchronised and its chip
+     * selects released, and only then do later operations go out.
+     */
+    std::future<void> transmitAsync(const uint8_t *data, size_t size);
+    std::future<void> transmitAsync(const segment *segments, size_t count);
+    std::future<void> transferAsync(const uint8_t *tx, uint8_t *rx, size_t size);
+    std::future<void> receiveAsync(uint8_t *rx, size_t size);
+    std::future<void> executeAsync(const batch& b);
+    void executeAsync(const batch& b, completion done);
+
+    /* Block until every asynchronous operation has completed. */
+    void wait();
+
+    /*
+     * USB buffers come from a per-device buffer_pool: the synchronous
+     * path holds one for commands and one for replies, and asynchronous
+     * transfers bigger than a FIFO's worth borrow theirs while queued;
+     * smaller ones get buffers sized to fit. At most high_water idle
+     * buffers (about 132 KiB each) are kept between bursts; the default
+     * is 4.
+     *
+     * Queued asynchronous operations may hold at most limit buffers
+     * between them, 16 by default. Submitting one that would go over
+     * blocks until enough earlier ones have completed; one that needs
+     * more than the limit on its own waits for the queue to empty.
+     */
+    void setBufferHighWater(size_t buffers);
+    void setBufferLimit(size_t limit);
+    const buffer_pool& buffers() const;
+
+    /*
+     * Until changed, the USB layer's defaults apply: a 16 ms latency timer
+     * and 4 KiB chunks, which suit neither small register accesses nor
+     * bulk streaming particularly well.
+     */
+    void setLatencyTimer(uint8_t ms);
+    void setChunkSizes(uint32_t write_chunk, uint32_t read_chunk);
+    usb_settings usbSettings() const;
+
+    /*
+     * Time round trips and bulk transfers over a range of latency timer
+     * and chunk size pairs, keep the best one for profile and return it.
+     * Only pin states that are already set are driven while measuring,
+     * so no chip select is asserted.
+     */
+    usb_settings autoTune(tuning_profile profile);
+
+    /*
+     * Counters and per-type latency histograms for this device. Reading
+     * them takes no lock and doesn't slow down the I/O paths.
+     */
+    metrics_snapshot metrics() const;
+
+    /*
+     * Record every USB write and read, with timestamps, to a binary trace
+     * file at path until stopTrace(), for replay() later. Recording goes
+     * through a ring of ring_size bytes (0 for the default) that a
+     * background thread drains to disk; stopTrace() returns how many
+     * records were dropped because the ring was full. If the file couldn't
+     * be written in full, stopTrace() still detaches the trace, then
+     * throws error.
+     */
+    void startTrace(const std::string& path, size_t ring_size = 0);
+    uint64_t stopTrace();
+
+    /*
+     * Set the SCK frequency to the fastest the FT2232H can produce that
+     * doesn't exceed hz and return that frequency. The achievable range
+     * is 92 Hz to 30 MHz; slower clocks throw error.
+     */
+    uint32_t setClock(uint32_t hz);
+    uint32_t clock() const;
+
+    /*
+     * Drive another chip select high (deselected) so that a second device
+     * can share the bus through batch::select(cs).
+     */
+    void addChipSelect(pins cs);
+
+private:
     struct impl;
     std::unique_ptr<impl> d;
 };
@@ -0,0 +1,102 @@
+/* metrics.h
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef FT2232H_SPI_METRICS_H
+#define FT2232H_SPI_METRICS_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace ft2232h_spi
+{
+
+/* Transaction kinds that get a latency histogram of their own. */
+enum class transaction_type : uint8_t {
+    transmit,
+    transfer,
+    receive,
+    execute
+};
+constexpr size_t transaction_types = 4;
+
+/*
+ * Per-call latency, from the call (or async submission) to completion.
+ * Bucket 0 counts calls that completed in under 1 us, bucket i
+ * those that took [2^(i-1), 2^i) us; the last bucket also takes anything
+ * slower.
+ */
+struct latency_histogram
+{
+    static constexpr size_t buckets = 24;
+
+    uint64_t counts[buckets];
+    uint64_t count;
+    uint64_t total_ns;
+
+    double meanSeconds() const { return count ? total_ns * 1e-9 / count : 0; }
+};
+
+/*
+ * A point-in-time copy of a device's counters, see spi::metrics(). The
+ * counters are updated independently, so a snapshot taken while another
+ * thread is mid-transaction may be off by that one transaction.
+ *
+ * Everything reads as zero, and enabled is false, when the library was
+ * built with FT2232H_SPI_METRICS off.
+ */
+struct metrics_snapshot
+{
+    bool enabled;
+
+    /* Chip-select frames completed and the SPI payload bytes they moved. */
+    uint64_t transactions;
+    uint64_t payload_bytes;
+
+    /* Calls into the transport, i.e. USB bulk writes and reads. */
+    uint64_t usb_writes;
+    uint64_t usb_write_bytes;
+    uint64_t usb_reads;
+    uint64_t usb_read_bytes;
+
+    /* MPSSE synchronisations, at open time and after a failed fence. */
+    uint64_t syncs;
+    uint64_t resyncs;
+
+    /* Operations that ended in an exception or a failed completion. */
+    uint64_t errors;
+
+    latency_histogram latency[transaction_types];
+
+    double meanWriteSize() const
+    {
+        return usb_writes ? double(usb_write_bytes) / usb_writes : 0;
+    }
+};
+
+/* How much a bulk operation moved and how long it took. */
+struct throughput
+{
+    uint64_t bytes;
+    double seconds;
+
+    double megabytesPerSecond() const {
+        return seconds > 0 ? bytes / seconds / 1e6 : 0;
+    }
+};
+
+} /* namespace ft2232h_spi */
+
+#endif /* FT2232H_SPI_METRICS_H */
@@ -0,0 +1,632 @@
+/* mpsse-emulator.cpp
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mpsse-emulator.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "mpsse.h"
+
+namespace ft2232h_spi {
+
+namespace {
+
+/* Data shifting command flags. */
+constexpr uint8_t shift_bit_mode = 0x02;
+constexpr uint8_t shift_out = 0x10;
+constexpr uint8_t shift_in = 0x20;
+constexpr uint8_t shift_tms = 0x40;
+
+/* The data output pin, which idles at whatever set_low_bits left it at. */
+constexpr uint8_t mosi_pin = 0x02;
+
+/* The pin the wait-on-I/O commands watch. */
+constexpr uint8_t gpiol1_pin = 0x20;
+}
+
+mpsse_emulator::slave::~slave()
+{
+}
+
+mpsse_emulator::mpsse_emulator()
+{
+}
+
+mpsse_emulator::~mpsse_emulator()
+{
+}
+
+void mpsse_emulator::attach(uint8_t cs, std::shared_ptr<slave> s)
+{
+    std::lock_guard<std::mutex> lock { mutex_ };
+    slaves_.emplace_back(cs, std::move(s));
+}
+
+void mpsse_emulator::setInputs(uint8_t low, uint8_t high)
+{
+    std::lock_guard<std::mutex> lock { mutex_ };
+    low_inputs_ = low;
+    high_inputs_ = high;
+
+    /* A new level may release a pending wait. */
+    run();
+}
+
+bool mpsse_emulator::waiting() const
+{
+    std::lock_guard<std::mutex> lock { mutex_ };
+    return waiting_;
+}
+
+void mpsse_emulator::write(const uint8_t *data, size_t size)
+{
+    std::lock_guard<std::mutex> lock { mutex_ };
+    ++writes_;
+    bytes_written_ += size;
+
+    /* Commands may be split across writes, so keep any incomplete tail. */
+    input_.insert(input_.end(), data, data + size);
+    run();
+}
+
+void mpsse_emulator::run()
+{
+    size_t offset = 0;
+    while (offset < input_.size()) {
+        size_t used = parse(input_.data() + offset, input_.size() - offset);
+        if (used == 0) {
+            break;
+        }
+        offset += used;
+    }
+    input_.erase(input_.begin(), input_.begin() + offset);
+}
+
+size_t mpsse_emulator::read(uint8_t *data, size_t size)
+{
+    std::lock_guard<std::mutex> lock { mutex_ };
+    ++reads_;
+
+    size = std::min(size, output_.size());
+    std::copy(output_.begin(), output_.begin() + size, data);
+    output_.erase(output_.begin(), output_.begin() + size);
+    return size;
+}
+
+void mpsse_emulator::setLatencyTimer(uint8_t ms)
+{
+    std::lock_guard<std::mutex> lock { mutex_ };
+    latency_ms_ = ms;
+}
+
+void mpsse_emulator::setChunkSizes(uint32_t write_chunk, uint32_t read_chunk)
+{
+    std::lock_guard<std::mutex> lock { mutex_ };
+    write_chunk_ = write_chunk;
+    read_chunk_ = read_chunk;
+}
+
+void mpsse_emulator::reset()
+{
+    std::lock_guard<std::mutex> lock { mutex_ };
+    input_.clear();
+    output_.clear();
+    waiting_ = false;
+    loopback_ = false;
+}
+
+uint8_t mpsse_emulator::latencyTimer() const
+{
+    std::lock_guard<std::mutex> lock { mutex_ };
+    return latency_ms_;
+}
+
+uint32_t mpsse_emulator::writeChunkSize() const
+{
+    std::lock_guard<std::mutex> lock { mutex_ };
+    return write_chunk_;
+}
+
+uint32_t mpsse_emulator::readChunkSize() const
+{
+    std::lock_guard<std::mutex> lock { mutex_ };
+    return read_chunk_;
+}
+
+uint8_t mpsse_emulator::lowPins() const
+{
+    std::lock_guard<std::mutex> lock { mutex_ };
+    return low_;
+}
+
+uint8_t mpsse_emulator::lowDirection() const
+{
+    std::lock_guard<std::mutex> lock { mutex_ };
+    return low_dir_;
+}
+
+uint8_t mpsse_emulator::highPins() const
+{
+    std::lock_guard<std::mutex> lock { mutex_ };
+    return high_;
+}
+
+uint8_t mpsse_emulator::highDirection() const
+{
+    std::lock_guard<std::mutex> lock { mutex_ };
+    return high_dir_;
+}
+
+bool mpsse_emulator::loopback() const
+{
+    std::lock_guard<std::mutex> lock { mutex_ };
+    return loopback_;
+}
+
+uint32_t mpsse_emulator::clock() const
+{
+    std::lock_guard<std::mutex> lock { mutex_ };
+    uint32_t base = div5_ ? base_clock_div5_hz : base_clock_hz;
+    return base / (2 * (uint32_t(divisor_) + 1));
+}
+
+uint64_t mpsse_emulator::cycles() const
+{
+    std::lock_guard<std::mutex> lock { mutex_ };
+    return cycles_;
+}
+
+uint64_t mpsse_emulator::writes() const
+{
+    std::lock_guard<std::mutex> lock { mutex_ };
+    return writes_;
+}
+
+uint64_t mpsse_emulator::reads() const
+{
+    std::lock_guard<std::mutex> lock { mutex_ };
+    return reads_;
+}
+
+uint64_t mpsse_emulator::bytesWritten() const
+{
+    std::lock_guard<std::mutex> lock { mutex_ };
+    return bytes_written_;
+}
+
+/*
+ * Execute the command at the start of data, returning how many bytes it
+ * took, or 0 if it isn't all there yet or is waiting on a pin.
+ */
+size_t mpsse_emulator::parse(const uint8_t *data, size_t size)
+{
+    uint8_t op = data[0];
+
+    if (!(op & 0x80)) {
+        if ((op & shift_tms) || !(op & (shift_out | shift_in))) {
+            badOpcode(op);
+            return 1;
+        }
+
+        if (op & shift_bit_mode) {
+            size_t needed = (op & shift_out) ? 3 : 2;
+            if (size < needed) {
+                return 0;
+            }
+            cycles_ += data[1] + 1;
+            shift(op, (op & shift_out) ? data + 2 : nullptr, 1);
+            return needed;
+        }
+
+        if (size < 3) {
+            return 0;
+        }
+        size_t length = (data[1] | (data[2] << 8)) + 1;
+        size_t needed = 3 + ((op & shift_out) ? length : 0);
+        if (size < needed) {
+            return 0;
+        }
+        cycles_ += 8 * length;
+        shift(op, (op & shift_out) ? data + 3 : nullptr, length);
+        return needed;
+    }
+
+    switch (op) {
+    case uint8_t(opcodes::set_low_bits):
+        if (size < 3) {
+            return 0;
+        }
+        setLow(data[1], data[2]);
+        return 3;
+
+    case uint8_t(opcodes::set_high_bits):
+        if (size < 3) {
+            return 0;
+        }
+        high_ = data[1];
+        high_dir_ = data[2];
+        for (auto& s : slaves_) {
+            s.second->pinsChanged(low_ & low_dir_, high_ & high_dir_);
+        }
+        return 3;
+
+    case uint8_t(opcodes::get_low_bits):
+        output_.push_back((low_ & low_dir_) | (low_inputs_ & ~low_dir_));
+        return 1;
+
+    case uint8_t(opcodes::get_high_bits):
+        output_.push_back((high_ & high_dir_) | (high_inputs_ & ~high_dir_));
+        return 1;
+
+    case uint8_t(opcodes::loopback_enable):
+        loopback_ = true;
+        return 1;
+
+    case uint8_t(opcodes::loopback_disable):
+        loopback_ = false;
+        return 1;
+
+    case uint8_t(opcodes::set_clkdiv):
+        if (size < 3) {
+            return 0;
+        }
+        divisor_ = data[1] | (data[2] << 8);
+        return 3;
+
+    case uint8_t(opcodes::wait_on_high):
+    case uint8_t(opcodes::wait_on_low):
+        waiting_ = lowLevel(gpiol1_pin) != (op == uint8_t(opcodes::wait_on_high));
+        return waiting_ ? 0 : 1;
+
+    case uint8_t(opcodes::clkdiv_5_disable):
+        div5_ = false;
+        return 1;
+
+    case uint8_t(opcodes::clkdiv_5_enable):
+        div5_ = true;
+        return 1;
+
+    case uint8_t(opcodes::clock_bits):
+        if (size < 2) {
+            return 0;
+        }
+        idle(data[1] + 1);
+        return 2;
+
+    case uint8_t(opcodes::clock_bytes):
+        if (size < 3) {
+            return 0;
+        }
+        idle(8 * ((data[1] | (data[2] << 8)) + 1));
+        return 3;
+
+    case uint8_t(opcodes::send_immediate):
+    case uint8_t(opcodes::three_phase_enable):
+    case uint8_t(opcodes::three_phase_disable):
+    case uint8_t(opcodes::adaptive_clk_enable):
+    case uint8_t(opcodes::adaptive_clk_disable):
+        return 1;
+
+    default:
+        badOpcode(op);
+        return 1;
+    }
+}
+
+bool mpsse_emulator::lowLevel(uint8_t pin) const
+{
+    return ((low_ & low_dir_) | (low_inputs_ & ~low_dir_)) & pin;
+}
+
+void mpsse_emulator::setLow(uint8_t value, uint8_t direction)
+{
+    for (auto& s : slaves_) {
+        bool was = (low_dir_ & s.first) && !(low_ & s.first);
+        bool now = (direction & s.first) && !(value & s.first);
+        if (now && !was) {
+            s.second->select();
+        } else if (was && !now) {
+            s.second->deselect();
+        }
+    }
+
+    low_ = value;
+    low_dir_ = direction;
+    for (auto& s : slaves_) {
+        s.second->pinsChanged(low_ & low_dir_, high_ & high_dir_);
+    }
+}
+
+void mpsse_emulator::shift(uint8_t op, const uint8_t *out, size_t size)
+{
+    uint8_t idle = (low_ & mosi_pin) ? 0xff : 0x00;
+    for (size_t i = 0; i < size; ++i) {
+        uint8_t miso = shiftByte(out ? out[i] : idle);
+        if (op & shift_in) {
+            output_.push_back(miso);
+        }
+    }
+}
+
+uint8_t mpsse_emulator::shiftByte(uint8_t mosi)
+{
+    /* MISO idles high when nothing is driving it. */
+    uint8_t miso = 0xff;
+    bool driven = false;
+    for (auto& s : slaves_) {
+        if ((low_dir_ & s.first) && !(low_ & s.first)) {
+            uint8_t reply = s.second->exchange(mosi);
+            if (!driven) {
+                miso = reply;
+                driven = true;
+            }
+        }
+    }
+
+    return loopback_ ? mosi : miso;
+}
+
+void mpsse_emulator::idle(uint64_t cycles)
+{
+    cycles_ += cycles;
+    for (auto& s : slaves_) {
+        s.second->idle(cycles);
+    }
+}
+
+void mpsse_emulator::badOpcode(uint8_t op)
+{
+    output_.push_back(bad_opcode_reply);
+    output_.push_back(op);
+}
+
+void recording_slave::select()
+{
+    selected = true;
+    frames.emplace_back();
+}
+
+void recording_slave::deselect()
+{
+    selected = false;
+}
+
+uint8_t recording_slave::exchange(uint8_t mosi)
+{
+    frames.back().push_back(mosi);
+    if (miso.empty()) {
+        return 0xff;
+    }
+    uint8_t result = miso.front();
+    miso.pop_front();
+    return result;
+}
+
+register_slave::register_slave()
+{
+    memset(registers, 0, sizeof(registers));
+}
+
+void register_slave::select()
+{
+    addressed_ = false;
+}
+
+uint8_t register_slave::exchange(uint8_t mosi)
+{
+    if (!addressed_) {
+        addressed_ = true;
+        reading_ = mosi & 0x80;
+        address_ = mosi & 0x7f;
+        return 0xff;
+    }
+
+    uint8_t result = registers[address_];
+    if (!reading_) {
+        registers[address_] = mosi;
+    }
+    address_ = (address_ + 1) & 0x7f;
+    return result;
+}
+
+flash_slave::flash_slave(size_t size) :
+    memory(size, 0xff),
+    id { 0xef, 0x40, 0 }
+{
+    while ((size_t(1) << id[2]) < size) {
+        ++id[2];
+    }
+}
+
+void flash_slave::select()
+{
+    frame_.clear();
+    frame_busy_ = busy_ > 0;
+}
+
+void flash_slave::deselect()
+{
+    if (frame_.empty() || frame_[0] == 0x05) {
+        return;
+    }
+    if (frame_busy_) {
+        ++ignored;
+        return;
+    }
+
+    uint8_t op = frame_[0];
+    switch (op) {
+    case 0x06:
+        write_enabled_ = true;
+        return;
+
+    case 0x04:
+        write_enabled_ = false;
+        return;
+
+    case 0x02:
+    case 0x20:
+    case 0xd8:
+        if (!write_enabled_ || frame_.size() < 4) {
+            ++ignored;
+            return;
+        }
+        break;
+
+    default:
+        return;
+    }
+
+    uint32_t addr = address() % memory.size();
+    if (op == 0x02) {
+        /* Data past the end of the page wraps round to its start. */
+        uint32_t page = addr & ~uint32_t(0xff);
+        for (size_t i = 4; i < frame_.size(); ++i) {
+            memory[page | ((addr + i - 4) & 0xff)] &= frame_[i];
+        }
+        busy_ = program_bytes;
+    } else {
+        size_t size = op == 0x20 ? 0x1000 : 0x10000;
+        addr &= ~uint32_t(size - 1);
+        size = std::min(size, memory.size() - addr);
+        std::fill_n(memory.begin() + addr, size, 0xff);
+        busy_ = erase_bytes;
+    }
+    write_enabled_ = false;
+}
+
+uint8_t flash_slave::exchange(uint8_t mosi)
+{
+    frame_.push_back(mosi);
+    size_t pos = frame_.size() - 1;
+
+    uint8_t result = 0xff;
+    if (pos > 0 && frame_[0] == 0x05) {
+        result = status();
+    } else if (!frame_busy_) {
+        switch (frame_[0]) {
+        case 0x9f:
+            if (pos >= 1 && pos <= 3) {
+                result = id[pos - 1];
+            }
+            break;
+        case 0x03:
+            if (pos >= 4) {
+                result = memory[(address() + pos - 4) % memory.size()];
+            }
+            break;
+        case 0x0b:
+            if (pos >= 5) {
+                result = memory[(address() + pos - 5) % memory.size()];
+            }
+            break;
+        }
+    }
+
+    if (busy_ > 0) {
+        --busy_;
+    }
+    return result;
+}
+
+void flash_slave::idle(uint64_t cycles)
+{
+    idle_cycles_ += cycles;
+    uint64_t bytes = std::min<uint64_t>(idle_cycles_ / 8, busy_);
+    busy_ -= size_t(bytes);
+    idle_cycles_ %= 8;
+}
+
+uint8_t flash_slave::status() const
+{
+    return (busy_ > 0 ? 0x01 : 0) | (write_enabled_ ? 0x02 : 0);
+}
+
+uint32_t flash_slave::address() const
+{
+    return (frame_[1] << 16) | (frame_[2] << 8) | frame_[3];
+}
+
+panel_slave::panel_slave(
+    uint16_t width, uint16_t height, size_t bytes_per_pixel, uint8_t dc_pin) :
+        memory(size_t(width) * height * bytes_per_pixel),
+        width_(width),
+        height_(height),
+        bytes_per_pixel_(bytes_per_pixel),
+        dc_pin_(dc_pin),
+        x1_(width - 1),
+        y1_(height - 1)
+{
+}
+
+void panel_slave::pinsChanged(uint8_t low, uint8_t /* high */)
+{
+    data_ = low & dc_pin_;
+}
+
+uint8_t panel_slave::exchange(uint8_t mosi)
+{
+    if (!data_) {
+        ++commands;
+        command_ = mosi;
+        param_count_ = 0;
+        if (command_ == 0x2c) {
+            x_ = x0_;
+            y_ = y0_;
+            byte_ = 0;
+        }
+    } else {
+        parameter(mosi);
+    }
+    return 0xff;
+}
+
+void panel_slave::parameter(uint8_t value)
+{
+    switch (command_) {
+    case 0x2a:
+    case 0x2b:
+        if (param_count_ < 4) {
+            params_[param_count_++] = value;
+        }
+        if (param_count_ == 4) {
+            uint16_t start = (params_[0] << 8) | params_[1];
+            uint16_t end = (params_[2] << 8) | params_[3];
+            (command_ == 0x2a ? x0_ : y0_) = start;
+            (command_ == 0x2a ? x1_ : y1_) = end;
+        }
+        break;
+
+    case 0x2c:
+        if (y_ > y1_ || x_ >= width_ || y_ >= height_) {
+            break;
+        }
+        memory[(size_t(y_) * width_ + x_) * bytes_per_pixel_ + byte_] = value;
+        ++pixel_bytes;
+        if (++byte_ == bytes_per_pixel_) {
+            byte_ = 0;
+            if (x_++ == x1_) {
+                x_ = x0_;
+                ++y_;
+            }
+        }
+        break;
+    }
+}
+
+} /* namespace ft2232h_spi */
@@ -0,0 +1,258 @@
+/* mpsse-emulator.h
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef FT2232H_SPI_MPSSE_EMULATOR_H
+#define FT2232H_SPI_MPSSE_EMULATOR_H
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "ft2232h-spi/transport.h"
+
+namespace ft2232h_spi
+{
+
+/*
+ * An in-process stand-in for one FT2232H channel in MPSSE mode. It parses
+ * the command stream, tracks the pin, clock and loopback state, answers
+ * unknown opcodes the way the chip does and clocks data through whichever
+ * simulated slaves have their chip select asserted.
+ *
+ * Data is exchanged a byte at a time in both byte and bit mode; TMS
+ * commands are treated as unknown opcodes. A wait-on-I/O command holds up
+ * the rest of the stream until setInputs() drives GPIOL1 (ADBUS5) to the
+ * awaited level, or reset() is called.
+ */
+class mpsse_emulator : public transport
+{
+public:
+    /* A simulated SPI device wired to one or more chip-select pins. */
+    class slave
+    {
+    public:
+        virtual ~slave();
+
+        virtual void select() { }
+        virtual void deselect() { }
+
+        /* The output levels after every set_low_bits/set_high_bits. */
+        virtual void pinsChanged(uint8_t /* low */, uint8_t /* high */) { }
+
+        /* SCK cycles clocked with no data, whether selected or not. */
+        virtual void idle(uint64_t /* cycles */) { }
+
+        /* Clock one byte: mosi arrives, the return value goes out on MISO. */
+        virtual uint8_t exchange(uint8_t mosi) = 0;
+    };
+
+    mpsse_emulator();
+    ~mpsse_emulator();
+
+    /* Attach s to the ADBUS chip-select pin(s) in cs. */
+    void attach(uint8_t cs, std::shared_ptr<slave> s);
+
+    /* Levels seen on ADBUS/ACBUS pins that are configured as inputs. */
+    void setInputs(uint8_t low, uint8_t high);
+
+    /* Whether a wait-on-I/O command is holding up the stream. */
+    bool waiting() const;
+
+    void write(const uint8_t *data, size_t size) override;
+    size_t read(uint8_t *data, size_t size) override;
+    void setLatencyTimer(uint8_t ms) override;
+    void setChunkSizes(uint32_t write_chunk, uint32_t read_chunk) override;
+    void reset() override;
+
+    uint8_t lowPins() const;
+    uint8_t lowDirection() const;
+    uint8_t highPins() const;
+    uint8_t highDirection() const;
+    bool loopback() const;
+
+    /* SCK frequency as currently programmed. */
+    uint32_t clock() const;
+
+    /* SCK cycles produced so far, with and without data. */
+    uint64_t cycles() const;
+
+    /* USB settings as last configured; they don't affect the emulation. */
+    uint8_t latencyTimer() const;
+    uint32_t writeChunkSize() const;
+    uint32_t readChunkSize() const;
+
+    /* Calls to write()/read() and bytes passed to write(). */
+    uint64_t writes() const;
+    uint64_t reads() const;
+    uint64_t bytesWritten() const;
+
+private:
+    void run();
+    size_t parse(const uint8_t *data, size_t size);
+    bool lowLevel(uint8_t pin) const;
+    void setLow(uint8_t value, uint8_t direction);
+    void shift(uint8_t op, const uint8_t *out, size_t size);
+    uint8_t shiftByte(uint8_t mosi);
+    void idle(uint64_t cycles);
+    void badOpcode(uint8_t op);
+
+    mutable std::mutex mutex_;
+
+    std::vector<uint8_t> input_;
+    std::deque<uint8_t> output_;
+    std::vector<std::pair<uint8_t, std::shared_ptr<slave>>> slaves_;
+
+    uint8_t low_ = 0;
+    uint8_t low_dir_ = 0;
+    uint8_t high_ = 0;
+    uint8_t high_dir_ = 0;
+    uint8_t low_inputs_ = 0xff;
+    uint8_t high_inputs_ = 0xff;
+    bool loopback_ = false;
+    bool waiting_ = false;
+    bool div5_ = true;
+    uint16_t divisor_ = 0;
+    uint8_t latency_ms_ = 16;
+    uint32_t write_chunk_ = 4096;
+    uint32_t read_chunk_ = 4096;
+
+    uint64_t cycles_ = 0;
+    uint64_t writes_ = 0;
+    uint64_t reads_ = 0;
+    uint64_t bytes_written_ = 0;
+};
+
+/*
+ * Records the MOSI bytes of every chip-select frame and answers with
+ * queued MISO bytes (0xff once they run out).
+ */
+class recording_slave : public mpsse_emulator::slave
+{
+public:
+    void select() override;
+    void deselect() override;
+    uint8_t exchange(uint8_t mosi) override;
+
+    std::vector<std::vector<uint8_t>> frames;
+    std::deque<uint8_t> miso;
+    bool selected = false;
+};
+
+/*
+ * A 128-byte register file. The first byte of a frame is the start
+ * address, with bit 7 set for a read; following bytes are written to, or
+ * read from, consecutive registers, wrapping at the end.
+ */
+class register_slave : public mpsse_emulator::slave
+{
+public:
+    register_slave();
+
+    void select() override;
+    uint8_t exchange(uint8_t mosi) override;
+
+    uint8_t registers[128];
+
+private:
+    bool addressed_ = false;
+    bool reading_ = false;
+    uint8_t address_ = 0;
+};
+
+/*
+ * A SPI NOR flash with 256-byte pages and 4 KiB/64 KiB erase. It answers
+ * JEDEC ID (0x9f), read (0x03), fast read (0x0b), read status (0x05,
+ * repeated for as long as the frame lasts), write enable/disable
+ * (0x06/0x04), page program (0x02) and sector/block erase (0x20/0xd8).
+ *
+ * Time is counted in bytes' worth of SCK, either clocked through the
+ * chip or idle: after a program or erase it stays busy, ignoring
+ * everything except read status, for program_bytes or erase_bytes bytes.
+ */
+class flash_slave : public mpsse_emulator::slave
+{
+public:
+    explicit flash_slave(size_t size);
+
+    void select() override;
+    void deselect() override;
+    uint8_t exchange(uint8_t mosi) override;
+    void idle(uint64_t cycles) override;
+
+    std::vector<uint8_t> memory;
+    uint8_t id[3];
+    size_t program_bytes = 64;
+    size_t erase_bytes = 64;
+
+    /* Commands dropped because the chip was busy or not write enabled. */
+    uint64_t ignored = 0;
+
+private:
+    uint8_t status() const;
+    uint32_t address() const;
+
+    std::vector<uint8_t> frame_;
+    bool frame_busy_ = false;
+    size_t busy_ = 0;
+    uint64_t idle_cycles_ = 0;
+    bool write_enabled_ = false;
+};
+
+/*
+ * A display controller with the MIPI DCS column/row address set (0x2a,
+ * 0x2b) and memory write (0x2c) commands. Bytes sent with the dc pin low
+ * are commands, anything else is parameters or pixel data, written into
+ * memory row by row within the current window.
+ */
+class panel_slave : public mpsse_emulator::slave
+{
+public:
+    panel_slave(
+        uint16_t width, uint16_t height, size_t bytes_per_pixel,
+        uint8_t dc_pin);
+
+    void pinsChanged(uint8_t low, uint8_t high) override;
+    uint8_t exchange(uint8_t mosi) override;
+
+    std::vector<uint8_t> memory;
+
+    /* Commands seen and pixel bytes written so far. */
+    uint64_t commands = 0;
+    uint64_t pixel_bytes = 0;
+
+private:
+    void parameter(uint8_t value);
+
+    uint16_t width_;
+    uint16_t height_;
+    size_t bytes_per_pixel_;
+    uint8_t dc_pin_;
+    bool data_ = false;
+
+    uint8_t command_ = 0;
+    uint8_t params_[4];
+    size_t param_count_ = 0;
+
+    uint16_t x0_ = 0, x1_ = 0, y0_ = 0, y1_ = 0;
+    uint16_t x_ = 0, y_ = 0;
+    size_t byte_ = 0;
+};
+
+} /* namespace ft2232h_spi */
+
+#endif /* FT2232H_SPI_MPSSE_EMULATOR_H */
@@ -0,0 +1,201 @@
+/* mpsse.h
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef FT2232H_SPI_MPSSE_H
+#define FT2232H_SPI_MPSSE_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "ft2232h-spi/packet.h"
+
+namespace ft2232h_spi
+{
+
+/* The subset of MPSSE commands the library speaks. */
+enum class opcodes : uint8_t {
+    write                = 0x10,
+    read                 = 0x24,
+    read_write           = 0x34,
+    set_low_bits         = 0x80,
+    get_low_bits         = 0x81,
+    set_high_bits        = 0x82,
+    get_high_bits        = 0x83,
+    loopback_enable      = 0x84,
+    loopback_disable     = 0x85,
+    set_clkdiv           = 0x86,
+    send_immediate       = 0x87,
+    wait_on_high         = 0x88,
+    wait_on_low          = 0x89,
+    clkdiv_5_disable     = 0x8a,
+    clkdiv_5_enable      = 0x8b,
+    three_phase_enable   = 0x8c,
+    three_phase_disable  = 0x8d,
+    clock_bits           = 0x8e,
+    clock_bytes          = 0x8f,
+    adaptive_clk_enable  = 0x96,
+    adaptive_clk_disable = 0x97,
+    bogus                = 0xab
+};
+
+/* The MPSSE answers an opcode it doesn't know with this, then the opcode. */
+constexpr uint8_t bad_opcode_reply = 0xfa;
+
+/* ADBUS0-2 are SCK, MOSI and MISO in serial mode, never chip selects. */
+constexpr uint8_t serial_pins = 0x07;
+
+/*
+ * SCK = base / (2 * (divisor + 1)), where base is 60 MHz, or 12 MHz with
+ * the divide-by-5 prescaler enabled.
+ */
+constexpr uint32_t base_clock_hz = 60000000;
+constexpr uint32_t base_clock_div5_hz = base_clock_hz / 5;
+
+/* The 16-bit divisor bottoms out at 91.55 Hz; the first whole Hz above. */
+constexpr uint32_t min_clock_hz = (base_clock_div5_hz + 2 * 0x10000 - 1) /
+    (2 * 0x10000);
+
+/*
+ * Builders for each command. Their arguments are usually constants, in
+ * which case the result is too and can be spliced together with + into a
+ * fixed command sequence at compile time.
+ */
+namespace commands
+{
+
+/* A data command header; the MPSSE encodes the length as length - 1. */
+constexpr static_packet<3> data(opcodes op, size_t length)
+{
+    return { op, uint8_t(length - 1), uint8_t((length - 1) >> 8) };
+}
+
+constexpr static_packet<3> write(size_t length)
+{
+    return data(opcodes::write, length);
+}
+
+constexpr static_packet<3> read(size_t length)
+{
+    return data(opcodes::read, length);
+}
+
+constexpr static_packet<3> readWrite(size_t length)
+{
+    return data(opcodes::read_write, length);
+}
+
+constexpr static_packet<3> setLowBits(uint8_t value, uint8_t direction)
+{
+    return { opcodes::set_low_bits, value, direction };
+}
+
+constexpr static_packet<1> getLowBits()
+{
+    return { opcodes::get_low_bits };
+}
+
+constexpr static_packet<3> setHighBits(uint8_t value, uint8_t direction)
+{
+    return { opcodes::set_high_bits, value, direction };
+}
+
+constexpr static_packet<1> getHighBits()
+{
+    return { opcodes::get_high_bits };
+}
+
+constexpr static_packet<1> loopbackEnable()
+{
+    return { opcodes::loopback_enable };
+}
+
+constexpr static_packet<1> loopbackDisable()
+{
+    return { opcodes::loopback_disable };
+}
+
+constexpr static_packet<3> setClkdiv(uint16_t divisor)
+{
+    return { opcodes::set_clkdiv, uint8_t(divisor), uint8_t(divisor >> 8) };
+}
+
+constexpr static_packet<1> sendImmediate()
+{
+    return { opcodes::send_immediate };
+}
+
+/* Hold off every later command until GPIOL1 (ADBUS5) is high/low. */
+constexpr static_packet<1> waitOnHigh()
+{
+    return { opcodes::wait_on_high };
+}
+
+constexpr static_packet<1> waitOnLow()
+{
+    return { opcodes::wait_on_low };
+}
+
+constexpr static_packet<1> clkdiv5Disable()
+{
+    return { opcodes::clkdiv_5_disable };
+}
+
+constexpr static_packet<1> clkdiv5Enable()
+{
+    return { opcodes::clkdiv_5_enable };
+}
+
+constexpr static_packet<1> threePhaseEnable()
+{
+    return { opcodes::three_phase_enable };
+}
+
+constexpr static_packet<1> threePhaseDisable()
+{
+    return { opcodes::three_phase_disable };
+}
+
+/* Pulse SCK without moving any data, length bits (1-8) or bytes. */
+constexpr static_packet<2> clockBits(size_t length)
+{
+    return { opcodes::clock_bits, uint8_t(length - 1) };
+}
+
+constexpr static_packet<3> clockBytes(size_t length)
+{
+    return data(opcodes::clock_bytes, length);
+}
+
+constexpr static_packet<1> adaptiveClkEnable()
+{
+    return { opcodes::adaptive_clk_enable };
+}
+
+constexpr static_packet<1> adaptiveClkDisable()
+{
+    return { opcodes::adaptive_clk_disable };
+}
+
+constexpr static_packet<1> bogus()
+{
+    return { opcodes::bogus };
+}
+
+} /* namespace commands */
+
+} /* namespace ft2232h_spi */
+
+#endif /* FT2232H_SPI_MPSSE_H */
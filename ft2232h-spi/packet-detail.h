@@ -46,6 +46,14 @@ size_t pack_impl(uint8_t *buffer, T&& arg, Args&&... args)
     );
 }
 
+template<size_t N, size_t M, size_t... I, size_t... J>
+constexpr static_packet<N + M> concat(
+    const static_packet<N>& a, const static_packet<M>& b,
+    std::index_sequence<I...>, std::index_sequence<J...>)
+{
+    return static_packet<N + M> { a[I]..., b[J]... };
+}
+
 } /* namespace detail */
 
 template<class... Args>
@@ -58,4 +66,24 @@ packet::packet(Args&&... args) :
 {
 }
 
+template<size_t N>
+template<class... Bytes>
+constexpr static_packet<N>::static_packet(Bytes... bytes) :
+    data_ { uint8_t(bytes)... }
+{
+    static_assert(
+        sizeof...(Bytes) == N,
+        "static_packet must be initialised with exactly N bytes."
+    );
+}
+
+template<size_t N, size_t M>
+constexpr static_packet<N + M> operator+(
+    const static_packet<N>& a, const static_packet<M>& b)
+{
+    return detail::concat(
+        a, b, std::make_index_sequence<N>(), std::make_index_sequence<M>()
+    );
+}
+
 } /* namespace ft2232h_spi */
@@ -19,6 +19,8 @@
 
 #include "exceptions.h"
 
+constexpr size_t ft2232h_spi::packet::capacity;
+
 void ft2232h_spi::packet::append(const packet& p)
 {
     if (p.size_ + size_ > sizeof(data_)) {
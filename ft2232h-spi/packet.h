@@ -26,6 +26,8 @@ namespace ft2232h_spi
 class packet
 {
 public:
+    static constexpr size_t capacity = 16;
+
     template<class... Args>
     packet(Args&&... args);
 
@@ -35,10 +37,35 @@ public:
     size_t size() const { return size_; }
 
 private:
-    uint8_t data_[16];
+    uint8_t data_[capacity];
     uint8_t size_ = 0;
 };
 
+/*
+ * A fixed sequence of exactly N bytes. Unlike packet, the length is part
+ * of the type, so concatenating two of them with + can't overflow and
+ * sequences built from constants are themselves compile-time constants.
+ */
+template<size_t N>
+class static_packet
+{
+public:
+    template<class... Bytes>
+    constexpr static_packet(Bytes... bytes);
+
+    constexpr uint8_t operator[](size_t i) const { return data_[i]; }
+
+    const uint8_t *data() const { return data_; }
+    static constexpr size_t size() { return N; }
+
+private:
+    uint8_t data_[N ? N : 1];
+};
+
+template<size_t N, size_t M>
+constexpr static_packet<N + M> operator+(
+    const static_packet<N>& a, const static_packet<M>& b);
+
 } /* namespace ft2232h_spi */
 
 #define FT2232H_SPI_INCLUDE_PACKET_DETAIL_H
@@ -0,0 +1,185 @@
+/* spi-bus.cpp
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "spi-bus.h"
+
+#include "transport.h"
+
+namespace ft2232h_spi {
+
+void spi_bus::device::transmit(const uint8_t *data, size_t size)
+{
+    spi::batch b;
+    b.transmit(data, size);
+    submit(std::move(b)).get();
+}
+
+void spi_bus::device::transfer(const uint8_t *tx, uint8_t *rx, size_t size)
+{
+    spi::batch b;
+    b.transfer(tx, rx, size);
+    submit(std::move(b)).get();
+}
+
+void spi_bus::device::receive(uint8_t *rx, size_t size)
+{
+    spi::batch b;
+    b.receive(rx, size);
+    submit(std::move(b)).get();
+}
+
+void spi_bus::device::execute(const spi::batch& b)
+{
+    submit(b).get();
+}
+
+std::future<void> spi_bus::device::submit(spi::batch b)
+{
+    return bus_->post({ cs_, clock_hz_, std::move(b), nullptr, {} });
+}
+
+/* The channel is opened without a default chip select; devices bring their own. */
+spi_bus::spi_bus(const endpoint& ep, spi::busses bus) :
+    spi_ { spi::pins(0), ep, bus }
+{
+    thread_ = std::thread { [this]() { run(); } };
+}
+
+spi_bus::spi_bus(std::unique_ptr<transport> io) :
+    spi_ { spi::pins(0), std::move(io) }
+{
+    thread_ = std::thread { [this]() { run(); } };
+}
+
+spi_bus::~spi_bus()
+{
+    {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        stopping_ = true;
+    }
+    work_.notify_all();
+    thread_.join();
+}
+
+spi_bus::device spi_bus::attach(spi::pins cs, uint32_t clock_hz)
+{
+    post({ cs, clock_hz, {}, [cs](spi& s) { s.addChipSelect(cs); }, {} }).get();
+    return device { this, cs, clock_hz };
+}
+
+uint64_t spi_bus::executions() const
+{
+    std::lock_guard<std::mutex> lock { mutex_ };
+    return executions_;
+}
+
+std::future<void> spi_bus::post(request r)
+{
+    auto result = r.done.get_future();
+    {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        pending_.push_back(std::move(r));
+    }
+    work_.notify_one();
+    return result;
+}
+
+void spi_bus::run()
+{
+    std::deque<request> taken;
+    std::vector<request*> merged;
+    spi::batch combined;
+
+    /* Send whatever has been merged so far and report back to its owners. */
+    auto flush = [&]() {
+        if (merged.empty()) {
+            return;
+        }
+
+        std::exception_ptr failure;
+        try {
+            spi_.execute(combined);
+        } catch (...) {
+            failure = std::current_exception();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock { mutex_ };
+            ++executions_;
+        }
+        for (auto r : merged) {
+            if (failure) {
+                r->done.set_exception(failure);
+            } else {
+                r->done.set_value();
+            }
+        }
+        merged.clear();
+        combined.clear();
+    };
+
+    std::unique_lock<std::mutex> lock { mutex_ };
+    for (;;) {
+        work_.wait(lock, [this]() { return stopping_ || !pending_.empty(); });
+        if (pending_.empty()) {
+            return;
+        }
+        taken.swap(pending_);
+        lock.unlock();
+
+        for (auto& r : taken) {
+            if (r.setup) {
+                flush();
+                try {
+                    r.setup(spi_);
+                    r.done.set_value();
+                } catch (...) {
+                    r.done.set_exception(std::current_exception());
+                }
+                continue;
+            }
+
+            /* Checked on its own, so a bad batch only fails itself. */
+            spi::batch single;
+            try {
+                single.setClock(r.clock_hz);
+                single.append(r.b, r.cs);
+                spi_.check(single);
+            } catch (...) {
+                r.done.set_exception(std::current_exception());
+                continue;
+            }
+
+            /* A wait timing out fails its whole write, so it goes alone. */
+            bool alone = single.waits() > 0;
+            if (alone) {
+                flush();
+            }
+            combined.append(single);
+            merged.push_back(&r);
+            if (alone) {
+                flush();
+            }
+        }
+        flush();
+        taken.clear();
+
+        lock.lock();
+    }
+}
+
+} /* namespace ft2232h_spi */
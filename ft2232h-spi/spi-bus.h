@@ -0,0 +1,114 @@
+/* spi-bus.h
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef FT2232H_SPI_SPI_BUS_H
+#define FT2232H_SPI_SPI_BUS_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+
+#include "ft2232h-spi/ft2232h-spi.h"
+
+namespace ft2232h_spi
+{
+
+/*
+ * Owns one MPSSE channel and shares it between several devices, each on
+ * its own chip select. Transactions from any number of threads go into a
+ * single queue; whatever has accumulated by the time the bus is free is
+ * merged into one batch and sent with one USB write.
+ *
+ * Each request is checked before it's merged, so a batch the device
+ * can't take only fails its own request. A batch with wait-on-GPIO steps
+ * is sent on its own, because a timeout fails everything in its write.
+ */
+class spi_bus
+{
+public:
+    /* A lightweight handle for one device on the bus. Cheap to copy. */
+    class device
+    {
+    public:
+        void transmit(const uint8_t *data, size_t size);
+        void transfer(const uint8_t *tx, uint8_t *rx, size_t size);
+        void receive(uint8_t *rx, size_t size);
+
+        /* Frames in b that use the default chip select address this device. */
+        void execute(const spi::batch& b);
+        std::future<void> submit(spi::batch b);
+
+        spi::pins chipSelect() const { return cs_; }
+        uint32_t clock() const { return clock_hz_; }
+
+    private:
+        friend class spi_bus;
+        device(spi_bus *bus, spi::pins cs, uint32_t clock_hz) :
+            bus_(bus),
+            cs_(cs),
+            clock_hz_(clock_hz)
+        { }
+
+        spi_bus *bus_;
+        spi::pins cs_;
+        uint32_t clock_hz_;
+    };
+
+    spi_bus(const endpoint& ep, spi::busses bus = spi::bus_a);
+    spi_bus(std::unique_ptr<transport> io);
+    ~spi_bus();
+
+    spi_bus(const spi_bus&) = delete;
+    spi_bus& operator=(const spi_bus&) = delete;
+
+    /*
+     * Register a device on chip select cs, clocked at clock_hz. The pin
+     * is driven high straight away.
+     */
+    device attach(spi::pins cs, uint32_t clock_hz = spi::default_clock_hz);
+
+    /* Number of merged batches sent to the device so far. */
+    uint64_t executions() const;
+
+private:
+    struct request
+    {
+        spi::pins cs;
+        uint32_t clock_hz;
+        spi::batch b;
+        std::function<void(spi&)> setup;
+        std::promise<void> done;
+    };
+
+    std::future<void> post(request r);
+    void run();
+
+    spi spi_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable work_;
+    std::deque<request> pending_;
+    bool stopping_ = false;
+    uint64_t executions_ = 0;
+    std::thread thread_;
+};
+
+} /* namespace ft2232h_spi */
+
+#endif /* FT2232H_SPI_SPI_BUS_H */
@@ -0,0 +1,271 @@
+/* spi-display.cpp
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "spi-display.h"
+
+#include <algorithm>
+#include <cstring>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "packet.h"
+
+namespace ft2232h_spi {
+
+namespace {
+
+constexpr uint8_t cmd_column_address_set = 0x2a;
+constexpr uint8_t cmd_row_address_set = 0x2b;
+constexpr uint8_t cmd_memory_write = 0x2c;
+
+/*
+ * Roughly what opening another window costs on the wire: three commands
+ * with their D/C toggles plus eight parameter bytes. Unchanged pixels
+ * between two dirty areas are resent rather than paying this.
+ */
+constexpr size_t window_cost = 48;
+
+/* Past this many rectangles, or this much of the screen, send it all. */
+constexpr size_t max_rects = 16;
+constexpr size_t full_refresh_percent = 75;
+
+/*
+ * Rows are compared 16 bytes at a time with SSE2 or NEON where the target
+ * has them, and two words at a time otherwise, then a byte at a time
+ * within the block that differs.
+ */
+constexpr size_t compare_block = 16;
+
+bool sameBlock(const uint8_t *a, const uint8_t *b)
+{
+#if defined(__SSE2__)
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a));
+    __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) == 0xffff;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    return vminvq_u8(vceqq_u8(vld1q_u8(a), vld1q_u8(b))) == 0xff;
+#else
+    uint64_t x[2], y[2];
+    memcpy(x, a, sizeof(x));
+    memcpy(y, b, sizeof(y));
+    return x[0] == y[0] && x[1] == y[1];
+#endif
+}
+
+/* Offsets of the first differing byte, and one past the last. */
+size_t firstDifference(const uint8_t *a, const uint8_t *b, size_t size)
+{
+    size_t i = 0;
+    while (i + compare_block <= size && sameBlock(a + i, b + i)) {
+        i += compare_block;
+    }
+    while (i < size && a[i] == b[i]) {
+        ++i;
+    }
+    return i;
+}
+
+size_t endOfDifference(const uint8_t *a, const uint8_t *b, size_t size)
+{
+    size_t i = size;
+    while (i >= compare_block &&
+        sameBlock(a + i - compare_block, b + i - compare_block))
+    {
+        i -= compare_block;
+    }
+    while (i > 0 && a[i - 1] == b[i - 1]) {
+        --i;
+    }
+    return i;
+}
+
+packet window(uint16_t start, uint16_t end)
+{
+    return packet {
+        uint8_t(start >> 8), uint8_t(start), uint8_t(end >> 8), uint8_t(end)
+    };
+}
+
+}
+
+spi_display::spi_display(
+    spi& dev, uint16_t dc, uint16_t width, uint16_t height,
+    size_t bytes_per_pixel) :
+        dev_(dev),
+        dc_(dc),
+        width_(width),
+        height_(height),
+        bytes_per_pixel_(bytes_per_pixel),
+        stride_(size_t(width) * bytes_per_pixel),
+        shadow_(stride_ * height)
+{
+    if (!dc || (dc & (dc - 1))) {
+        throw error(WHEN("D/C must be a single GPIO pin."));
+    }
+    if (!width || !height || !bytes_per_pixel) {
+        throw error(WHEN("display can't have an empty frame."));
+    }
+}
+
+void spi_display::command(uint8_t cmd, const uint8_t *params, size_t size)
+{
+    spi::batch b;
+    b.select();
+    queueCommand(b, cmd);
+    if (size > 0) {
+        b.write(params, size);
+    }
+    b.deselect();
+    dev_.execute(b);
+}
+
+spi_display::push_result spi_display::push(const uint8_t *frame)
+{
+    diff(frame);
+
+    push_result result { dirty_.size(), 0, false };
+    if (dirty_.empty()) {
+        return result;
+    }
+
+    /* All the windows go in one frame; D/C tells commands from data. */
+    batch_.clear();
+    batch_.select();
+    for (auto& r : dirty_) {
+        queueRect(batch_, r, frame);
+        result.pixels += size_t(r.width) * r.height;
+    }
+    batch_.deselect();
+    dev_.execute(batch_);
+
+    for (auto& r : dirty_) {
+        for (uint16_t y = r.y; y < r.y + r.height; ++y) {
+            size_t offset = y * stride_ + r.x * bytes_per_pixel_;
+            size_t size = r.width * bytes_per_pixel_;
+            memcpy(&shadow_[offset], frame + offset, size);
+        }
+    }
+    valid_ = true;
+
+    result.full = result.pixels == size_t(width_) * height_;
+    return result;
+}
+
+/*
+ * Fill dirty_ with the rectangles covering every changed pixel. Each row
+ * that differs contributes its span from first to last changed pixel;
+ * consecutive spans become one rectangle while widening it, and sending
+ * any unchanged rows between, costs less than a new window.
+ */
+void spi_display::diff(const uint8_t *frame)
+{
+    dirty_.clear();
+    rect whole { 0, 0, width_, height_ };
+    if (!valid_) {
+        dirty_.push_back(whole);
+        return;
+    }
+
+    bool open = false;
+    size_t x0 = 0, x1 = 0, y0 = 0, y1 = 0;
+    size_t area = 0;
+    auto close = [&]() {
+        dirty_.push_back({
+            uint16_t(x0), uint16_t(y0), uint16_t(x1 - x0), uint16_t(y1 - y0)
+        });
+        area += (x1 - x0) * (y1 - y0);
+    };
+
+    for (size_t y = 0; y < height_; ++y) {
+        const uint8_t *now = frame + y * stride_;
+        const uint8_t *was = &shadow_[y * stride_];
+
+        /*
+         * An unchanged row is read once. In a changed one the search for
+         * the end stops at the first difference, so nothing is read twice.
+         */
+        size_t from = firstDifference(now, was, stride_);
+        if (from == stride_) {
+            continue;
+        }
+        size_t to = from +
+            endOfDifference(now + from, was + from, stride_ - from);
+
+        size_t bpp = bytes_per_pixel_;
+        size_t first = from / bpp;
+        size_t end = (to + bpp - 1) / bpp;
+
+        if (open) {
+            size_t left = std::min(x0, first);
+            size_t right = std::max(x1, end);
+            size_t extra = (y - y1) * (right - left) +
+                (y1 - y0) * ((right - left) - (x1 - x0));
+            if (extra * bytes_per_pixel_ <= window_cost) {
+                x0 = left;
+                x1 = right;
+                y1 = y + 1;
+                continue;
+            }
+            close();
+        }
+
+        open = true;
+        x0 = first;
+        x1 = end;
+        y0 = y;
+        y1 = y + 1;
+    }
+    if (open) {
+        close();
+    }
+
+    size_t screen = size_t(width_) * height_;
+    if (dirty_.size() > max_rects ||
+        area * 100 >= screen * full_refresh_percent)
+    {
+        dirty_.assign(1, whole);
+    }
+}
+
+void spi_display::queueCommand(spi::batch& b, uint8_t cmd)
+{
+    b.gpioClear(dc_).write(packet { cmd }).gpioSet(dc_);
+}
+
+void spi_display::queueRect(spi::batch& b, const rect& r, const uint8_t *frame)
+{
+    queueCommand(b, cmd_column_address_set);
+    b.write(window(r.x, r.x + r.width - 1));
+    queueCommand(b, cmd_row_address_set);
+    b.write(window(r.y, r.y + r.height - 1));
+    queueCommand(b, cmd_memory_write);
+
+    /* Full-width rows are contiguous, so they go out as one write. */
+    if (r.width == width_) {
+        b.write(frame + r.y * stride_, r.height * stride_);
+        return;
+    }
+    size_t row = r.width * bytes_per_pixel_;
+    for (size_t y = r.y; y < size_t(r.y) + r.height; ++y) {
+        b.write(frame + y * stride_ + r.x * bytes_per_pixel_, row);
+    }
+}
+
+} /* namespace ft2232h_spi */
@@ -0,0 +1,105 @@
+/* spi-display.h
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef FT2232H_SPI_SPI_DISPLAY_H
+#define FT2232H_SPI_SPI_DISPLAY_H
+
+#include <vector>
+
+#include "ft2232h-spi/ft2232h-spi.h"
+
+namespace ft2232h_spi
+{
+
+/*
+ * Streams frames to a SPI LCD/OLED controller that speaks the MIPI DCS
+ * window commands (column/row address set and memory write), with its
+ * D/C line on a GPIO.
+ *
+ * A shadow copy of the last frame sent is kept, and each new frame is
+ * diffed against it row by row. Changed rows are grouped into dirty
+ * rectangles, and each rectangle goes out as its window commands
+ * followed by its pixel rows. When the rectangles would cover most of
+ * the screen, the whole frame is sent instead. Either way one push() is
+ * one batch, so one USB write for anything up to 64 KiB.
+ */
+class spi_display
+{
+public:
+    struct rect
+    {
+        uint16_t x;
+        uint16_t y;
+        uint16_t width;
+        uint16_t height;
+    };
+
+    /* What a push() sent. */
+    struct push_result
+    {
+        size_t rects;
+        size_t pixels;
+        bool full;
+    };
+
+    /*
+     * dev must outlive the spi_display. dc is the spi::gpios pin wired
+     * to the controller's D/C input. Frames are width * height pixels of
+     * bytes_per_pixel bytes each, row by row, in the controller's format.
+     */
+    spi_display(
+        spi& dev, uint16_t dc, uint16_t width, uint16_t height,
+        size_t bytes_per_pixel = 2);
+
+    spi_display(const spi_display&) = delete;
+    spi_display& operator=(const spi_display&) = delete;
+
+    /* Send a command byte and its parameters, e.g. during panel setup. */
+    void command(uint8_t cmd, const uint8_t *params = nullptr, size_t size = 0);
+
+    /* Send whatever differs between frame and the last frame pushed. */
+    push_result push(const uint8_t *frame);
+
+    /* Forget the shadow frame so that the next push() sends everything. */
+    void invalidate() { valid_ = false; }
+
+    /* The rectangles the last push() sent. */
+    const std::vector<rect>& dirty() const { return dirty_; }
+
+    uint16_t width() const { return width_; }
+    uint16_t height() const { return height_; }
+
+private:
+    void diff(const uint8_t *frame);
+    void queueCommand(spi::batch& b, uint8_t cmd);
+    void queueRect(spi::batch& b, const rect& r, const uint8_t *frame);
+
+    spi& dev_;
+    uint16_t dc_;
+    uint16_t width_;
+    uint16_t height_;
+    size_t bytes_per_pixel_;
+    size_t stride_;
+
+    std::vector<uint8_t> shadow_;
+    bool valid_ = false;
+    std::vector<rect> dirty_;
+    spi::batch batch_;
+};
+
+} /* namespace ft2232h_spi */
+
+#endif /* FT2232H_SPI_SPI_DISPLAY_H */
@@ -0,0 +1,310 @@
+/* spi-flash.cpp
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "spi-flash.h"
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <thread>
+
+#include "packet.h"
+#include "util.h"
+
+namespace ft2232h_spi {
+
+namespace {
+
+constexpr uint8_t cmd_page_program = 0x02;
+constexpr uint8_t cmd_read_status = 0x05;
+constexpr uint8_t cmd_write_enable = 0x06;
+constexpr uint8_t cmd_fast_read = 0x0b;
+constexpr uint8_t cmd_sector_erase = 0x20;
+constexpr uint8_t cmd_jedec_id = 0x9f;
+constexpr uint8_t cmd_block_erase = 0xd8;
+
+constexpr uint8_t status_busy = 0x01;
+
+/* Typical for 25-series parts, most of which quote 0.4-0.8 ms. */
+constexpr auto default_program_time = std::chrono::microseconds(800);
+constexpr auto max_program_time = std::chrono::microseconds(10000);
+
+/*
+ * Pages per executeAsync() call and how many calls may be outstanding:
+ * enough that the next batch is queued up behind the one programming.
+ */
+constexpr size_t pages_per_batch = 64;
+constexpr size_t batches_in_flight = 2;
+
+/* Worst cases from common datasheets, with some margin. */
+constexpr auto program_timeout = std::chrono::milliseconds(50);
+constexpr auto erase_timeout = std::chrono::milliseconds(5000);
+constexpr auto poll_interval = std::chrono::microseconds(100);
+
+constexpr size_t verify_chunk = 0x10000;
+
+constexpr size_t all_confirmed = size_t(-1);
+
+typedef std::chrono::steady_clock steady_clock;
+
+packet addressed(uint8_t op, uint32_t address)
+{
+    return packet {
+        op, uint8_t(address >> 16), uint8_t(address >> 8), uint8_t(address)
+    };
+}
+
+double secondsSince(steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(steady_clock::now() - start).count();
+}
+
+}
+
+constexpr size_t spi_flash::page_size;
+constexpr size_t spi_flash::sector_size;
+constexpr size_t spi_flash::block_size;
+constexpr size_t spi_flash::max_size;
+
+/* One executeAsync() call's worth of pages. */
+struct spi_flash::in_flight
+{
+    std::future<void> done;
+
+    /* Payload offset of each page, then of the end of the last one. */
+    std::vector<size_t> pages;
+
+    /* Filled in with the status byte read at the end of each page. */
+    std::vector<uint8_t> status;
+};
+
+spi_flash::spi_flash(spi& dev) :
+    dev_(dev),
+    program_time_(default_program_time)
+{
+}
+
+spi_flash::jedec_id spi_flash::probe()
+{
+    uint8_t tx[4] = { cmd_jedec_id, 0, 0, 0 };
+    uint8_t rx[4];
+    dev_.transfer(tx, rx, sizeof(tx));
+
+    jedec_id result { rx[1], rx[2], rx[3] };
+    if ((rx[1] == 0x00 || rx[1] == 0xff) && rx[2] == rx[1] && rx[3] == rx[1]) {
+        throw error(WHEN("no flash chip answered the JEDEC ID command."));
+    }
+    return result;
+}
+
+throughput spi_flash::erase(uint32_t address, size_t size)
+{
+    checkRange(address, size);
+    if (address % sector_size || size % sector_size) {
+        throw error(WHEN("erase range must be sector aligned."));
+    }
+
+    auto start = steady_clock::now();
+    throughput result { size, 0 };
+    while (size > 0) {
+        bool block = address % block_size == 0 && size >= block_size;
+        size_t erased = block ? block_size : sector_size;
+        uint8_t op = block ? cmd_block_erase : cmd_sector_erase;
+
+        spi::batch b;
+        b.transmit(packet { cmd_write_enable }).transmit(addressed(op, address));
+        dev_.execute(b);
+        waitReady(erase_timeout);
+
+        address += erased;
+        size -= erased;
+    }
+
+    result.seconds = secondsSince(start);
+    return result;
+}
+
+throughput spi_flash::program(
+    uint32_t address, const uint8_t *data, size_t size)
+{
+    checkRange(address, size);
+
+    auto start = steady_clock::now();
+    size_t offset = 0;
+    while (offset < size) {
+        offset = programFrom(address, data, size, offset);
+        waitReady(program_timeout);
+    }
+    return { size, secondsSince(start) };
+}
+
+throughput spi_flash::read(
+    uint32_t address, uint8_t *data, size_t size)
+{
+    checkRange(address, size);
+    if (size == 0) {
+        return { 0, 0 };
+    }
+
+    /* Fast read takes a dummy byte after the address. */
+    packet header = addressed(cmd_fast_read, address);
+    header.append(packet { uint8_t(0) });
+
+    auto start = steady_clock::now();
+    spi::batch b;
+    b.select()
+        .write(header)
+        .read(data, size)
+        .deselect();
+    dev_.execute(b);
+    return { size, secondsSince(start) };
+}
+
+bool spi_flash::verify(uint32_t address, const uint8_t *data, size_t size)
+{
+    std::vector<uint8_t> readback(std::min(size, verify_chunk));
+    while (size > 0) {
+        size_t chunk = std::min(size, verify_chunk);
+        read(address, readback.data(), chunk);
+        if (memcmp(readback.data(), data, chunk)) {
+            return false;
+        }
+        address += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+void spi_flash::setPageProgramTime(std::chrono::microseconds t)
+{
+    if (t.count() < 0) {
+        throw error(WHEN("page program time can't be negative."));
+    }
+    program_time_ = t;
+}
+
+/*
+ * Program pages from offset onwards, returning size once every page is
+ * known to have been taken, or the offset of the first page that may
+ * have been ignored because the one before it overran.
+ */
+size_t spi_flash::programFrom(
+    uint32_t address, const uint8_t *data, size_t size, size_t offset)
+{
+    std::deque<in_flight> flights;
+
+    /* Status buffers must outlive the transfers, even if one fails. */
+    scope_guard drain { [this]() { dev_.wait(); } };
+
+    size_t restart = all_confirmed;
+    while (offset < size && restart == all_confirmed) {
+        if (flights.size() == batches_in_flight) {
+            restart = check(flights.front());
+            flights.pop_front();
+            if (restart != all_confirmed) {
+                break;
+            }
+        }
+
+        in_flight f;
+        f.status.resize(pages_per_batch);
+        spi::batch b;
+        for (size_t n = 0; n < pages_per_batch && offset < size; ++n) {
+            uint32_t at = address + offset;
+            size_t chunk = std::min(size - offset, page_size - at % page_size);
+            f.pages.push_back(offset);
+            queuePage(b, at, data + offset, chunk, &f.status[n]);
+            offset += chunk;
+        }
+        f.pages.push_back(offset);
+        f.done = dev_.executeAsync(b);
+        flights.push_back(std::move(f));
+    }
+
+    for (auto& f : flights) {
+        size_t r = check(f);
+        if (restart == all_confirmed) {
+            restart = r;
+        }
+    }
+
+    if (restart == all_confirmed) {
+        return size;
+    }
+    program_time_ = std::min(program_time_ * 2, max_program_time);
+    return restart;
+}
+
+/* Wait for f and return where to carry on from if a page overran. */
+size_t spi_flash::check(in_flight& f)
+{
+    f.done.get();
+    for (size_t n = 0; n + 1 < f.pages.size(); ++n) {
+        if (f.status[n] & status_busy) {
+            ++overruns_;
+            return f.pages[n + 1];
+        }
+    }
+    return all_confirmed;
+}
+
+/*
+ * Write enable, page program, idle clocks for as long as the program
+ * should take, then a status read.
+ */
+void spi_flash::queuePage(
+    spi::batch& b, uint32_t address, const uint8_t *data, size_t size,
+    uint8_t *status)
+{
+    b.transmit(packet { cmd_write_enable });
+    b.select()
+        .write(addressed(cmd_page_program, address))
+        .write(data, size)
+        .deselect();
+
+    if (program_time_.count() > 0) {
+        b.delay(program_time_);
+    }
+    b.select().write(packet { cmd_read_status }).read(status, 1).deselect();
+}
+
+void spi_flash::waitReady(std::chrono::milliseconds timeout)
+{
+    auto deadline = steady_clock::now() + timeout;
+    uint8_t tx[2] = { cmd_read_status, 0 };
+    uint8_t rx[2];
+    for (;;) {
+        dev_.transfer(tx, rx, sizeof(tx));
+        if (!(rx[1] & status_busy)) {
+            return;
+        }
+        if (steady_clock::now() > deadline) {
+            throw error(WHEN("flash is still busy after timeout."));
+        }
+        std::this_thread::sleep_for(poll_interval);
+    }
+}
+
+void spi_flash::checkRange(uint32_t address, size_t size) const
+{
+    if (address > max_size || size > max_size - address) {
+        throw error(WHEN("range is beyond 3-byte addressing."));
+    }
+}
+
+} /* namespace ft2232h_spi */
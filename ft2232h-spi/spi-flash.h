@@ -0,0 +1,121 @@
+/* spi-flash.h
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef FT2232H_SPI_SPI_FLASH_H
+#define FT2232H_SPI_SPI_FLASH_H
+
+#include <chrono>
+#include <limits>
+
+#include "ft2232h-spi/ft2232h-spi.h"
+
+namespace ft2232h_spi
+{
+
+/*
+ * Programs, erases and reads a SPI NOR flash with 3-byte addresses (up to
+ * 16 MiB) on a spi device, using the common 25-series command set.
+ *
+ * Page programs are not confirmed one round trip at a time. Each page's
+ * write enable, page program, an on-device delay of the page program
+ * time and a status read are encoded back to back, so the next page
+ * follows on the wire as soon as the current one should be done, and
+ * batches of pages are kept in flight with executeAsync(). The status
+ * byte read at the end of each page says whether the chip really had
+ * finished; if not, the page after it may have been ignored, so
+ * programming waits for the chip, lengthens the delay and carries on
+ * from that page.
+ */
+class spi_flash
+{
+public:
+    /* Manufacturer, memory type and capacity code, as read by 0x9f. */
+    struct jedec_id
+    {
+        uint8_t manufacturer;
+        uint8_t type;
+        uint8_t capacity;
+
+        /*
+         * Size in bytes, assuming the usual 2^capacity encoding, or 0 if
+         * capacity is too large to be one, as with a garbage ID.
+         */
+        size_t size() const
+        {
+            return capacity < std::numeric_limits<size_t>::digits ?
+                size_t(1) << capacity : 0;
+        }
+    };
+
+    static constexpr size_t page_size = 256;
+    static constexpr size_t sector_size = 0x1000;
+    static constexpr size_t block_size = 0x10000;
+    static constexpr size_t max_size = 0x1000000;
+
+    /* dev must outlive the spi_flash. */
+    explicit spi_flash(spi& dev);
+
+    spi_flash(const spi_flash&) = delete;
+    spi_flash& operator=(const spi_flash&) = delete;
+
+    /* Read the JEDEC ID, throwing if no chip seems to be answering. */
+    jedec_id probe();
+
+    /*
+     * Erase the sectors covering [address, address + size), which must
+     * be sector aligned. Aligned 64 KiB runs use block erase.
+     */
+    throughput erase(uint32_t address, size_t size);
+
+    /* Program size bytes at address, which must already be erased. */
+    throughput program(uint32_t address, const uint8_t *data, size_t size);
+
+    /* Read size bytes from address with fast read (0x0b). */
+    throughput read(uint32_t address, uint8_t *data, size_t size);
+
+    /* Read back [address, address + size) and compare it with data. */
+    bool verify(uint32_t address, const uint8_t *data, size_t size);
+
+    /*
+     * The page program time to wait for before the first status read;
+     * it's doubled whenever a page turns out to still be busy. The
+     * default suits most 25-series parts.
+     */
+    void setPageProgramTime(std::chrono::microseconds t);
+    std::chrono::microseconds pageProgramTime() const { return program_time_; }
+
+    /* Pages found still busy at their status read so far. */
+    uint64_t overruns() const { return overruns_; }
+
+private:
+    struct in_flight;
+
+    size_t programFrom(
+        uint32_t address, const uint8_t *data, size_t size, size_t offset);
+    size_t check(in_flight& f);
+    void queuePage(spi::batch& b, uint32_t address, const uint8_t *data,
+        size_t size, uint8_t *status);
+    void waitReady(std::chrono::milliseconds timeout);
+    void checkRange(uint32_t address, size_t size) const;
+
+    spi& dev_;
+    std::chrono::microseconds program_time_;
+    uint64_t overruns_ = 0;
+};
+
+} /* namespace ft2232h_spi */
+
+#endif /* FT2232H_SPI_SPI_FLASH_H */
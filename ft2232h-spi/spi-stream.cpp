@@ -0,0 +1,188 @@
+/* spi-stream.cpp
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "spi-stream.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace ft2232h_spi {
+
+constexpr size_t spi_stream::default_ring_samples;
+constexpr size_t spi_stream::default_batch_samples;
+constexpr size_t spi_stream::default_batches;
+
+spi_stream::spi_stream(
+    spi& dev, size_t sample_size, const std::vector<uint8_t>& command,
+    std::chrono::nanoseconds interval, size_t ring_samples,
+    size_t batch_samples, size_t batches) :
+        dev_(dev),
+        sample_size_(sample_size),
+        tx_(command),
+        slots_(batches),
+        ring_(ring_samples * sample_size),
+        capacity_(ring_samples)
+{
+    if (sample_size < 1 || command.size() > sample_size) {
+        throw error(WHEN("command must fit in a sample of >=1 bytes."));
+    }
+    if (batches < 2 || batch_samples < 1 || ring_samples < batch_samples) {
+        throw error(
+            WHEN("need >=2 batches of >=1 samples and room for a batch."));
+    }
+    tx_.resize(sample_size, 0);
+
+    for (auto& s : slots_) {
+        s.rx.resize(batch_samples * sample_size);
+        for (size_t i = 0; i < batch_samples; ++i) {
+            s.b.transfer(tx_.data(), &s.rx[i * sample_size], sample_size);
+            if (interval.count() > 0) {
+                s.b.delay(interval);
+            }
+        }
+    }
+}
+
+spi_stream::~spi_stream()
+{
+    try {
+        stop();
+    } catch (const std::exception&) {
+    }
+}
+
+void spi_stream::start()
+{
+    if (feeder_.joinable()) {
+        throw error(WHEN("stream is already running."));
+    }
+    stopping_ = false;
+    running_ = true;
+    failure_ = nullptr;
+    feeder_ = std::thread { [this]() { feed(); } };
+}
+
+void spi_stream::stop()
+{
+    if (!feeder_.joinable()) {
+        return;
+    }
+    stopping_ = true;
+    feeder_.join();
+
+    if (failure_) {
+        auto e = failure_;
+        failure_ = nullptr;
+        std::rethrow_exception(e);
+    }
+}
+
+size_t spi_stream::read(uint8_t *samples, size_t max_samples)
+{
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    size_t head = head_.load(std::memory_order_acquire);
+    size_t count = std::min(max_samples, head - tail);
+
+    size_t offset = tail % capacity_;
+    size_t first = std::min(count, capacity_ - offset);
+    memcpy(samples, &ring_[offset * sample_size_], first * sample_size_);
+    memcpy(
+        samples + first * sample_size_, &ring_[0],
+        (count - first) * sample_size_);
+
+    tail_.store(tail + count, std::memory_order_release);
+    return count;
+}
+
+size_t spi_stream::available() const
+{
+    return head_.load(std::memory_order_acquire) -
+        tail_.load(std::memory_order_acquire);
+}
+
+void spi_stream::feed()
+{
+    size_t next = 0;
+    try {
+        for (auto& s : slots_) {
+            s.done = dev_.executeAsync(s.b);
+        }
+
+        while (!stopping_) {
+            auto& s = slots_[next];
+            s.done.get();
+
+            /*
+             * If nothing else is still queued, the adapter has gone idle.
+             * A slot that hasn't completed has at least its commands with
+             * the adapter, as writes aren't held back behind reads.
+             */
+            bool idle = true;
+            for (auto& other : slots_) {
+                if (&other != &s &&
+                    other.done.wait_for(std::chrono::seconds(0)) !=
+                        std::future_status::ready)
+                {
+                    idle = false;
+                }
+            }
+            if (idle) {
+                gaps_.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            push(s.rx.data(), s.rx.size() / sample_size_);
+            s.done = dev_.executeAsync(s.b);
+            next = (next + 1) % slots_.size();
+        }
+
+        /* Keep whatever was already on its way. */
+        for (size_t i = 0; i < slots_.size(); ++i) {
+            auto& s = slots_[(next + i) % slots_.size()];
+            s.done.get();
+            push(s.rx.data(), s.rx.size() / sample_size_);
+        }
+    } catch (...) {
+        failure_ = std::current_exception();
+
+        /* The receive buffers must outlive any transfer still running. */
+        dev_.wait();
+    }
+    running_ = false;
+}
+
+/* Append up to samples whole samples, dropping those that don't fit. */
+void spi_stream::push(const uint8_t *data, size_t samples)
+{
+    size_t head = head_.load(std::memory_order_relaxed);
+    size_t tail = tail_.load(std::memory_order_acquire);
+    size_t count = std::min(samples, capacity_ - (head - tail));
+
+    size_t offset = head % capacity_;
+    size_t first = std::min(count, capacity_ - offset);
+    memcpy(&ring_[offset * sample_size_], data, first * sample_size_);
+    memcpy(
+        &ring_[0], data + first * sample_size_,
+        (count - first) * sample_size_);
+
+    head_.store(head + count, std::memory_order_release);
+    samples_.fetch_add(count, std::memory_order_relaxed);
+    if (count < samples) {
+        overruns_.fetch_add(samples - count, std::memory_order_relaxed);
+    }
+}
+
+} /* namespace ft2232h_spi */
@@ -0,0 +1,128 @@
+/* spi-stream.h
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef FT2232H_SPI_SPI_STREAM_H
+#define FT2232H_SPI_SPI_STREAM_H
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <future>
+#include <thread>
+#include <vector>
+
+#include "ft2232h-spi/ft2232h-spi.h"
+
+namespace ft2232h_spi
+{
+
+/*
+ * Reads fixed-size samples from a device such as a SPI ADC back to back.
+ * Every sample is one chip-select frame that clocks command out (zero
+ * padded to sample_size) while clocking sample_size bytes in, followed by
+ * an on-device delay of interval, so the sample period is set by the
+ * MPSSE rather than the host.
+ *
+ * A feeder thread keeps several batches of sample frames queued with
+ * executeAsync(), so the adapter always has the next batch to work on
+ * while the last one's reply is copied out. Samples go into a lock-free
+ * ring with a single producer (the feeder) and a single consumer (the
+ * thread calling read()).
+ *
+ * Two things are counted rather than stalling anything. An overrun is a
+ * sample dropped because the ring was full. A gap is a point where every
+ * queued batch had completed before the feeder could queue another, so
+ * the sample period was broken.
+ */
+class spi_stream
+{
+public:
+    static constexpr size_t default_ring_samples = 1 << 16;
+    static constexpr size_t default_batch_samples = 256;
+    static constexpr size_t default_batches = 4;
+
+    /* dev must outlive the spi_stream and not be used while it runs. */
+    spi_stream(
+        spi& dev, size_t sample_size,
+        const std::vector<uint8_t>& command = {},
+        std::chrono::nanoseconds interval = std::chrono::nanoseconds(0),
+        size_t ring_samples = default_ring_samples,
+        size_t batch_samples = default_batch_samples,
+        size_t batches = default_batches);
+    ~spi_stream();
+
+    spi_stream(const spi_stream&) = delete;
+    spi_stream& operator=(const spi_stream&) = delete;
+
+    void start();
+
+    /*
+     * Stop queueing, wait for what is in flight and join the feeder.
+     * Rethrows whatever stopped the stream early, if anything did.
+     */
+    void stop();
+
+    /* False once stopped, or if the device failed. */
+    bool running() const { return running_; }
+
+    /*
+     * Copy up to max_samples whole samples into samples and return how
+     * many were copied. Never blocks; call from one thread only.
+     */
+    size_t read(uint8_t *samples, size_t max_samples);
+
+    /* Samples waiting to be read. */
+    size_t available() const;
+
+    size_t sampleSize() const { return sample_size_; }
+    uint64_t samples() const { return samples_; }
+    uint64_t overruns() const { return overruns_; }
+    uint64_t gaps() const { return gaps_; }
+
+private:
+    struct slot
+    {
+        std::vector<uint8_t> rx;
+        spi::batch b;
+        std::future<void> done;
+    };
+
+    void feed();
+    void push(const uint8_t *data, size_t samples);
+
+    spi& dev_;
+    size_t sample_size_;
+    std::vector<uint8_t> tx_;
+    std::vector<slot> slots_;
+
+    std::vector<uint8_t> ring_;
+    size_t capacity_;
+    std::atomic<size_t> head_ { 0 };
+    std::atomic<size_t> tail_ { 0 };
+
+    std::atomic<uint64_t> samples_ { 0 };
+    std::atomic<uint64_t> overruns_ { 0 };
+    std::atomic<uint64_t> gaps_ { 0 };
+
+    std::atomic<bool> running_ { false };
+    std::atomic<bool> stopping_ { false };
+    std::exception_ptr failure_;
+    std::thread feeder_;
+};
+
+} /* namespace ft2232h_spi */
+
+#endif /* FT2232H_SPI_SPI_STREAM_H */
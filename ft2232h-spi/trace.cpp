@@ -0,0 +1,330 @@
+/* trace.cpp
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <sstream>
+
+namespace ft2232h_spi {
+
+namespace {
+
+/* How long the flush thread sleeps when the ring is empty. */
+constexpr auto flush_interval = std::chrono::milliseconds(1);
+
+uint64_t nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+size_t roundUpToPowerOfTwo(size_t n)
+{
+    size_t result = 1;
+    while (result < n) {
+        result <<= 1;
+    }
+    return result;
+}
+
+}
+
+constexpr size_t trace_transport::default_ring_size;
+
+class trace_transport::traced_read : public transport::pending
+{
+public:
+    traced_read(
+        trace_transport *owner, std::unique_ptr<pending> inner,
+        uint8_t *data, size_t size) :
+            owner(owner),
+            inner(std::move(inner)),
+            data(data),
+            size(size)
+    { }
+
+    size_t wait() override
+    {
+        size_t rc = inner->wait();
+        owner->record(trace_event::read, data, size, rc);
+        return rc;
+    }
+
+private:
+    trace_transport *owner;
+    std::unique_ptr<pending> inner;
+    uint8_t *data;
+    size_t size;
+};
+
+trace_transport::trace_transport(
+    std::unique_ptr<transport>&& inner, const std::string& path,
+    size_t ring_size) :
+        file_(std::fopen(path.c_str(), "wb")),
+        start_ns_(nowNs()),
+        ring_(roundUpToPowerOfTwo(ring_size)),
+        mask_(ring_.size() - 1)
+{
+    if (!file_) {
+        throw error(WHEN("can't open trace file ") + path);
+    }
+    if (std::fwrite(trace_magic, sizeof(trace_magic), 1, file_) != 1 ||
+        std::fwrite(&trace_version, sizeof(trace_version), 1, file_) != 1)
+    {
+        std::fclose(file_);
+        throw error(WHEN("can't write trace file ") + path);
+    }
+
+    inner_ = std::move(inner);
+    flusher_ = std::thread { [this]() { flushLoop(); } };
+}
+
+trace_transport::~trace_transport()
+{
+    stop();
+}
+
+void trace_transport::write(const uint8_t *data, size_t size)
+{
+    inner_->write(data, size);
+    record(trace_event::write, data, size, size);
+}
+
+size_t trace_transport::read(uint8_t *data, size_t size)
+{
+    size_t rc = inner_->read(data, size);
+    record(trace_event::read, data, size, rc);
+    return rc;
+}
+
+std::unique_ptr<transport::pending> trace_transport::submitWrite(
+    const uint8_t *data, size_t size)
+{
+    auto result = inner_->submitWrite(data, size);
+    record(trace_event::write, data, size, size);
+    return result;
+}
+
+std::unique_ptr<transport::pending> trace_transport::submitRead(
+    uint8_t *data, size_t size)
+{
+    return std::unique_ptr<pending> {
+        new traced_read { this, inner_->submitRead(data, size), data, size }
+    };
+}
+
+bool trace_transport::overlappedReads() const
+{
+    return inner_->overlappedReads();
+}
+
+void trace_transport::setLatencyTimer(uint8_t ms)
+{
+    inner_->setLatencyTimer(ms);
+}
+
+void trace_transport::setChunkSizes(uint32_t write_chunk, uint32_t read_chunk)
+{
+    inner_->setChunkSizes(write_chunk, read_chunk);
+}
+
+void trace_transport::reset()
+{
+    inner_->reset();
+}
+
+std::unique_ptr<transport> trace_transport::release()
+{
+    stop();
+    return std::move(inner_);
+}
+
+void trace_transport::record(
+    trace_event event, const uint8_t *data, uint32_t requested, uint32_t size)
+{
+    trace_record_header header {};
+    header.event = event;
+    header.requested = requested;
+    header.size = size;
+    header.time_ns = nowNs() - start_ns_;
+
+    size_t head = head_.load(std::memory_order_relaxed);
+    size_t tail = tail_.load(std::memory_order_acquire);
+    size_t needed = sizeof(header) + size;
+    if (needed > ring_.size() - (head - tail)) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    push(&header, sizeof(header), head);
+    push(data, size, head + sizeof(header));
+    head_.store(head + needed, std::memory_order_release);
+}
+
+void trace_transport::push(const void *data, size_t size, size_t head)
+{
+    if (size == 0) {
+        return;
+    }
+
+    size_t offset = head & mask_;
+    size_t first = std::min(size, ring_.size() - offset);
+    memcpy(&ring_[offset], data, first);
+    memcpy(&ring_[0], static_cast<const uint8_t*>(data) + first, size - first);
+}
+
+void trace_transport::flushLoop()
+{
+    for (;;) {
+        bool stopping = stopping_.load(std::memory_order_acquire);
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        size_t head = head_.load(std::memory_order_acquire);
+
+        if (head == tail) {
+            if (stopping) {
+                return;
+            }
+            std::this_thread::sleep_for(flush_interval);
+            continue;
+        }
+
+        /* After a failed write, keep draining so recording never stalls. */
+        size_t offset = tail & mask_;
+        size_t size = std::min(head - tail, ring_.size() - offset);
+        if (!failed_.load(std::memory_order_relaxed) &&
+            std::fwrite(&ring_[offset], 1, size, file_) != size)
+        {
+            failed_.store(true, std::memory_order_relaxed);
+        }
+        tail_.store(tail + size, std::memory_order_release);
+    }
+}
+
+void trace_transport::stop()
+{
+    if (!flusher_.joinable()) {
+        return;
+    }
+    stopping_.store(true, std::memory_order_release);
+    flusher_.join();
+    if (std::fclose(file_) != 0) {
+        failed_ = true;
+    }
+    file_ = nullptr;
+}
+
+trace_reader::trace_reader(const std::string& path) :
+    file_(std::fopen(path.c_str(), "rb"))
+{
+    if (!file_) {
+        throw error(WHEN("can't open trace file ") + path);
+    }
+
+    char magic[sizeof(trace_magic)];
+    uint32_t version = 0;
+    if (std::fread(magic, sizeof(magic), 1, file_) != 1 ||
+        std::fread(&version, sizeof(version), 1, file_) != 1 ||
+        memcmp(magic, trace_magic, sizeof(magic)) != 0 ||
+        version != trace_version)
+    {
+        std::fclose(file_);
+        throw error(WHEN("not a version 1 trace file: ") + path);
+    }
+}
+
+trace_reader::~trace_reader()
+{
+    std::fclose(file_);
+}
+
+bool trace_reader::next(trace_record& r)
+{
+    trace_record_header header;
+    if (std::fread(&header, sizeof(header), 1, file_) != 1) {
+        return false;
+    }
+
+    r.event = header.event;
+    r.requested = header.requested;
+    r.time_ns = header.time_ns;
+    r.data.resize(header.size);
+    if (header.size > 0 &&
+        std::fread(r.data.data(), header.size, 1, file_) != 1)
+    {
+        throw error(WHEN("trace file is truncated."));
+    }
+    return true;
+}
+
+replay_result replay(const std::string& path, transport& io, replay_speed speed)
+{
+    trace_reader reader { path };
+    trace_record r;
+    replay_result result {};
+    std::vector<uint8_t> buffer;
+
+    auto start = std::chrono::steady_clock::now();
+    while (reader.next(r)) {
+        if (speed == replay_speed::original) {
+            std::this_thread::sleep_until(
+                start + std::chrono::nanoseconds(r.time_ns)
+            );
+        }
+
+        if (r.event == trace_event::write) {
+            io.write(r.data.data(), r.data.size());
+            ++result.writes;
+            result.bytes_written += r.data.size();
+            continue;
+        }
+
+        /*
+         * Reads that came back empty are replayed as one read of the same
+         * size, so timeouts cost what they did originally. Others read
+         * until as much data as was recorded has arrived.
+         */
+        ++result.reads;
+        buffer.resize(std::max<size_t>(r.requested, r.data.size()));
+        size_t got = 0;
+        if (r.data.empty()) {
+            got = io.read(buffer.data(), r.requested);
+        } else {
+            int empty_reads = 0;
+            while (got < r.data.size() && empty_reads <= max_empty_reads) {
+                size_t rc = io.read(buffer.data() + got, r.data.size() - got);
+                empty_reads = rc == 0 ? empty_reads + 1 : 0;
+                got += rc;
+            }
+        }
+        result.bytes_read += got;
+
+        if (got != r.data.size() ||
+            memcmp(buffer.data(), r.data.data(), got) != 0)
+        {
+            ++result.mismatches;
+        }
+    }
+
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    result.seconds = elapsed.count();
+    return result;
+}
+
+} /* namespace ft2232h_spi */
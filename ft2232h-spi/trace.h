@@ -0,0 +1,183 @@
+/* trace.h
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef FT2232H_SPI_TRACE_H
+#define FT2232H_SPI_TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ft2232h-spi/transport.h"
+
+namespace ft2232h_spi
+{
+
+/*
+ * Trace files start with an 8 byte magic and a 32-bit version, followed
+ * by one record per transport call: a trace_record_header and then
+ * header.size bytes of data, all in host byte order. Times are in
+ * nanoseconds since the trace was started.
+ */
+constexpr char trace_magic[8] = { 'F', 'T', 'S', 'P', 'I', 'T', 'R', 'C' };
+constexpr uint32_t trace_version = 1;
+
+enum class trace_event : uint8_t {
+    write = 1,
+    read = 2
+};
+
+struct trace_record_header
+{
+    trace_event event;
+    uint8_t reserved[3];
+
+    /* For reads, how much was asked for; size is how much arrived. */
+    uint32_t requested;
+    uint32_t size;
+    uint32_t reserved2;
+    uint64_t time_ns;
+};
+
+struct trace_record
+{
+    trace_event event;
+    uint32_t requested;
+    uint64_t time_ns;
+    std::vector<uint8_t> data;
+};
+
+/*
+ * Wraps another transport and records every write and read passing
+ * through it, see spi::startTrace(). Records are copied into a lock-free
+ * ring and written to the file by a background thread, so the I/O path
+ * never waits on the disk. If the ring fills up, records are dropped and
+ * counted rather than stalling the device.
+ *
+ * The ring has a single producer: calls into the transport must not
+ * overlap, which spi guarantees.
+ */
+class trace_transport : public transport
+{
+public:
+    static constexpr size_t default_ring_size = 4 << 20;
+
+    /* inner is only taken over once the trace file has been created. */
+    trace_transport(
+        std::unique_ptr<transport>&& inner, const std::string& path,
+        size_t ring_size = default_ring_size);
+    ~trace_transport();
+
+    void write(const uint8_t *data, size_t size) override;
+    size_t read(uint8_t *data, size_t size) override;
+    std::unique_ptr<pending> submitWrite(
+        const uint8_t *data, size_t size) override;
+    std::unique_ptr<pending> submitRead(uint8_t *data, size_t size) override;
+    bool overlappedReads() const override;
+    void setLatencyTimer(uint8_t ms) override;
+    void setChunkSizes(uint32_t write_chunk, uint32_t read_chunk) override;
+    void reset() override;
+
+    /* Records that didn't fit in the ring. */
+    uint64_t dropped() const { return dropped_; }
+
+    /*
+     * Whether writing to the trace file has failed, e.g. because the disk
+     * filled up. Everything recorded from then on is discarded, so the
+     * file is incomplete.
+     */
+    bool failed() const { return failed_; }
+
+    /*
+     * Finish writing the trace and hand back the wrapped transport. The
+     * trace_transport is unusable afterwards. Check failed() afterwards:
+     * this also covers the final flush and close of the file.
+     */
+    std::unique_ptr<transport> release();
+
+private:
+    class traced_read;
+
+    void record(
+        trace_event event, const uint8_t *data, uint32_t requested,
+        uint32_t size);
+    void push(const void *data, size_t size, size_t head);
+    void flushLoop();
+    void stop();
+
+    std::unique_ptr<transport> inner_;
+    std::FILE *file_;
+    uint64_t start_ns_;
+
+    std::vector<uint8_t> ring_;
+    size_t mask_;
+    std::atomic<size_t> head_ { 0 };
+    std::atomic<size_t> tail_ { 0 };
+    std::atomic<uint64_t> dropped_ { 0 };
+    std::atomic<bool> stopping_ { false };
+    std::atomic<bool> failed_ { false };
+    std::thread flusher_;
+};
+
+/* Reads a trace file back one record at a time. */
+class trace_reader
+{
+public:
+    explicit trace_reader(const std::string& path);
+    ~trace_reader();
+
+    /* Fetch the next record; false at the end of the trace. */
+    bool next(trace_record& r);
+
+private:
+    std::FILE *file_;
+};
+
+enum class replay_speed {
+    /* Wait between records to reproduce the original timing. */
+    original,
+    /* Issue records back to back. */
+    maximum
+};
+
+struct replay_result
+{
+    uint64_t writes;
+    uint64_t reads;
+    uint64_t bytes_written;
+    uint64_t bytes_read;
+
+    /* Reads whose data differed from, or fell short of, the recording. */
+    uint64_t mismatches;
+    double seconds;
+};
+
+/*
+ * Send the writes in a trace to io and perform its reads, comparing what
+ * comes back with what was recorded. io should be in the state the
+ * traced device was in when the trace started, e.g. freshly opened.
+ */
+replay_result replay(
+    const std::string& path, transport& io,
+    replay_speed speed = replay_speed::maximum);
+
+} /* namespace ft2232h_spi */
+
+#endif /* FT2232H_SPI_TRACE_H */
@@ -0,0 +1,78 @@
+/* transport.cpp
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "transport.h"
+
+#include <sstream>
+
+namespace ft2232h_spi {
+
+namespace {
+
+class finished : public transport::pending
+{
+public:
+    finished(size_t size) :
+        size(size)
+    { }
+
+    size_t wait() override { return size; }
+
+private:
+    size_t size;
+};
+
+}
+
+transport::pending::~pending()
+{
+}
+
+transport::~transport()
+{
+}
+
+std::unique_ptr<transport::pending> transport::submitWrite(
+    const uint8_t *data, size_t size)
+{
+    write(data, size);
+    return std::unique_ptr<pending> { new finished { size } };
+}
+
+std::unique_ptr<transport::pending> transport::submitRead(
+    uint8_t *data, size_t size)
+{
+    size_t got = 0;
+    int empty_reads = 0;
+    while (got < size) {
+        size_t rc = read(data + got, size - got);
+        if (rc == 0 && ++empty_reads > max_empty_reads) {
+            std::ostringstream what;
+            what << WHEN()
+                 << "expected " << size << " byte reply but got "
+                 << got << " bytes.";
+            throw error(what.str());
+        }
+        if (rc > 0) {
+            empty_reads = 0;
+        }
+        got += rc;
+    }
+    return std::unique_ptr<pending> { new finished { got } };
+}
+
+} /* namespace ft2232h_spi */
@@ -0,0 +1,106 @@
+/* transport.h
+ * Copyright (C) 2017 Tim Prince
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef FT2232H_SPI_TRANSPORT_H
+#define FT2232H_SPI_TRANSPORT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "ft2232h-spi/ft2232h-spi.h"
+
+namespace ft2232h_spi
+{
+
+/*
+ * How many reads in a row may come back empty before a reply is given
+ * up on, by spi, the default submitRead() and trace replay alike.
+ */
+constexpr int max_empty_reads = 64;
+
+/*
+ * Moves raw MPSSE command and reply bytes between spi and whatever sits
+ * behind it: a real FT2232H channel, an emulator or a recording stub.
+ * Implementations report failures by throwing error.
+ */
+class transport
+{
+public:
+    /* An I/O operation that has been started but not yet finished. */
+    class pending
+    {
+    public:
+        virtual ~pending();
+
+        /* Block until the operation finishes; returns bytes transferred. */
+        virtual size_t wait() = 0;
+    };
+
+    virtual ~transport();
+
+    /* Write every byte of data or throw. */
+    virtual void write(const uint8_t *data, size_t size) = 0;
+
+    /*
+     * Read up to size bytes of reply data, returning how many arrived. A
+     * return of 0 means nothing turned up within the transport's timeout.
+     */
+    virtual size_t read(uint8_t *data, size_t size) = 0;
+
+    /*
+     * Start a write or a read without waiting for it. The buffer must
+     * stay valid until wait() returns. A read only completes once size
+     * bytes have arrived. The default implementations do the I/O
+     * synchronously and hand back an already finished operation.
+     */
+    virtual std::unique_ptr<pending> submitWrite(
+        const uint8_t *data, size_t size);
+    virtual std::unique_ptr<pending> submitRead(uint8_t *data, size_t size);
+
+    /*
+     * Whether more than one submitted read may be outstanding at a time.
+     * libftdi, for one, keeps leftover read data in its context.
+     */
+    virtual bool overlappedReads() const { return false; }
+
+    /*
+     * USB tuning, see spi::usb_settings. Transports that have no such
+     * notion accept and ignore these.
+     */
+    virtual void setLatencyTimer(uint8_t /* ms */) { }
+    virtual void setChunkSizes(
+        uint32_t /* write_chunk */, uint32_t /* read_chunk */) { }
+
+    /*
+     * Abandon whatever the MPSSE is doing, e.g. a wait-on-GPIO command
+     * that will never be satisfied, discard anything buffered in either
+     * direction and put the channel back into MPSSE mode. Its settings
+     * must be assumed lost.
+     */
+    virtual void reset() { }
+};
+
+/*
+ * Open the given channel of the first adapter matching ep and put it in
+ * MPSSE mode. Provided by the USB backend the library was built with.
+ */
+std::unique_ptr<transport> openTransport(
+    const endpoint& ep, spi::busses bus);
+
+} /* namespace ft2232h_spi */
+
+#endif /* FT2232H_SPI_TRANSPORT_H */